@@ -0,0 +1,229 @@
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "append.h"
+#include "util.h"
+#include "header.h"
+#include "codec.h"
+#include "blockio.h"
+#include "index.h"
+#include "pax.h"
+
+struct member_time {
+    char *path;
+    unsigned int hash;
+    time_t mtime;
+    struct member_time *next;
+};
+
+struct archived {
+    struct member_time **buckets;
+    size_t numBuckets;
+    size_t count;
+};
+
+/* FNV-1a, same as the directory cache */
+static unsigned int hash_path(const char *path) {
+    unsigned int h = 2166136261u;
+
+    for(; *path; path++) {
+        h ^= (unsigned char)*path;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static struct member_time *find(struct archived *a, const char *path,
+                                unsigned int hash) {
+    struct member_time *e;
+
+    for(e = a -> buckets[hash % a -> numBuckets]; e; e = e -> next) {
+        if(e -> hash == hash && !strcmp(e -> path, path)) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void grow(struct archived *a) {
+    size_t n = a -> numBuckets * 2, i;
+    struct member_time **buckets = calloc(n, sizeof(struct member_time *));
+
+    if(!buckets) {
+        perror("Couldn't calloc member table");
+        exit(EXIT_FAILURE);
+    }
+    for(i = 0; i < a -> numBuckets; i++) {
+        struct member_time *e = a -> buckets[i], *next;
+
+        for(; e; e = next) {
+            next = e -> next;
+            e -> next = buckets[e -> hash % n];
+            buckets[e -> hash % n] = e;
+        }
+    }
+    free(a -> buckets);
+    a -> buckets = buckets;
+    a -> numBuckets = n;
+}
+
+struct archived *archived_open(void) {
+    struct archived *a = calloc(1, sizeof(struct archived));
+
+    if(!a || !(a -> buckets = calloc(APPEND_START_BUCKETS,
+                                     sizeof(struct member_time *)))) {
+        perror("Couldn't calloc member table");
+        exit(EXIT_FAILURE);
+    }
+    a -> numBuckets = APPEND_START_BUCKETS;
+    return a;
+}
+
+/* Records a member; with several copies of a path the newest counts */
+static void archived_add(struct archived *a, const char *path,
+                         time_t mtime) {
+    unsigned int hash = hash_path(path);
+    struct member_time *e;
+
+    if((e = find(a, path, hash))) {
+        if(mtime > e -> mtime) {
+            e -> mtime = mtime;
+        }
+        return;
+    }
+
+    if(!(e = malloc(sizeof(struct member_time))) ||
+       !(e -> path = strdup(path))) {
+        perror("Couldn't malloc member table entry");
+        exit(EXIT_FAILURE);
+    }
+    e -> hash = hash;
+    e -> mtime = mtime;
+    e -> next = a -> buckets[hash % a -> numBuckets];
+    a -> buckets[hash % a -> numBuckets] = e;
+
+    if(++a -> count > a -> numBuckets * 2) {
+        grow(a);
+    }
+}
+
+/* Nonzero if path isn't in the archive yet, or only older copies are */
+int archived_newer(struct archived *a, const char *path, time_t mtime) {
+    struct member_time *e = find(a, path, hash_path(path));
+
+    return !e || mtime > e -> mtime;
+}
+
+void archived_close(struct archived *a) {
+    size_t i;
+
+    for(i = 0; i < a -> numBuckets; i++) {
+        struct member_time *e = a -> buckets[i], *next;
+
+        for(; e; e = next) {
+            next = e -> next;
+            free(e -> path);
+            free(e);
+        }
+    }
+    free(a -> buckets);
+    free(a);
+}
+
+/* Returns the offset of the end of archive blocks in the archive open on
+ * fd, which is where new members go. The members already there are
+ * added to *index, which is started here if the archive has a current
+ * index of its own, and to seen if that isn't NULL. */
+off_t append_find_end(int fd, const char *archiveName, size_t recordSize,
+                      struct idx_builder **index, struct archived *seen) {
+    struct archive_io *in;
+    struct stat sb;
+    struct idx *x;
+    off_t end, last = 0;
+    int fromIndex = 0;
+    long i;
+
+    if(fstat(fd, &sb) == -1) {
+        perror("Couldn't stat archive");
+        exit(errno);
+    }
+    in = aio_open_reader(fd, recordSize);
+    if(in -> decomp) {
+        fprintf(stderr, "Can't append to a compressed archive\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* A current index already lists every member, so only the headers of
+     * the last one need reading */
+    if((x = idx_open(archiveName, fd))) {
+        if(!*index) {
+            *index = idx_begin();
+        }
+        for(i = 0; i < idx_count(x); i++) {
+            const char *name;
+            const struct idx_entry *e = idx_get(x, i, &name);
+
+            idx_add(*index, name, e -> headerOffset, e -> size, e -> type,
+                    e -> mtime);
+            if(seen) {
+                archived_add(seen, name, e -> mtime);
+            }
+            if((off_t)e -> headerOffset > last) {
+                last = e -> headerOffset;
+            }
+        }
+        idx_close(x);
+        aio_seek(in, last);
+        fromIndex = 1;
+    }
+
+    for(;;) {
+        off_t offset = in -> offset;
+        const struct header *h;
+        struct hdr_info info;
+        struct pax_info px;
+        int status;
+
+        /* Some writers leave off the end of archive blocks */
+        if(!(h = aio_next(in, AIO_BLOCK))) {
+            end = offset;
+            break;
+        }
+
+        /* Anything after an extended header with no member is dropped */
+        status = pax_decode(in, &h, &info, &px);
+        if(status == HDR_ZERO) {
+            end = offset;
+            break;
+        }
+        if(status == HDR_BAD) {
+            fprintf(stderr, "Archive is corrupted! Exiting.");
+            exit(EXIT_FAILURE);
+        }
+
+        if(!fromIndex || offset != last) {
+            if(*index) {
+                idx_add(*index, info.path, offset,
+                        px.sparse ? px.realSize : info.size, info.type,
+                        info.mtime);
+            }
+            if(seen) {
+                archived_add(seen, info.path, info.mtime);
+            }
+        }
+        if(info.size > 0) {
+            aio_skip(in, AIO_PADDED(info.size));
+        }
+    }
+
+    aio_close(in);
+    if(end > sb.st_size) {
+        fprintf(stderr, "Archive is truncated! Exiting.");
+        exit(EXIT_FAILURE);
+    }
+    return end;
+}
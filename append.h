@@ -0,0 +1,28 @@
+#ifndef APPEND_H
+#define APPEND_H
+
+#include <sys/types.h>
+#include <time.h>
+
+/* Support for adding members to an existing archive ('r', 'u'). New
+ * members go where the end of archive blocks are, which are found from
+ * the sidecar index when there is a current one and by walking the
+ * headers (skipping the bodies) otherwise. */
+
+#define APPEND_START_BUCKETS 1024
+
+struct idx_builder;
+
+/* Newest mtime of each member already in the archive, for 'u' */
+struct archived;
+
+struct archived *archived_open(void);
+
+int archived_newer(struct archived *a, const char *path, time_t mtime);
+
+void archived_close(struct archived *a);
+
+off_t append_find_end(int fd, const char *archiveName, size_t recordSize,
+                      struct idx_builder **index, struct archived *seen);
+
+#endif
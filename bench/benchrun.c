@@ -0,0 +1,274 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/ptrace.h>
+
+/* Runs one command and prints what it cost as a single line of JSON:
+ * wall, user and system time, peak RSS, context switches, and the kernel's
+ * I/O accounting for it (/proc/<pid>/io, read before the child is reaped,
+ * so every thread is counted). Rates are over the members given with -n
+ * and the size of the file given with -s, taken once the command is done.
+ * Each -t key=value is copied into the line as a string. The command's
+ * own output goes to /dev/null.
+ *
+ * Counting system calls means stopping the command at every one, which
+ * would swamp the timings, so that is a run of its own: with -c the
+ * command runs under ptrace() and only the number of system calls made by
+ * all of its threads is printed. -S puts that number in a timed run's
+ * line. */
+
+#define USAGE "Usage: benchrun [ -c ] [ -C dir ] [ -n members ] " \
+    "[ -s file ] [ -S syscalls ] [ -t key=value ... ] " \
+    "-- command [ arg ... ]\n"
+
+#define MAX_TAGS 32
+#define IO_LINE_SIZE 128
+#define MB (1024.0 * 1024.0)
+
+/* Counters from /proc/<pid>/io; -1 where the kernel doesn't keep them */
+struct io_counts {
+    long long syscr;
+    long long syscw;
+    long long rchar;
+    long long wchar;
+    long long readBytes;
+    long long writeBytes;
+};
+
+static void read_io(pid_t pid, struct io_counts *io) {
+    char name[64], line[IO_LINE_SIZE];
+    FILE *f;
+
+    io -> syscr = io -> syscw = io -> rchar = io -> wchar = -1;
+    io -> readBytes = io -> writeBytes = -1;
+
+    snprintf(name, sizeof(name), "/proc/%d/io", (int)pid);
+    if(!(f = fopen(name, "r"))) {
+        return;
+    }
+    while(fgets(line, sizeof(line), f)) {
+        sscanf(line, "syscr: %lld", &io -> syscr);
+        sscanf(line, "syscw: %lld", &io -> syscw);
+        sscanf(line, "rchar: %lld", &io -> rchar);
+        sscanf(line, "wchar: %lld", &io -> wchar);
+        sscanf(line, "read_bytes: %lld", &io -> readBytes);
+        sscanf(line, "write_bytes: %lld", &io -> writeBytes);
+    }
+    fclose(f);
+}
+
+/* Prints s as a JSON string */
+static void put_string(const char *s) {
+    putchar('"');
+    for(; *s; s++) {
+        if(*s == '"' || *s == '\\') {
+            putchar('\\');
+            putchar(*s);
+        }
+        else if((unsigned char)*s < ' ') {
+            printf("\\u%04x", (unsigned char)*s);
+        }
+        else {
+            putchar(*s);
+        }
+    }
+    putchar('"');
+}
+
+/* Starts argv in dir with its output thrown away, stopped for tracing
+ * first if traceBool */
+static pid_t start_command(char **argv, const char *dir, int traceBool) {
+    pid_t pid;
+
+    fflush(stdout);
+    if((pid = fork()) == -1) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    if(!pid) {
+        int devNull = open("/dev/null", O_WRONLY);
+
+        if(devNull == -1 || dup2(devNull, STDOUT_FILENO) == -1) {
+            perror("/dev/null");
+            _exit(127);
+        }
+        if(dir && chdir(dir)) {
+            perror(dir);
+            _exit(127);
+        }
+        if(traceBool && (ptrace(PTRACE_TRACEME, 0, NULL, NULL) == -1 ||
+                         raise(SIGSTOP))) {
+            perror("ptrace");
+            _exit(127);
+        }
+        execvp(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+    return pid;
+}
+
+/* Runs argv under ptrace() and returns how many system calls it and its
+ * threads entered */
+static long long count_syscalls(char **argv, const char *dir) {
+    long opts = PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE |
+                PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK |
+                PTRACE_O_TRACEEXEC | PTRACE_O_EXITKILL;
+    pid_t pid = start_command(argv, dir, 1), tid;
+    long long count = 0;
+    int status;
+
+    if(waitpid(pid, &status, 0) == -1 || !WIFSTOPPED(status) ||
+       ptrace(PTRACE_SETOPTIONS, pid, NULL, (void *)opts) == -1 ||
+       ptrace(PTRACE_SYSCALL, pid, NULL, NULL) == -1) {
+        perror("ptrace");
+        exit(EXIT_FAILURE);
+    }
+
+    while((tid = waitpid(-1, &status, __WALL)) != -1) {
+        int sig = 0;
+
+        if(!WIFSTOPPED(status)) {
+            continue;
+        }
+        if(WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+            struct __ptrace_syscall_info info;
+
+            if(ptrace(PTRACE_GET_SYSCALL_INFO, tid, (void *)sizeof(info),
+                      &info) > 0 && info.op == PTRACE_SYSCALL_INFO_ENTRY) {
+                count++;
+            }
+        }
+        /* New threads start stopped, and events stop with SIGTRAP; only
+         * real signals get passed on */
+        else if(WSTOPSIG(status) != SIGSTOP && !(status >> 16) &&
+                WSTOPSIG(status) != SIGTRAP) {
+            sig = WSTOPSIG(status);
+        }
+        ptrace(PTRACE_SYSCALL, tid, NULL, (void *)(long)sig);
+    }
+    if(errno != ECHILD) {
+        perror("waitpid");
+        exit(EXIT_FAILURE);
+    }
+    return count;
+}
+
+static double seconds(struct timeval tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+    const char *dir = NULL, *sizeFile = NULL, *tags[MAX_TAGS];
+    long long members = 0, size = -1, syscalls = -1;
+    int numTags = 0, countBool = 0, i, status;
+    struct timespec start, end;
+    struct io_counts io;
+    struct rusage ru;
+    struct stat sb;
+    siginfo_t si;
+    double wall;
+    pid_t pid;
+
+    for(i = 1; i < argc && strcmp(argv[i], "--"); i++) {
+        if(!strcmp(argv[i], "-c")) {
+            countBool = 1;
+            continue;
+        }
+        if(i + 1 == argc) {
+            fprintf(stderr, USAGE);
+            exit(EXIT_FAILURE);
+        }
+        if(!strcmp(argv[i], "-C")) {
+            dir = argv[++i];
+        }
+        else if(!strcmp(argv[i], "-n")) {
+            members = strtoll(argv[++i], NULL, 10);
+        }
+        else if(!strcmp(argv[i], "-s")) {
+            sizeFile = argv[++i];
+        }
+        else if(!strcmp(argv[i], "-S")) {
+            syscalls = strtoll(argv[++i], NULL, 10);
+        }
+        else if(!strcmp(argv[i], "-t") && numTags < MAX_TAGS &&
+                strchr(argv[i + 1], '=')) {
+            tags[numTags++] = argv[++i];
+        }
+        else {
+            fprintf(stderr, USAGE);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if(++i >= argc) {
+        fprintf(stderr, USAGE);
+        exit(EXIT_FAILURE);
+    }
+
+    if(countBool) {
+        printf("%lld\n", count_syscalls(argv + i, dir));
+        return 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid = start_command(argv + i, dir, 0);
+
+    /* Wait without reaping, so its /proc entry is still there */
+    while(waitid(P_PID, pid, &si, WEXITED | WNOWAIT)) {
+        if(errno != EINTR) {
+            perror("waitid");
+            exit(EXIT_FAILURE);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    read_io(pid, &io);
+    if(wait4(pid, &status, 0, &ru) == -1) {
+        perror("wait4");
+        exit(EXIT_FAILURE);
+    }
+
+    wall = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if(sizeFile && !stat(sizeFile, &sb)) {
+        size = sb.st_size;
+    }
+
+    putchar('{');
+    for(i = 0; i < numTags; i++) {
+        const char *eq = strchr(tags[i], '=');
+        char *key = strndup(tags[i], eq - tags[i]);
+
+        put_string(key);
+        putchar(':');
+        put_string(eq + 1);
+        printf(", ");
+        free(key);
+    }
+    printf("\"exit\":%d, \"wallSec\":%.6f, \"userSec\":%.6f, "
+           "\"sysSec\":%.6f, ",
+           WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status),
+           wall, seconds(ru.ru_utime), seconds(ru.ru_stime));
+    printf("\"files\":%lld, \"filesPerSec\":%.1f, \"bytes\":%lld, "
+           "\"mbPerSec\":%.2f, ",
+           members, wall > 0 ? members / wall : 0, size,
+           wall > 0 && size >= 0 ? size / MB / wall : 0);
+    printf("\"maxRssKb\":%ld, \"volCtxSw\":%ld, \"involCtxSw\":%ld, ",
+           ru.ru_maxrss, ru.ru_nvcsw, ru.ru_nivcsw);
+    printf("\"syscalls\":%lld, \"readSyscalls\":%lld, \"writeSyscalls\":%lld, "
+           "\"readChars\":%lld, \"writeChars\":%lld, "
+           "\"diskReadBytes\":%lld, \"diskWriteBytes\":%lld}\n",
+           syscalls, io.syscr, io.syscw, io.rchar, io.wchar, io.readBytes,
+           io.writeBytes);
+
+    return !WIFEXITED(status) || WEXITSTATUS(status);
+}
@@ -0,0 +1,264 @@
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* Builds the synthetic trees the benchmarks archive. The contents come
+ * from a fixed seed, so the same profile and count always give the same
+ * tree. On success prints "<members> <bytes>": how many members an archive
+ * of the tree has (the root included) and the total size of its regular
+ * files, holes and all. */
+
+#define USAGE "Usage: gentree dir tiny|huge|deep|sparse|links [ count ]\n"
+
+#define DIR_PERMS (S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH)
+#define FILE_PERMS (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
+#define CHUNK (1024 * 1024)
+#define PATH_SIZE 4096
+#define SEED 0x9E3779B97F4A7C15ULL
+
+/* tiny: files of 1 to TINY_MAX bytes, TINY_PER_DIR to a directory */
+#define TINY_COUNT 1000000
+#define TINY_MAX 64
+#define TINY_PER_DIR 1000
+/* huge: a few files of HUGE_MB each */
+#define HUGE_COUNT 2
+#define HUGE_MB 512
+/* deep: chains of DEEP_LEVELS directories with long names, a file in
+ * each, so most paths need an extended header */
+#define DEEP_COUNT 64
+#define DEEP_LEVELS 48
+#define DEEP_NAME_LEN 24
+/* sparse: SPARSE_MB files holding SPARSE_DATA bytes every SPARSE_STRIDE */
+#define SPARSE_COUNT 8
+#define SPARSE_MB 1024
+#define SPARSE_DATA (64 * 1024)
+#define SPARSE_STRIDE (64 * 1024 * 1024)
+/* links: files with LINKS_EACH more names apiece, in another directory */
+#define LINKS_COUNT 10000
+#define LINKS_EACH 3
+#define LINKS_SIZE 4096
+
+struct tree {
+    uint64_t state;
+    char *buf;
+    long members;
+    int64_t bytes;
+};
+
+/* xorshift64* */
+static uint64_t next_rand(struct tree *t) {
+    t -> state ^= t -> state >> 12;
+    t -> state ^= t -> state << 25;
+    t -> state ^= t -> state >> 27;
+    return t -> state * 0x2545F4914F6CDD1DULL;
+}
+
+static void fill(struct tree *t, size_t n) {
+    size_t i;
+
+    for(i = 0; i < n; i += sizeof(uint64_t)) {
+        uint64_t r = next_rand(t);
+
+        memcpy(t -> buf + i, &r, n - i < sizeof(r) ? n - i : sizeof(r));
+    }
+}
+
+static void make_dir(struct tree *t, const char *path) {
+    if(mkdir(path, DIR_PERMS) && errno != EEXIST) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    t -> members++;
+}
+
+static int create(const char *path) {
+    int fd;
+
+    if((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, FILE_PERMS)) == -1) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+static void write_all(int fd, const char *buf, size_t n) {
+    ssize_t w;
+
+    for(; n; buf += w, n -= w) {
+        if((w = write(fd, buf, n)) == -1) {
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/* A file of size bytes, written CHUNK at a time */
+static void make_file(struct tree *t, const char *path, int64_t size) {
+    int fd = create(path);
+    int64_t left;
+
+    for(left = size; left > 0; left -= CHUNK) {
+        size_t n = left < CHUNK ? left : CHUNK;
+
+        fill(t, n);
+        write_all(fd, t -> buf, n);
+    }
+    close(fd);
+    t -> members++;
+    t -> bytes += size;
+}
+
+static void gen_tiny(struct tree *t, const char *dir, long count) {
+    char path[PATH_SIZE];
+    long i;
+
+    for(i = 0; i < count; i++) {
+        if(i % TINY_PER_DIR == 0) {
+            snprintf(path, sizeof(path), "%s/d%06ld", dir, i / TINY_PER_DIR);
+            make_dir(t, path);
+        }
+        snprintf(path, sizeof(path), "%s/d%06ld/f%06ld", dir,
+                 i / TINY_PER_DIR, i);
+        make_file(t, path, 1 + next_rand(t) % TINY_MAX);
+    }
+}
+
+static void gen_huge(struct tree *t, const char *dir, long count) {
+    char path[PATH_SIZE];
+    long i;
+
+    for(i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "%s/huge%02ld", dir, i);
+        make_file(t, path, (int64_t)HUGE_MB * 1024 * 1024);
+    }
+}
+
+static void gen_deep(struct tree *t, const char *dir, long count) {
+    size_t cap = strlen(dir) + (DEEP_LEVELS + 1) * (DEEP_NAME_LEN + 2) + 16;
+    char *path = malloc(cap);
+    long i;
+    int level;
+
+    if(!path) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for(i = 0; i < count; i++) {
+        size_t len = sprintf(path, "%s/chain%04ld", dir, i);
+
+        make_dir(t, path);
+        for(level = 0; level < DEEP_LEVELS; level++) {
+            len += sprintf(path + len, "/level%02d_%0*d", level,
+                           DEEP_NAME_LEN - 8, level);
+            make_dir(t, path);
+            sprintf(path + len, "/file");
+            make_file(t, path, 1 + next_rand(t) % TINY_MAX);
+        }
+    }
+    free(path);
+}
+
+static void gen_sparse(struct tree *t, const char *dir, long count) {
+    int64_t size = (int64_t)SPARSE_MB * 1024 * 1024, off;
+    char path[PATH_SIZE];
+    long i;
+
+    for(i = 0; i < count; i++) {
+        int fd;
+
+        snprintf(path, sizeof(path), "%s/sparse%02ld", dir, i);
+        fd = create(path);
+        for(off = 0; off < size; off += SPARSE_STRIDE) {
+            fill(t, SPARSE_DATA);
+            if(pwrite(fd, t -> buf, SPARSE_DATA, off) != SPARSE_DATA) {
+                perror("pwrite");
+                exit(EXIT_FAILURE);
+            }
+        }
+        if(ftruncate(fd, size)) {
+            perror("ftruncate");
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+        t -> members++;
+        t -> bytes += size;
+    }
+}
+
+static void gen_links(struct tree *t, const char *dir, long count) {
+    char path[PATH_SIZE], name[PATH_SIZE];
+    long i;
+    int j;
+
+    snprintf(path, sizeof(path), "%s/files", dir);
+    make_dir(t, path);
+    snprintf(path, sizeof(path), "%s/links", dir);
+    make_dir(t, path);
+    for(i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "%s/files/f%06ld", dir, i);
+        make_file(t, path, LINKS_SIZE);
+        for(j = 0; j < LINKS_EACH; j++) {
+            snprintf(name, sizeof(name), "%s/links/f%06ld_%d", dir, i, j);
+            if(link(path, name)) {
+                perror(name);
+                exit(EXIT_FAILURE);
+            }
+            t -> members++;
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    struct tree t;
+    const char *dir, *profile;
+    long count = 0;
+
+    if(argc < 3 || argc > 4) {
+        fprintf(stderr, USAGE);
+        exit(EXIT_FAILURE);
+    }
+    dir = argv[1];
+    profile = argv[2];
+    if(argc == 4 && (count = strtol(argv[3], NULL, 10)) <= 0) {
+        fprintf(stderr, USAGE);
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&t, 0, sizeof(t));
+    t.state = SEED;
+    if(!(t.buf = malloc(CHUNK))) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    make_dir(&t, dir);
+
+    if(!strcmp(profile, "tiny")) {
+        gen_tiny(&t, dir, count ? count : TINY_COUNT);
+    }
+    else if(!strcmp(profile, "huge")) {
+        gen_huge(&t, dir, count ? count : HUGE_COUNT);
+    }
+    else if(!strcmp(profile, "deep")) {
+        gen_deep(&t, dir, count ? count : DEEP_COUNT);
+    }
+    else if(!strcmp(profile, "sparse")) {
+        gen_sparse(&t, dir, count ? count : SPARSE_COUNT);
+    }
+    else if(!strcmp(profile, "links")) {
+        gen_links(&t, dir, count ? count : LINKS_COUNT);
+    }
+    else {
+        fprintf(stderr, USAGE);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%ld %lld\n", t.members, (long long)t.bytes);
+    free(t.buf);
+    return 0;
+}
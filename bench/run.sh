@@ -0,0 +1,125 @@
+#!/bin/sh
+# Times mytar creating, listing and extracting the synthetic trees gentree
+# builds, once on a tmpfs and once on a disk backed directory, and appends
+# one JSON object per run to a results file so runs can be compared:
+#
+#   sh bench/run.sh [ profile ... ]
+#
+# Profiles are tiny (1M tiny files), huge, deep, sparse and links; all of
+# them by default. Set in the environment:
+#
+#   BENCH_TMPFS    tmpfs directory to work in (/dev/shm)
+#   BENCH_DISK     disk backed directory to work in (/var/tmp/mytar-bench)
+#   BENCH_FS       which of them to use ("tmpfs disk")
+#   BENCH_JOBS     job counts to create and extract with ("1 4")
+#   BENCH_COUNT    overrides each profile's file count, for quick runs
+#   BENCH_SYSCALLS 0 to skip the extra run that counts system calls
+#   BENCH_OUT      results file (bench/results/<time>.jsonl)
+#
+# Trees are kept between runs and only rebuilt when the count changes.
+# System calls are counted in a traced run of their own before each timed
+# one. When /proc/sys/vm/drop_caches is writable, the page cache is dropped
+# before each timed disk run so it starts cold.
+
+set -e
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+MYTAR=$(cd "$BENCH_DIR/.." && pwd)/mytar
+GENTREE=$BENCH_DIR/gentree
+BENCHRUN=$BENCH_DIR/benchrun
+
+BENCH_TMPFS=${BENCH_TMPFS:-/dev/shm}
+BENCH_DISK=${BENCH_DISK:-/var/tmp/mytar-bench}
+BENCH_FS=${BENCH_FS:-tmpfs disk}
+BENCH_JOBS=${BENCH_JOBS:-1 4}
+BENCH_SYSCALLS=${BENCH_SYSCALLS:-1}
+BENCH_OUT=${BENCH_OUT:-$BENCH_DIR/results/$(date +%Y%m%d-%H%M%S).jsonl}
+
+PROFILES=${*:-tiny huge deep sparse links}
+COMMIT=$(git -C "$BENCH_DIR" rev-parse --short HEAD 2>/dev/null || echo none)
+HOST=$(uname -n)
+
+for prog in "$MYTAR" "$GENTREE" "$BENCHRUN"; do
+    if [ ! -x "$prog" ]; then
+        echo "$prog isn't built; run make bench" >&2
+        exit 1
+    fi
+done
+mkdir -p "$(dirname "$BENCH_OUT")"
+
+# Builds the tree for profile $2 under $1 unless it is already there
+make_tree() {
+    stamp="$1/tree-$2.stamp"
+    want="$2 ${BENCH_COUNT:-default}"
+
+    if [ -f "$stamp" ] && [ "$(head -n 1 "$stamp")" = "$want" ]; then
+        return
+    fi
+    rm -rf "$1/tree-$2" "$stamp"
+    echo "generating $2 in $1" >&2
+    counts=$("$GENTREE" "$1/tree-$2" "$2" $BENCH_COUNT)
+    printf '%s\n%s\n' "$want" "$counts" > "$stamp"
+}
+
+drop_caches() {
+    if [ "$1" = disk ] && [ -w /proc/sys/vm/drop_caches ]; then
+        sync
+        echo 3 > /proc/sys/vm/drop_caches
+    fi
+}
+
+# Clears out what the last run of op left behind
+prepare() {
+    case $1 in
+        create) rm -f "$archive" ;;
+        extract) rm -rf "$out"; mkdir "$out" ;;
+    esac
+}
+
+# run fs profile op jobs members dir command...
+run() {
+    fs=$1 profile=$2 op=$3 jobs=$4 members=$5 dir=$6
+    shift 6
+    syscalls=-1
+    if [ "$BENCH_SYSCALLS" != 0 ]; then
+        prepare "$op"
+        syscalls=$("$BENCHRUN" -c -C "$dir" -- "$@")
+    fi
+    prepare "$op"
+    drop_caches "$fs"
+    "$BENCHRUN" -C "$dir" -n "$members" -s "$archive" -S "$syscalls" \
+        -t commit="$COMMIT" -t host="$HOST" -t fs="$fs" \
+        -t profile="$profile" -t op="$op" -t jobs="$jobs" \
+        -- "$@" | tee -a "$BENCH_OUT"
+}
+
+for fs in $BENCH_FS; do
+    case $fs in
+        tmpfs) root=$BENCH_TMPFS/mytar-bench ;;
+        disk) root=$BENCH_DISK ;;
+        *) echo "unknown fs $fs" >&2; exit 1 ;;
+    esac
+    mkdir -p "$root"
+
+    for profile in $PROFILES; do
+        make_tree "$root" "$profile"
+        members=$(sed -n 2p "$root/tree-$profile.stamp" | cut -d ' ' -f 1)
+        archive=$root/$profile.tar
+        out=$root/out-$profile
+
+        for jobs in $BENCH_JOBS; do
+            run "$fs" "$profile" create "$jobs" "$members" "$root" \
+                "$MYTAR" cfj "$archive" "$jobs" "tree-$profile"
+            if [ "$jobs" = 1 ]; then
+                run "$fs" "$profile" list 1 "$members" "$root" \
+                    "$MYTAR" tf "$archive"
+            fi
+            run "$fs" "$profile" extract "$jobs" "$members" "$out" \
+                "$MYTAR" xfj "$archive" "$jobs"
+            rm -rf "$out"
+        done
+        rm -f "$archive"
+    done
+done
+
+echo "results in $BENCH_OUT" >&2
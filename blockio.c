@@ -0,0 +1,696 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include "blockio.h"
+#include "compress.h"
+
+/* All archive traffic goes through here so that the number of syscalls
+ * scales with archive size / record size instead of with the number of
+ * 512 byte blocks. */
+
+static struct archive_io *aio_alloc(int fd, size_t recordSize) {
+    struct archive_io *a;
+
+    errno = 0;
+    a = calloc(1, sizeof(struct archive_io));
+    if(errno) {
+        perror("Couldn't calloc archive_io");
+        exit(errno);
+    }
+
+    if(recordSize < AIO_BLOCK) {
+        recordSize = DEFAULT_RECORD_SIZE;
+    }
+
+    errno = 0;
+    a -> buf = malloc(recordSize);
+    if(errno) {
+        perror("Couldn't malloc record buffer");
+        exit(errno);
+    }
+
+    a -> fd = fd;
+    a -> bufSize = recordSize;
+    return a;
+}
+
+/* Hints the kernel to start reading the window past the current position
+ * of a mapped archive */
+static void aio_advise(struct archive_io *a) {
+    size_t start, end;
+
+    if(!a -> mapped || a -> pos + MAP_ADVISE_WINDOW / 2 < a -> advised) {
+        return;
+    }
+
+    /* madvise() wants a page aligned start */
+    start = a -> advised & ~((size_t)sysconf(_SC_PAGESIZE) - 1);
+    end = a -> pos + MAP_ADVISE_WINDOW;
+    if(end > a -> len) {
+        end = a -> len;
+    }
+    if(end > start) {
+        madvise(a -> buf + start, end - start, MADV_WILLNEED);
+    }
+    a -> advised = end;
+}
+
+/* Looks at the start of a non-mapped archive, and switches to reading
+ * through a decompressor if it is compressed. Whatever was read stays in
+ * the buffer for an uncompressed archive. */
+static void aio_detect(struct archive_io *a) {
+    int method;
+
+    while(a -> len < COMP_MAGIC_LEN) {
+        ssize_t num = read(a -> fd, a -> buf + a -> len,
+                           a -> bufSize - a -> len);
+
+        if(num == -1 && errno == EINTR) {
+            continue;
+        }
+        if(num == -1) {
+            perror("Couldn't read archive");
+            exit(errno);
+        }
+        if(num == 0) {
+            break;
+        }
+        a -> len += num;
+    }
+
+    if((method = comp_detect((unsigned char *)a -> buf, a -> len)) ==
+       COMP_NONE) {
+        return;
+    }
+
+    a -> decomp = decomp_start(a -> fd, method, a -> buf, a -> len);
+    a -> len = 0;
+    a -> kcopy = KCOPY_NONE;
+    a -> seekable = 0;
+}
+
+struct archive_io *aio_open_reader(int fd, size_t recordSize) {
+    struct archive_io *a = aio_alloc(fd, recordSize);
+    struct stat sb;
+    void *map;
+
+    /* Pipes and sockets have to be read through to skip anything */
+    a -> seekable = lseek(fd, 0, SEEK_CUR) != -1;
+
+    /* copy_file_range() out of the archive needs it to be a plain file */
+    a -> kcopy = KCOPY_NONE;
+    if(fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode)) {
+        aio_detect(a);
+        return a;
+    }
+    a -> kcopy = KCOPY_RANGE;
+
+    /* Local seekable archives are read straight out of a mapping, so
+     * headers are parsed in place and skips are pointer arithmetic. The
+     * read offset must be 0 since offsets into the map are archive
+     * offsets. Anything else keeps the read() path. */
+    if(sb.st_size <= 0 || (uintmax_t)sb.st_size > SIZE_MAX ||
+       lseek(fd, 0, SEEK_CUR) != 0) {
+        aio_detect(a);
+        return a;
+    }
+
+    map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(map == MAP_FAILED) {
+        aio_detect(a);
+        return a;
+    }
+
+    /* Compressed archives gain nothing from the mapping */
+    if(comp_detect(map, sb.st_size) != COMP_NONE) {
+        munmap(map, sb.st_size);
+        aio_detect(a);
+        return a;
+    }
+    madvise(map, sb.st_size, MADV_SEQUENTIAL);
+
+    free(a -> buf);
+    a -> buf = map;
+    a -> bufSize = a -> len = sb.st_size;
+    a -> mapped = 1;
+    aio_advise(a);
+
+    return a;
+}
+
+/* Puts a COMP_* compression stage between a writer and its fd. Must come
+ * before anything is written. */
+void aio_compress(struct archive_io *a, int method, int numThreads) {
+    a -> comp = comp_start(a -> fd, method, numThreads);
+    /* The compressor has to see every byte */
+    a -> kcopy = KCOPY_NONE;
+}
+
+struct archive_io *aio_open_writer(int fd, size_t recordSize, int padRecords) {
+    struct archive_io *a = aio_alloc(fd, recordSize);
+    struct stat sb;
+
+    a -> writer = 1;
+    a -> padRecords = padRecords;
+
+    /* Fixed size records have to reach the device as whole write()s,
+     * so only unblocked archives get the kernel copy paths. */
+    a -> kcopy = KCOPY_NONE;
+    if(!padRecords && fstat(fd, &sb) == 0) {
+        if(S_ISREG(sb.st_mode)) {
+            a -> kcopy = KCOPY_RANGE;
+        }
+        else if(S_ISFIFO(sb.st_mode)) {
+            a -> kcopy = KCOPY_SPLICE;
+        }
+        else {
+            a -> kcopy = KCOPY_SENDFILE;
+        }
+    }
+
+    return a;
+}
+
+/* Reads up to n bytes straight from the archive fd, or from its
+ * decompressor, retrying on EINTR. Returns how many, 0 at end of file. */
+static size_t aio_raw_read(struct archive_io *a, char *dst, size_t n) {
+    ssize_t num;
+
+    if(a -> decomp) {
+        return decomp_read(a -> decomp, dst, n);
+    }
+
+    do {
+        num = read(a -> fd, dst, n);
+    } while(num == -1 && errno == EINTR);
+
+    if(num == -1) {
+        perror("Couldn't read archive");
+        exit(errno);
+    }
+    return num;
+}
+
+/* Refills an exhausted read buffer. Returns the number of new bytes,
+ * 0 on end of file. */
+static size_t aio_fill(struct archive_io *a) {
+    /* The whole archive is already in view */
+    if(a -> mapped) {
+        return 0;
+    }
+
+    a -> pos = 0;
+    a -> len = aio_raw_read(a, a -> buf, a -> bufSize);
+    return a -> len;
+}
+
+/* Reads up to n bytes, only returning less than n at end of archive */
+size_t aio_read(struct archive_io *a, void *dst, size_t n) {
+    size_t done = 0;
+
+    while(done < n) {
+        size_t avail = a -> len - a -> pos;
+
+        if(!avail) {
+            if(!aio_fill(a)) {
+                break;
+            }
+            avail = a -> len;
+        }
+
+        if(avail > n - done) {
+            avail = n - done;
+        }
+        memcpy((char *)dst + done, a -> buf + a -> pos, avail);
+        a -> pos += avail;
+        a -> offset += avail;
+        done += avail;
+    }
+
+    return done;
+}
+
+/* Returns a pointer to the next n bytes (n <= one record) and consumes
+ * them, or NULL if the archive ends first. The bytes are only valid until
+ * the next call on a. Mapped archives hand out the mapping itself. */
+const void *aio_next(struct archive_io *a, size_t n) {
+    size_t avail = a -> len - a -> pos;
+    const char *p;
+
+    if(avail < n && !a -> mapped) {
+        /* Slide the leftover to the front and top the buffer up */
+        memmove(a -> buf, a -> buf + a -> pos, avail);
+        a -> pos = 0;
+        a -> len = avail;
+
+        while(a -> len < n) {
+            size_t num = aio_raw_read(a, a -> buf + a -> len,
+                                      a -> bufSize - a -> len);
+
+            if(num == 0) {
+                break;
+            }
+            a -> len += num;
+        }
+        avail = a -> len;
+    }
+
+    if(avail < n) {
+        return NULL;
+    }
+
+    p = a -> buf + a -> pos;
+    a -> pos += n;
+    a -> offset += n;
+    aio_advise(a);
+    return p;
+}
+
+/* Writes all of len bytes to outfd */
+static void write_all(int outfd, const char *src, size_t len) {
+    while(len) {
+        ssize_t num = write(outfd, src, len);
+
+        if(num == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            perror("Couldn't write file");
+            exit(errno);
+        }
+        src += num;
+        len -= num;
+    }
+}
+
+/* Streams the next n archive bytes into outfd. Whatever is already
+ * buffered is written straight out of the record buffer; the rest is
+ * copy_file_range()d when both ends allow it, or else pumped a record at a
+ * time. Peak memory is one record regardless of member size. */
+void aio_copy_to_fd(struct archive_io *a, int outfd, off_t n) {
+    while(n > 0) {
+        size_t avail = a -> len - a -> pos;
+
+        if(!avail && !a -> mapped && a -> kcopy == KCOPY_RANGE &&
+           n >= KCOPY_MIN) {
+            ssize_t num = copy_file_range(a -> fd, NULL, outfd, NULL, n, 0);
+
+            if(num == -1 && errno == EINTR) {
+                continue;
+            }
+            if(num > 0) {
+                a -> offset += num;
+                n -= num;
+                continue;
+            }
+            if(num == -1 && errno != ENOSYS && errno != EXDEV &&
+               errno != EINVAL && errno != EOPNOTSUPP && errno != EBADF) {
+                perror("Couldn't copy file body");
+                exit(errno);
+            }
+            /* Not supported for this pair, or end of archive; the buffered
+             * path below sorts out which. */
+            a -> kcopy = KCOPY_NONE;
+        }
+
+        if(!avail) {
+            if(!aio_fill(a)) {
+                fprintf(stderr, "Archive is truncated! Exiting.");
+                exit(EXIT_FAILURE);
+            }
+            avail = a -> len;
+        }
+
+        if((off_t)avail > n) {
+            avail = n;
+        }
+        write_all(outfd, a -> buf + a -> pos, avail);
+        a -> pos += avail;
+        a -> offset += avail;
+        n -= avail;
+        aio_advise(a);
+    }
+}
+
+/* Copies n bytes starting at offset of infd to outfd without touching
+ * infd's file position, so any number of threads can share it. */
+void aio_copy_range(int infd, off_t offset, int outfd, off_t n) {
+    char *buf = NULL;
+
+    while(n > 0) {
+        ssize_t num = copy_file_range(infd, &offset, outfd, NULL, n, 0);
+
+        if(num == -1 && errno == EINTR) {
+            continue;
+        }
+        if(num <= 0) {
+            break;
+        }
+        n -= num;
+    }
+
+    /* The kernel wouldn't (or the archive ended); pread() the rest */
+    while(n > 0) {
+        ssize_t num;
+
+        if(!buf && !(buf = malloc(DEFAULT_RECORD_SIZE))) {
+            perror("Couldn't malloc copy buffer");
+            exit(EXIT_FAILURE);
+        }
+
+        num = pread(infd, buf, n < DEFAULT_RECORD_SIZE ?
+                    n : DEFAULT_RECORD_SIZE, offset);
+        if(num == -1 && errno == EINTR) {
+            continue;
+        }
+        if(num == -1) {
+            perror("Couldn't read archive");
+            exit(errno);
+        }
+        if(num == 0) {
+            fprintf(stderr, "Archive is truncated! Exiting.");
+            exit(EXIT_FAILURE);
+        }
+        write_all(outfd, buf, num);
+        offset += num;
+        n -= num;
+    }
+
+    free(buf);
+}
+
+/* Skips n bytes, first out of the buffer, then with a single lseek() */
+void aio_skip(struct archive_io *a, off_t n) {
+    size_t avail = a -> len - a -> pos;
+
+    if(n <= (off_t)avail) {
+        a -> pos += n;
+        a -> offset += n;
+        aio_advise(a);
+        return;
+    }
+
+    /* Skipping past the end of a mapping just leaves us at EOF */
+    if(a -> mapped) {
+        a -> pos = a -> len;
+        a -> offset += n;
+        return;
+    }
+
+    a -> pos = a -> len = 0;
+    a -> offset += avail;
+    n -= avail;
+
+    /* A compressed archive with a frame table restarts at the right frame */
+    if(a -> decomp && decomp_seek(a -> decomp, a -> offset + n)) {
+        a -> offset += n;
+        return;
+    }
+
+    /* Read and discard a record at a time */
+    if(!a -> seekable) {
+        while(n > 0) {
+            if(!aio_fill(a)) {
+                fprintf(stderr, "Archive is truncated! Exiting.");
+                exit(EXIT_FAILURE);
+            }
+            avail = (off_t)a -> len < n ? a -> len : (size_t)n;
+            a -> pos = avail;
+            a -> offset += avail;
+            n -= avail;
+        }
+        return;
+    }
+
+    if(lseek(a -> fd, n, SEEK_CUR) == -1) {
+        perror("Couldn't lseek to next header");
+        exit(errno);
+    }
+    a -> offset += n;
+}
+
+/* Whether aio_seek() can go anywhere, backwards included */
+int aio_seekable(struct archive_io *a) {
+    if(a -> decomp) {
+        return decomp_seekable(a -> decomp);
+    }
+    return a -> kcopy == KCOPY_RANGE;
+}
+
+/* Decompresses on numThreads threads, if the archive is compressed and has
+ * a frame table. Only before anything is read; aio_seekable() is false
+ * afterwards. */
+void aio_parallel(struct archive_io *a, int numThreads) {
+    if(a -> decomp) {
+        decomp_parallel(a -> decomp, numThreads);
+    }
+}
+
+/* Repositions a reader of a seekable archive at an absolute offset */
+void aio_seek(struct archive_io *a, off_t offset) {
+    if(a -> mapped) {
+        a -> pos = offset < (off_t)a -> len ? (size_t)offset : a -> len;
+        a -> offset = offset;
+        a -> advised = a -> pos;
+        aio_advise(a);
+        return;
+    }
+
+    /* Still inside what we have buffered */
+    if(offset >= a -> offset - (off_t)a -> pos &&
+       offset < a -> offset + (off_t)(a -> len - a -> pos)) {
+        a -> pos += offset - a -> offset;
+        a -> offset = offset;
+        return;
+    }
+
+    /* Offsets are in the uncompressed stream, which only goes forwards
+     * unless the decompressor can restart at a frame */
+    if(a -> decomp) {
+        off_t here = a -> offset + (off_t)(a -> len - a -> pos);
+
+        a -> pos = a -> len = 0;
+        if(decomp_seek(a -> decomp, offset)) {
+            a -> offset = offset;
+            return;
+        }
+        if(offset < here) {
+            fprintf(stderr, "Can't seek back in a compressed archive\n");
+            exit(EXIT_FAILURE);
+        }
+        a -> offset = here;
+        aio_skip(a, offset - here);
+        return;
+    }
+
+    if(lseek(a -> fd, offset, SEEK_SET) == -1) {
+        perror("Couldn't lseek in archive");
+        exit(errno);
+    }
+    a -> pos = a -> len = 0;
+    a -> offset = offset;
+}
+
+/* Writes out the whole buffer, retrying on short writes */
+static void aio_drain(struct archive_io *a) {
+    size_t done = 0;
+
+    if(a -> comp) {
+        comp_write(a -> comp, a -> buf, a -> pos);
+        a -> pos = 0;
+        return;
+    }
+
+    while(done < a -> pos) {
+        ssize_t num = write(a -> fd, a -> buf + done, a -> pos - done);
+
+        if(num == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        done += num;
+    }
+
+    a -> pos = 0;
+}
+
+void aio_write(struct archive_io *a, const void *src, size_t n) {
+    while(n) {
+        size_t space = a -> bufSize - a -> pos;
+
+        if(space > n) {
+            space = n;
+        }
+        memcpy(a -> buf + a -> pos, src, space);
+        a -> pos += space;
+        a -> offset += space;
+        src = (const char *)src + space;
+        n -= space;
+
+        if(a -> pos == a -> bufSize) {
+            aio_drain(a);
+        }
+    }
+}
+
+/* Zero fills up to the next 512 byte boundary */
+void aio_pad_block(struct archive_io *a) {
+    static const char zeros[AIO_BLOCK];
+    size_t rem = a -> offset % AIO_BLOCK;
+
+    if(rem) {
+        aio_write(a, zeros, AIO_BLOCK - rem);
+    }
+}
+
+/* Moves up to left bytes from infd to the archive without them passing
+ * through user space. Returns how many were copied; anything short of
+ * left is for the buffered path. Downgrades a -> kcopy when the kernel
+ * refuses a method so we only pay for the failed call once. */
+static off_t aio_kernel_copy(struct archive_io *a, int infd, off_t left) {
+    off_t done = 0;
+
+    aio_flush(a);
+
+    while(left > 0 && a -> kcopy != KCOPY_NONE) {
+        ssize_t num;
+
+        switch(a -> kcopy) {
+            case KCOPY_RANGE:
+                num = copy_file_range(infd, NULL, a -> fd, NULL, left, 0);
+                break;
+            case KCOPY_SPLICE:
+                num = splice(infd, NULL, a -> fd, NULL, left, SPLICE_F_MORE);
+                break;
+            default:
+                num = sendfile(a -> fd, infd, NULL, left);
+                break;
+        }
+
+        if(num == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if(num == -1) {
+            /* Nothing was moved, so fall back a level and retry. Only
+             * sendfile() falls back to plain read()/write(). */
+            if(errno == ENOSYS || errno == EXDEV || errno == EINVAL ||
+               errno == EOPNOTSUPP || errno == EBADF) {
+                a -> kcopy = a -> kcopy == KCOPY_SENDFILE ?
+                             KCOPY_NONE : KCOPY_SENDFILE;
+                continue;
+            }
+            perror("Couldn't copy file body");
+            exit(EXIT_FAILURE);
+        }
+
+        /* The file shrank; let the buffered path zero fill */
+        if(num == 0) {
+            break;
+        }
+
+        done += num;
+        left -= num;
+        a -> offset += num;
+    }
+
+    return done;
+}
+
+/* Appends exactly n bytes of infd to the archive. Large bodies are
+ * copied by the kernel where the output allows it; otherwise they are read
+ * straight into the record buffer. If the file shrank under us the rest is
+ * zero filled so the archive still matches the size in the header. */
+off_t aio_copy_from_fd(struct archive_io *a, int infd, off_t n) {
+    off_t left = n;
+    int shrunk = 0;
+
+    if(a -> kcopy != KCOPY_NONE && n >= KCOPY_MIN) {
+        left -= aio_kernel_copy(a, infd, left);
+    }
+
+    while(left > 0) {
+        size_t space = a -> bufSize - a -> pos;
+        ssize_t num = 0;
+
+        if((off_t)space > left) {
+            space = left;
+        }
+
+        if(!shrunk) {
+            num = read(infd, a -> buf + a -> pos, space);
+            if(num == -1 && errno == EINTR) {
+                continue;
+            }
+            if(num == -1) {
+                perror("read");
+                num = 0;
+            }
+            if(num == 0) {
+                fprintf(stderr,
+                        "File shrank by %ld bytes; padding with zeros\n",
+                        (long)left);
+                shrunk = 1;
+            }
+        }
+        if(shrunk) {
+            memset(a -> buf + a -> pos, 0, space);
+            num = space;
+        }
+
+        a -> pos += num;
+        a -> offset += num;
+        left -= num;
+
+        if(a -> pos == a -> bufSize) {
+            aio_drain(a);
+        }
+    }
+
+    return n;
+}
+
+void aio_flush(struct archive_io *a) {
+    if(a -> writer && a -> pos) {
+        aio_drain(a);
+    }
+}
+
+/* Flushes a writer (padding out the last record if asked to) and frees.
+ * The fd belongs to the caller. */
+void aio_close(struct archive_io *a) {
+    if(a -> writer) {
+        if(a -> padRecords && a -> pos) {
+            memset(a -> buf + a -> pos, 0, a -> bufSize - a -> pos);
+            a -> offset += a -> bufSize - a -> pos;
+            a -> pos = a -> bufSize;
+        }
+        aio_flush(a);
+        if(a -> comp) {
+            comp_finish(a -> comp);
+        }
+    }
+    else if(a -> decomp) {
+        decomp_finish(a -> decomp);
+    }
+
+    if(a -> mapped) {
+        munmap(a -> buf, a -> len);
+    }
+    else {
+        free(a -> buf);
+    }
+    free(a);
+}
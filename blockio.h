@@ -0,0 +1,88 @@
+#ifndef BLOCKIO_H
+#define BLOCKIO_H
+
+#include <sys/types.h>
+
+#define AIO_BLOCK 512
+/* 1 MiB - one read()/write() per MiB of archive */
+#define DEFAULT_RECORD_SIZE (1024 * 1024)
+/* 16384 * 512 = 8 MiB records */
+#define MAX_BLOCKING_FACTOR 16384
+
+/* Bodies smaller than this are cheaper to copy through the buffer */
+#define KCOPY_MIN (128 * 1024)
+
+/* Read ahead hint window for mapped archives */
+#define MAP_ADVISE_WINDOW (16 * 1024 * 1024)
+
+/* Rounds a member size up to the whole blocks it occupies in the archive */
+#define AIO_PADDED(n) ((((off_t)(n)) + AIO_BLOCK - 1) / AIO_BLOCK * AIO_BLOCK)
+
+/* Buffered view of an archive file descriptor. A single struct is either a
+ * reader or a writer, never both. Readers of seekable local files map the
+ * whole archive instead, in which case buf/len describe the mapping. */
+struct archive_io {
+    int fd;
+    int writer;
+    /* Pad the archive to a whole number of records on close (tar 'b') */
+    int padRecords;
+    /* How file bodies may be handed to the kernel, see KCOPY_* */
+    int kcopy;
+    /* reader: lseek() works, else skips read through (pipes, sockets) */
+    int seekable;
+    /* reader: buf is an mmap() of the whole archive */
+    int mapped;
+    /* reader: end of the range already given MADV_WILLNEED */
+    size_t advised;
+    char *buf;
+    size_t bufSize;
+    /* reader: next unconsumed byte, writer: next free byte */
+    size_t pos;
+    /* reader: number of valid bytes in buf */
+    size_t len;
+    /* Archive offset of buf[pos] */
+    off_t offset;
+    /* Set when the archive fd carries a compressed stream; offsets are
+     * then offsets into the uncompressed archive */
+    struct compressor *comp;
+    struct decompressor *decomp;
+};
+
+#define KCOPY_NONE 0
+#define KCOPY_RANGE 1
+#define KCOPY_SPLICE 2
+#define KCOPY_SENDFILE 3
+
+struct archive_io *aio_open_reader(int fd, size_t recordSize);
+
+struct archive_io *aio_open_writer(int fd, size_t recordSize, int padRecords);
+
+void aio_compress(struct archive_io *a, int method, int numThreads);
+
+size_t aio_read(struct archive_io *a, void *dst, size_t n);
+
+const void *aio_next(struct archive_io *a, size_t n);
+
+void aio_skip(struct archive_io *a, off_t n);
+
+int aio_seekable(struct archive_io *a);
+
+void aio_parallel(struct archive_io *a, int numThreads);
+
+void aio_seek(struct archive_io *a, off_t offset);
+
+void aio_write(struct archive_io *a, const void *src, size_t n);
+
+void aio_pad_block(struct archive_io *a);
+
+off_t aio_copy_from_fd(struct archive_io *a, int infd, off_t n);
+
+void aio_copy_to_fd(struct archive_io *a, int outfd, off_t n);
+
+void aio_copy_range(int infd, off_t offset, int outfd, off_t n);
+
+void aio_flush(struct archive_io *a);
+
+void aio_close(struct archive_io *a);
+
+#endif
@@ -0,0 +1,159 @@
+#include <stdint.h>
+#include <string.h>
+#include "header.h"
+#include "util.h"
+#include "codec.h"
+#include "given.h"
+
+/* Numeric fields are width - 1 octal digits and a terminator, unless the
+ * top bit of the first byte is set, in which case the rest of the field is
+ * a big endian binary number (GNU's base-256). Both directions run eight
+ * digits at a time in a 64 bit word where the byte order allows it. */
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define HDR_SWAR 1
+#endif
+
+#define BASE256_FLAG 0x80
+#define SWAR_DIGITS 16
+#define ASCII_ZEROS 0x3030303030303030ULL
+#define OCTAL_MASK 0xF8F8F8F8F8F8F8F8ULL
+#define LANE8_DIGIT 0x0007000700070007ULL
+#define LANE16_DIGITS 0x0000003f0000003fULL
+#define LANE32_DIGITS 0x0000000000000fffULL
+
+#ifdef HDR_SWAR
+/* Eight digit values, most significant in the lowest byte, to the 24 bit
+ * number they spell */
+static uint64_t swar_pack(uint64_t x) {
+    x = ((x & LANE8_DIGIT) << 3) | ((x >> 8) & LANE8_DIGIT);
+    x = ((x & LANE16_DIGITS) << 6) | ((x >> 16) & LANE16_DIGITS);
+    return ((x & LANE32_DIGITS) << 12) | ((x >> 32) & LANE32_DIGITS);
+}
+
+/* The reverse of swar_pack() for a number below 8^8 */
+static uint64_t swar_spread(uint64_t v) {
+    uint64_t x = (v >> 12) | ((v & LANE32_DIGITS) << 32);
+
+    x = ((x >> 6) & LANE16_DIGITS) | ((x & LANE16_DIGITS) << 16);
+    return ((x >> 3) & LANE8_DIGIT) | ((x & LANE8_DIGIT) << 8);
+}
+#endif
+
+/* Decodes a numeric field without relying on a terminator. Like strtol(),
+ * leading spaces are skipped and the number ends at the first byte that
+ * isn't an octal digit. Returns -1 for base-256 values that don't fit. */
+int64_t hdr_get_num(const char *field, size_t width) {
+    uint64_t val = 0;
+    size_t i = 0;
+
+    if((unsigned char)field[0] & BASE256_FLAG) {
+        return extract_special_int(field, width);
+    }
+
+#ifdef HDR_SWAR
+    /* What every ustar writer produces: all digits, then NUL or space */
+    if(width > 1 && width <= SWAR_DIGITS + 1 &&
+       (field[width - 1] == '\0' || field[width - 1] == ' ')) {
+        char digits[SWAR_DIGITS];
+        uint64_t hi, lo;
+
+        memset(digits, '0', SWAR_DIGITS);
+        memcpy(digits + SWAR_DIGITS - (width - 1), field, width - 1);
+        memcpy(&hi, digits, sizeof(hi));
+        memcpy(&lo, digits + sizeof(hi), sizeof(lo));
+        if((hi & OCTAL_MASK) == ASCII_ZEROS &&
+           (lo & OCTAL_MASK) == ASCII_ZEROS) {
+            return (int64_t)(swar_pack(hi - ASCII_ZEROS) << 24 |
+                             swar_pack(lo - ASCII_ZEROS));
+        }
+    }
+#endif
+
+    while(i < width && field[i] == ' ') {
+        i++;
+    }
+    for(; i < width && field[i] >= '0' && field[i] <= '7'; i++) {
+        val = val << 3 | (field[i] - '0');
+    }
+    return (int64_t)val;
+}
+
+/* Writes val as width - 1 zero padded octal digits and a NUL, the way
+ * sprintf("%0*o") would. Returns -1, leaving the field alone, if val
+ * needs more digits than that. */
+int hdr_put_octal(char *field, size_t width, uint64_t val) {
+    size_t n = width - 1;
+
+    if(n * 3 < 64 && val >> (n * 3)) {
+        return -1;
+    }
+
+#ifdef HDR_SWAR
+    if(n <= SWAR_DIGITS) {
+        char digits[SWAR_DIGITS];
+        uint64_t hi = swar_spread(val >> 24) + ASCII_ZEROS;
+        uint64_t lo = swar_spread(val & 0xffffff) + ASCII_ZEROS;
+
+        memcpy(digits, &hi, sizeof(hi));
+        memcpy(digits + sizeof(hi), &lo, sizeof(lo));
+        memcpy(field, digits + SWAR_DIGITS - n, n);
+        field[n] = '\0';
+        return 0;
+    }
+#endif
+
+    field[n] = '\0';
+    while(n--) {
+        field[n] = '0' + (val & 7);
+        val >>= 3;
+    }
+    return 0;
+}
+
+/* Copies a possibly unterminated string field and terminates it */
+static size_t get_string(char *dst, const char *field, size_t width) {
+    const char *end = memchr(field, '\0', width);
+    size_t len = end ? (size_t)(end - field) : width;
+
+    memcpy(dst, field, len);
+    dst[len] = '\0';
+    return len;
+}
+
+/* Decodes a whole header block in one go. Returns HDR_ZERO for an all zero
+ * block (info is left untouched), HDR_BAD if the stored checksum doesn't
+ * match or the size is unusable, and HDR_VALID otherwise. */
+int hdr_decode(const struct header *h, struct hdr_info *info) {
+    size_t len = 0;
+
+    if(is_zero_block((const unsigned char *)h)) {
+        return HDR_ZERO;
+    }
+
+    info->path = info->pathBuf;
+    info->linkname = info->linkBuf;
+    if(h->prefix[0]) {
+        len = get_string(info->path, h->prefix, sizeof(h->prefix));
+        info->path[len++] = '/';
+    }
+    get_string(info->path + len, h->name, sizeof(h->name));
+    get_string(info->linkname, h->linkname, sizeof(h->linkname));
+    get_string(info->uname, h->uname, sizeof(h->uname));
+    get_string(info->gname, h->gname, sizeof(h->gname));
+
+    info->mode = (mode_t)hdr_get_num(h->mode, sizeof(h->mode));
+    info->uid = (long)hdr_get_num(h->uid, sizeof(h->uid));
+    info->gid = (long)hdr_get_num(h->gid, sizeof(h->gid));
+    info->size = (off_t)hdr_get_num(h->size, sizeof(h->size));
+    info->mtime = (time_t)hdr_get_num(h->mtime, sizeof(h->mtime));
+    info->mtimeNsec = 0;
+    info->chksum = (long)hdr_get_num(h->chksum, sizeof(h->chksum));
+    info->type = h->typeflag[0];
+    info->sum = calc_checksum((unsigned char *)h);
+
+    if(info->size < 0) {
+        return HDR_BAD;
+    }
+    return info->sum == info->chksum ? HDR_VALID : HDR_BAD;
+}
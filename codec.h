@@ -0,0 +1,44 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "header.h"
+
+/* prefix, "/", name and a terminator */
+#define HDR_PATH_SIZE (155 + 1 + 100 + 1)
+#define HDR_LINK_SIZE (100 + 1)
+#define HDR_NAME_SIZE (32 + 1)
+
+/* A ustar header with every field decoded. Strings are always NUL
+ * terminated, even where the header's fields are not. path and linkname
+ * point into pathBuf and linkBuf, unless an extended header gave longer
+ * ones (see pax_decode()). */
+struct hdr_info {
+    char *path;
+    char *linkname;
+    char pathBuf[HDR_PATH_SIZE];
+    char linkBuf[HDR_LINK_SIZE];
+    char uname[HDR_NAME_SIZE];
+    char gname[HDR_NAME_SIZE];
+    mode_t mode;
+    long uid;
+    long gid;
+    off_t size;
+    time_t mtime;
+    /* Only extended headers carry fractions of a second */
+    long mtimeNsec;
+    /* Checksum as stored in the header and as computed from it */
+    long chksum;
+    int sum;
+    char type;
+};
+
+int64_t hdr_get_num(const char *field, size_t width);
+
+int hdr_put_octal(char *field, size_t width, uint64_t val);
+
+int hdr_decode(const struct header *h, struct hdr_info *info);
+
+#endif
@@ -0,0 +1,1185 @@
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "compress.h"
+
+#define JOB_FREE 0
+#define JOB_QUEUED 1
+#define JOB_DONE 2
+/* Compressed bytes read per read() */
+#define DECOMP_IN_SIZE (256 * 1024)
+/* deflateInit2() window bits for a gzip wrapper instead of zlib's */
+#define GZIP_WBITS (15 + 16)
+#define GZIP_MEMLEVEL 8
+
+/* The frame table follows the last frame. For zstd it is the seekable
+ * format's skippable frame: an entry of compressed and decompressed size
+ * per frame, then the frame count, a descriptor byte and a magic number.
+ * gzip has nothing like it, so the same entries ride in the extra field of
+ * empty gzip members (GZIP_TABLE_ENTRIES at most in each), and one last
+ * empty member of fixed size holds the frame count and how many bytes of
+ * table members precede it. Other tools decode all of it to nothing. */
+#define ZSTD_SKIPPABLE_MAGIC 0x184D2A5EU
+#define ZSTD_SEEKABLE_MAGIC 0x8F92EAB1U
+#define ZSTD_SKIPPABLE_HEAD 8
+#define ZSTD_FOOTER_LEN 9
+#define ZSTD_CHECKSUM_FLAG 0x80
+#define TABLE_ENTRY_LEN 8
+#define GZIP_HEAD_LEN 10
+#define GZIP_XLEN_LEN 2
+#define GZIP_SUBFIELD_HEAD 4
+#define GZIP_TAIL_LEN 10
+#define GZIP_FEXTRA 0x04
+#define GZIP_MEMBER_LEN(data) (GZIP_HEAD_LEN + GZIP_XLEN_LEN + \
+                               GZIP_SUBFIELD_HEAD + (data) + GZIP_TAIL_LEN)
+#define GZIP_TABLE_ENTRIES 8191
+#define GZIP_FOOTER_DATA 12
+
+static const unsigned char gzipMagic[] = { 0x1f, 0x8b };
+static const unsigned char zstdMagic[] = { 0x28, 0xb5, 0x2f, 0xfd };
+/* An empty gzip member is this header, the extra field, then an empty final
+ * deflate block and a zero CRC32 and size */
+static const unsigned char gzipTableHead[GZIP_HEAD_LEN] =
+    { 0x1f, 0x8b, 0x08, GZIP_FEXTRA, 0, 0, 0, 0, 0, 0xff };
+static const unsigned char gzipEmptyTail[GZIP_TAIL_LEN] =
+    { 0x03, 0x00, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+struct comp_job {
+    char *in;
+    size_t inLen;
+    char *out;
+    size_t outLen;
+    size_t outCap;
+    int state;
+};
+
+/* Per thread compression state, reused from chunk to chunk */
+struct comp_ctx {
+    z_stream zs;
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx *zc;
+#endif
+};
+
+/* Per thread decompression state */
+struct decomp_ctx {
+    z_stream zs;
+#ifdef HAVE_ZSTD
+    ZSTD_DStream *zd;
+#endif
+};
+
+struct compressor {
+    int fd;
+    int method;
+    int numThreads;
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t done;
+    /* Ring of chunks, addressed by ever growing sequence numbers: the one
+     * being filled, the next one for a worker and the next to write out */
+    struct comp_job *jobs;
+    int numJobs;
+    long fill;
+    long take;
+    long flush;
+    int closing;
+    /* Used directly when there are no threads */
+    struct comp_ctx ctx;
+    /* Compressed and decompressed size of each frame written so far */
+    uint32_t *frames;
+    long numFrames;
+    long framesCap;
+};
+
+/* A whole decompressed frame, when frames are decompressed in parallel */
+struct frame_buf {
+    char *data;
+    size_t len;
+    size_t cap;
+    int state;
+};
+
+struct decompressor {
+    int fd;
+    int method;
+    char *in;
+    size_t inCap;
+    size_t inPos;
+    size_t inLen;
+    int eof;
+    /* gzip: the last member is complete */
+    int ended;
+    struct decomp_ctx x;
+#ifdef HAVE_ZSTD
+    /* Last ZSTD_decompressStream() result, 0 on a frame boundary */
+    size_t zret;
+#endif
+    /* Uncompressed offset of the next byte decomp_read() hands out, and how
+     * much to throw away before it after a seek into a frame */
+    off_t offset;
+    off_t discard;
+    /* From the frame table, numFrames + 1 entries each: where frame i
+     * starts in the file and in the uncompressed stream */
+    long numFrames;
+    off_t *frameComp;
+    off_t *frameData;
+    /* Parallel mode: workers decompress whole frames into a ring of
+     * slots that decomp_read() empties in order */
+    int numThreads;
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t freed;
+    pthread_cond_t done;
+    struct frame_buf *slots;
+    int numSlots;
+    long take;
+    long flush;
+    size_t slotPos;
+    int closing;
+};
+
+int comp_supported(int method) {
+#ifdef HAVE_ZSTD
+    return method == COMP_GZIP || method == COMP_ZSTD;
+#else
+    return method == COMP_GZIP;
+#endif
+}
+
+/* Returns the COMP_* method the stream starting with head is in */
+int comp_detect(const unsigned char *head, size_t n) {
+    if(n >= sizeof(gzipMagic) &&
+       !memcmp(head, gzipMagic, sizeof(gzipMagic))) {
+        return COMP_GZIP;
+    }
+    if(n >= sizeof(zstdMagic) &&
+       !memcmp(head, zstdMagic, sizeof(zstdMagic))) {
+        return COMP_ZSTD;
+    }
+    return COMP_NONE;
+}
+
+static void put_le16(unsigned char *p, uint16_t v) {
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+}
+
+static void put_le32(unsigned char *p, uint32_t v) {
+    put_le16(p, v & 0xffff);
+    put_le16(p + 2, v >> 16);
+}
+
+static void put_le64(unsigned char *p, uint64_t v) {
+    put_le32(p, v & 0xffffffff);
+    put_le32(p + 4, v >> 32);
+}
+
+static uint16_t get_le16(const unsigned char *p) {
+    return p[0] | p[1] << 8;
+}
+
+static uint32_t get_le32(const unsigned char *p) {
+    return get_le16(p) | (uint32_t)get_le16(p + 2) << 16;
+}
+
+static uint64_t get_le64(const unsigned char *p) {
+    return get_le32(p) | (uint64_t)get_le32(p + 4) << 32;
+}
+
+static void *grow_or_die(void *p, size_t n) {
+    if(!(p = realloc(p, n ? n : 1))) {
+        perror("Couldn't malloc compression buffer");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static void write_out(int fd, const char *src, size_t len) {
+    while(len) {
+        ssize_t num = write(fd, src, len);
+
+        if(num == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        src += num;
+        len -= num;
+    }
+}
+
+/* pread()s exactly len bytes. Returns 0 if the file ends first. */
+static int read_at(int fd, void *dst, size_t len, off_t offset) {
+    while(len) {
+        ssize_t num = pread(fd, dst, len, offset);
+
+        if(num == -1 && errno == EINTR) {
+            continue;
+        }
+        if(num == -1) {
+            perror("Couldn't read archive");
+            exit(errno);
+        }
+        if(num == 0) {
+            return 0;
+        }
+        dst = (char *)dst + num;
+        len -= num;
+        offset += num;
+    }
+    return 1;
+}
+
+static void ctx_init(struct comp_ctx *x, int method) {
+    memset(x, 0, sizeof(struct comp_ctx));
+
+    if(method == COMP_GZIP) {
+        if(deflateInit2(&x -> zs, COMP_GZIP_LEVEL, Z_DEFLATED, GZIP_WBITS,
+                        GZIP_MEMLEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+            fprintf(stderr, "Couldn't start gzip compression\n");
+            exit(EXIT_FAILURE);
+        }
+        return;
+    }
+#ifdef HAVE_ZSTD
+    if(!(x -> zc = ZSTD_createCCtx())) {
+        fprintf(stderr, "Couldn't start zstd compression\n");
+        exit(EXIT_FAILURE);
+    }
+#endif
+}
+
+static void ctx_free(struct comp_ctx *x, int method) {
+    if(method == COMP_GZIP) {
+        deflateEnd(&x -> zs);
+        return;
+    }
+#ifdef HAVE_ZSTD
+    ZSTD_freeCCtx(x -> zc);
+#endif
+}
+
+/* Turns one chunk into a complete gzip member or zstd frame */
+static void compress_job(struct comp_ctx *x, int method, struct comp_job *j) {
+    size_t need;
+
+    if(method == COMP_GZIP) {
+        deflateReset(&x -> zs);
+        need = deflateBound(&x -> zs, j -> inLen);
+    }
+    else {
+#ifdef HAVE_ZSTD
+        need = ZSTD_compressBound(j -> inLen);
+#else
+        need = 0;
+#endif
+    }
+
+    if(need > j -> outCap) {
+        free(j -> out);
+        if(!(j -> out = malloc(need))) {
+            perror("Couldn't malloc compression buffer");
+            exit(EXIT_FAILURE);
+        }
+        j -> outCap = need;
+    }
+
+    if(method == COMP_GZIP) {
+        x -> zs.next_in = (Bytef *)j -> in;
+        x -> zs.avail_in = j -> inLen;
+        x -> zs.next_out = (Bytef *)j -> out;
+        x -> zs.avail_out = need;
+        if(deflate(&x -> zs, Z_FINISH) != Z_STREAM_END) {
+            fprintf(stderr, "Couldn't compress archive\n");
+            exit(EXIT_FAILURE);
+        }
+        j -> outLen = need - x -> zs.avail_out;
+        return;
+    }
+#ifdef HAVE_ZSTD
+    j -> outLen = ZSTD_compressCCtx(x -> zc, j -> out, need, j -> in,
+                                    j -> inLen, COMP_ZSTD_LEVEL);
+    if(ZSTD_isError(j -> outLen)) {
+        fprintf(stderr, "Couldn't compress archive: %s\n",
+                ZSTD_getErrorName(j -> outLen));
+        exit(EXIT_FAILURE);
+    }
+#endif
+}
+
+static void *comp_worker(void *arg) {
+    struct compressor *c = arg;
+    struct comp_ctx x;
+
+    ctx_init(&x, c -> method);
+
+    pthread_mutex_lock(&c -> lock);
+    for(;;) {
+        struct comp_job *j;
+
+        while(c -> take == c -> fill && !c -> closing) {
+            pthread_cond_wait(&c -> queued, &c -> lock);
+        }
+        if(c -> take == c -> fill) {
+            break;
+        }
+        j = &c -> jobs[c -> take++ % c -> numJobs];
+        pthread_mutex_unlock(&c -> lock);
+
+        compress_job(&x, c -> method, j);
+
+        pthread_mutex_lock(&c -> lock);
+        j -> state = JOB_DONE;
+        pthread_cond_broadcast(&c -> done);
+    }
+    pthread_mutex_unlock(&c -> lock);
+
+    ctx_free(&x, c -> method);
+    return NULL;
+}
+
+/* Writes out a compressed chunk and adds it to the frame table */
+static void write_job(struct compressor *c, struct comp_job *j) {
+    write_out(c -> fd, j -> out, j -> outLen);
+
+    if(c -> numFrames == c -> framesCap) {
+        c -> framesCap = c -> framesCap ? c -> framesCap * 2 : 64;
+        c -> frames = grow_or_die(c -> frames,
+                                  c -> framesCap * 2 * sizeof(uint32_t));
+    }
+    c -> frames[c -> numFrames * 2] = j -> outLen;
+    c -> frames[c -> numFrames * 2 + 1] = j -> inLen;
+    c -> numFrames++;
+    j -> inLen = 0;
+}
+
+/* Writes finished chunks out in order, waiting for each one up to (not
+ * including) sequence number until, then any others that happen to be
+ * done already */
+static void comp_flush(struct compressor *c, long until) {
+    for(;;) {
+        struct comp_job *j;
+
+        pthread_mutex_lock(&c -> lock);
+        if(c -> flush == c -> fill) {
+            pthread_mutex_unlock(&c -> lock);
+            return;
+        }
+        j = &c -> jobs[c -> flush % c -> numJobs];
+        while(c -> flush < until && j -> state != JOB_DONE) {
+            pthread_cond_wait(&c -> done, &c -> lock);
+        }
+        if(j -> state != JOB_DONE) {
+            pthread_mutex_unlock(&c -> lock);
+            return;
+        }
+        pthread_mutex_unlock(&c -> lock);
+
+        write_job(c, j);
+
+        pthread_mutex_lock(&c -> lock);
+        j -> state = JOB_FREE;
+        c -> flush++;
+        pthread_mutex_unlock(&c -> lock);
+    }
+}
+
+/* Hands the chunk being filled to the workers, and makes sure the slot
+ * the next one goes in has been written out */
+static void comp_submit(struct compressor *c) {
+    struct comp_job *j = &c -> jobs[c -> fill % c -> numJobs];
+
+    if(!c -> threads) {
+        compress_job(&c -> ctx, c -> method, j);
+        write_job(c, j);
+        return;
+    }
+
+    pthread_mutex_lock(&c -> lock);
+    j -> state = JOB_QUEUED;
+    c -> fill++;
+    pthread_cond_signal(&c -> queued);
+    pthread_mutex_unlock(&c -> lock);
+
+    comp_flush(c, c -> fill - c -> numJobs + 1);
+}
+
+static void write_zstd_table(struct compressor *c) {
+    size_t tableLen = c -> numFrames * TABLE_ENTRY_LEN + ZSTD_FOOTER_LEN;
+    unsigned char *buf = grow_or_die(NULL, ZSTD_SKIPPABLE_HEAD + tableLen);
+    unsigned char *p = buf + ZSTD_SKIPPABLE_HEAD;
+    long i;
+
+    put_le32(buf, ZSTD_SKIPPABLE_MAGIC);
+    put_le32(buf + 4, tableLen);
+    for(i = 0; i < c -> numFrames * 2; i++, p += 4) {
+        put_le32(p, c -> frames[i]);
+    }
+    put_le32(p, c -> numFrames);
+    /* Descriptor: no per frame checksums */
+    p[4] = 0;
+    put_le32(p + 5, ZSTD_SEEKABLE_MAGIC);
+
+    write_out(c -> fd, (char *)buf, ZSTD_SKIPPABLE_HEAD + tableLen);
+    free(buf);
+}
+
+/* Starts an empty gzip member whose extra field is one subfield of len
+ * bytes, and returns where the subfield's data goes */
+static unsigned char *gzip_table_member(unsigned char *p, char id1, char id2,
+                                        size_t len) {
+    memcpy(p, gzipTableHead, GZIP_HEAD_LEN);
+    p += GZIP_HEAD_LEN;
+    put_le16(p, GZIP_SUBFIELD_HEAD + len);
+    p += GZIP_XLEN_LEN;
+    p[0] = id1;
+    p[1] = id2;
+    put_le16(p + 2, len);
+    memcpy(p + GZIP_SUBFIELD_HEAD + len, gzipEmptyTail, GZIP_TAIL_LEN);
+    return p + GZIP_SUBFIELD_HEAD;
+}
+
+static void write_gzip_table(struct compressor *c) {
+    long numMembers = (c -> numFrames + GZIP_TABLE_ENTRIES - 1) /
+                      GZIP_TABLE_ENTRIES;
+    size_t tableLen = numMembers * GZIP_MEMBER_LEN(0) +
+                      c -> numFrames * TABLE_ENTRY_LEN;
+    size_t total = tableLen + GZIP_MEMBER_LEN(GZIP_FOOTER_DATA);
+    unsigned char *buf = grow_or_die(NULL, total), *p = buf, *data;
+    long i, j;
+
+    for(i = 0; i < c -> numFrames; i += GZIP_TABLE_ENTRIES) {
+        long n = c -> numFrames - i < GZIP_TABLE_ENTRIES ?
+                 c -> numFrames - i : GZIP_TABLE_ENTRIES;
+
+        data = gzip_table_member(p, 'M', 'X', n * TABLE_ENTRY_LEN);
+        for(j = i * 2; j < (i + n) * 2; j++, data += 4) {
+            put_le32(data, c -> frames[j]);
+        }
+        p += GZIP_MEMBER_LEN(n * TABLE_ENTRY_LEN);
+    }
+
+    data = gzip_table_member(p, 'M', 'F', GZIP_FOOTER_DATA);
+    put_le32(data, c -> numFrames);
+    put_le64(data + 4, tableLen);
+
+    write_out(c -> fd, (char *)buf, total);
+    free(buf);
+}
+
+struct compressor *comp_start(int fd, int method, int numThreads) {
+    struct compressor *c;
+    int i;
+
+    if(!comp_supported(method)) {
+        fprintf(stderr, "This mytar was built without zstd support\n");
+        exit(EXIT_FAILURE);
+    }
+
+    errno = 0;
+    c = calloc(1, sizeof(struct compressor));
+    if(errno) {
+        perror("Couldn't calloc compressor");
+        exit(errno);
+    }
+    c -> fd = fd;
+    c -> method = method;
+    c -> numThreads = numThreads;
+    c -> numJobs = numThreads > 1 ? numThreads * COMP_AHEAD : 1;
+
+    errno = 0;
+    c -> jobs = calloc(c -> numJobs, sizeof(struct comp_job));
+    if(errno) {
+        perror("Couldn't calloc compressor");
+        exit(errno);
+    }
+
+    if(numThreads <= 1) {
+        ctx_init(&c -> ctx, method);
+        return c;
+    }
+
+    pthread_mutex_init(&c -> lock, NULL);
+    pthread_cond_init(&c -> queued, NULL);
+    pthread_cond_init(&c -> done, NULL);
+
+    errno = 0;
+    c -> threads = calloc(numThreads, sizeof(pthread_t));
+    if(errno) {
+        perror("Couldn't calloc compressor");
+        exit(errno);
+    }
+    for(i = 0; i < numThreads; i++) {
+        if((errno = pthread_create(&c -> threads[i], NULL, comp_worker, c))) {
+            perror("Couldn't start compression thread");
+            exit(errno);
+        }
+    }
+
+    return c;
+}
+
+void comp_write(struct compressor *c, const char *src, size_t n) {
+    while(n) {
+        struct comp_job *j = &c -> jobs[c -> fill % c -> numJobs];
+        size_t space = COMP_CHUNK - j -> inLen;
+
+        if(!j -> in && !(j -> in = malloc(COMP_CHUNK))) {
+            perror("Couldn't malloc compression buffer");
+            exit(EXIT_FAILURE);
+        }
+
+        if(space > n) {
+            space = n;
+        }
+        memcpy(j -> in + j -> inLen, src, space);
+        j -> inLen += space;
+        src += space;
+        n -= space;
+
+        if(j -> inLen == COMP_CHUNK) {
+            comp_submit(c);
+        }
+    }
+}
+
+/* Compresses and writes whatever is left and then the frame table, and
+ * frees. The fd belongs to the caller. */
+void comp_finish(struct compressor *c) {
+    int i;
+
+    if(c -> jobs[c -> fill % c -> numJobs].inLen) {
+        comp_submit(c);
+    }
+
+    if(c -> threads) {
+        comp_flush(c, c -> fill);
+
+        pthread_mutex_lock(&c -> lock);
+        c -> closing = 1;
+        pthread_cond_broadcast(&c -> queued);
+        pthread_mutex_unlock(&c -> lock);
+        for(i = 0; i < c -> numThreads; i++) {
+            pthread_join(c -> threads[i], NULL);
+        }
+
+        pthread_mutex_destroy(&c -> lock);
+        pthread_cond_destroy(&c -> queued);
+        pthread_cond_destroy(&c -> done);
+        free(c -> threads);
+    }
+    else {
+        ctx_free(&c -> ctx, c -> method);
+    }
+
+    if(c -> method == COMP_GZIP) {
+        write_gzip_table(c);
+    }
+    else {
+        write_zstd_table(c);
+    }
+
+    for(i = 0; i < c -> numJobs; i++) {
+        free(c -> jobs[i].in);
+        free(c -> jobs[i].out);
+    }
+    free(c -> jobs);
+    free(c -> frames);
+    free(c);
+}
+
+static void dctx_init(struct decomp_ctx *x, int method) {
+    memset(x, 0, sizeof(struct decomp_ctx));
+
+    if(method == COMP_GZIP) {
+        if(inflateInit2(&x -> zs, GZIP_WBITS) != Z_OK) {
+            fprintf(stderr, "Couldn't start gzip decompression\n");
+            exit(EXIT_FAILURE);
+        }
+        return;
+    }
+#ifdef HAVE_ZSTD
+    if(!(x -> zd = ZSTD_createDStream()) ||
+       ZSTD_isError(ZSTD_initDStream(x -> zd))) {
+        fprintf(stderr, "Couldn't start zstd decompression\n");
+        exit(EXIT_FAILURE);
+    }
+#endif
+}
+
+/* Drops any partly decoded member or frame */
+static void dctx_reset(struct decomp_ctx *x, int method) {
+    if(method == COMP_GZIP) {
+        inflateReset(&x -> zs);
+        return;
+    }
+#ifdef HAVE_ZSTD
+    ZSTD_initDStream(x -> zd);
+#endif
+}
+
+static void dctx_free(struct decomp_ctx *x, int method) {
+    if(method == COMP_GZIP) {
+        inflateEnd(&x -> zs);
+        return;
+    }
+#ifdef HAVE_ZSTD
+    ZSTD_freeDStream(x -> zd);
+#endif
+}
+
+static void decomp_corrupt(const char *why) {
+    fprintf(stderr, "Couldn't decompress archive: %s\n", why);
+    exit(EXIT_FAILURE);
+}
+
+static void decomp_truncated(void) {
+    fprintf(stderr, "Compressed archive is truncated! Exiting.");
+    exit(EXIT_FAILURE);
+}
+
+/* Decompresses one whole frame of known size from memory */
+static void decompress_frame(struct decomp_ctx *x, int method,
+                             const char *src, size_t srcLen,
+                             char *dst, size_t dstLen) {
+    dctx_reset(x, method);
+
+    if(method == COMP_GZIP) {
+        x -> zs.next_in = (Bytef *)src;
+        x -> zs.avail_in = srcLen;
+        x -> zs.next_out = (Bytef *)dst;
+        x -> zs.avail_out = dstLen;
+        if(inflate(&x -> zs, Z_FINISH) != Z_STREAM_END ||
+           x -> zs.avail_out) {
+            decomp_corrupt(x -> zs.msg ? x -> zs.msg : "frame table mismatch");
+        }
+        return;
+    }
+#ifdef HAVE_ZSTD
+    {
+        ZSTD_inBuffer in;
+        ZSTD_outBuffer out;
+        size_t ret;
+
+        in.src = src;
+        in.size = srcLen;
+        in.pos = 0;
+        out.dst = dst;
+        out.size = dstLen;
+        out.pos = 0;
+        do {
+            ret = ZSTD_decompressStream(x -> zd, &out, &in);
+            if(ZSTD_isError(ret)) {
+                decomp_corrupt(ZSTD_getErrorName(ret));
+            }
+        } while(ret && in.pos < in.size);
+        if(ret || out.pos != dstLen) {
+            decomp_corrupt("frame table mismatch");
+        }
+    }
+#endif
+}
+
+/* Turns numFrames packed table entries into start offsets */
+static void set_table(struct decompressor *d, const unsigned char *entries,
+                      long numFrames) {
+    long i;
+
+    d -> numFrames = numFrames;
+    d -> frameComp = grow_or_die(NULL, (numFrames + 1) * sizeof(off_t));
+    d -> frameData = grow_or_die(NULL, (numFrames + 1) * sizeof(off_t));
+    d -> frameComp[0] = d -> frameData[0] = 0;
+    for(i = 0; i < numFrames; i++) {
+        const unsigned char *e = entries + i * TABLE_ENTRY_LEN;
+
+        d -> frameComp[i + 1] = d -> frameComp[i] + get_le32(e);
+        d -> frameData[i + 1] = d -> frameData[i] + get_le32(e + 4);
+    }
+}
+
+static void load_zstd_table(struct decompressor *d, off_t fileSize) {
+    unsigned char foot[ZSTD_FOOTER_LEN], *buf;
+    size_t entryLen, tableLen;
+    uint32_t numFrames, i;
+
+    if(fileSize < ZSTD_SKIPPABLE_HEAD + ZSTD_FOOTER_LEN ||
+       !read_at(d -> fd, foot, ZSTD_FOOTER_LEN, fileSize - ZSTD_FOOTER_LEN) ||
+       get_le32(foot + 5) != ZSTD_SEEKABLE_MAGIC) {
+        return;
+    }
+    numFrames = get_le32(foot);
+    entryLen = TABLE_ENTRY_LEN + (foot[4] & ZSTD_CHECKSUM_FLAG ? 4 : 0);
+    tableLen = (size_t)numFrames * entryLen + ZSTD_FOOTER_LEN;
+    if((off_t)(ZSTD_SKIPPABLE_HEAD + tableLen) > fileSize) {
+        return;
+    }
+
+    buf = grow_or_die(NULL, ZSTD_SKIPPABLE_HEAD + tableLen);
+    if(read_at(d -> fd, buf, ZSTD_SKIPPABLE_HEAD + tableLen,
+               fileSize - ZSTD_SKIPPABLE_HEAD - tableLen) &&
+       get_le32(buf) == ZSTD_SKIPPABLE_MAGIC &&
+       get_le32(buf + 4) == tableLen) {
+        /* Pack the entries down over the header and any checksums */
+        for(i = 0; i < numFrames; i++) {
+            memmove(buf + i * TABLE_ENTRY_LEN,
+                    buf + ZSTD_SKIPPABLE_HEAD + i * entryLen,
+                    TABLE_ENTRY_LEN);
+        }
+        set_table(d, buf, numFrames);
+    }
+    free(buf);
+}
+
+/* Length of the subfield in the empty table member at p, which must have
+ * id1 id2 and fit in avail bytes, or -1 */
+static long gzip_member_data(const unsigned char *p, size_t avail,
+                             char id1, char id2) {
+    const unsigned char *sub = p + GZIP_HEAD_LEN + GZIP_XLEN_LEN;
+    long len;
+
+    if(avail < GZIP_MEMBER_LEN(0) || memcmp(p, gzipTableHead, GZIP_HEAD_LEN) ||
+       sub[0] != id1 || sub[1] != id2) {
+        return -1;
+    }
+    len = get_le16(sub + 2);
+    if(get_le16(p + GZIP_HEAD_LEN) != GZIP_SUBFIELD_HEAD + len ||
+       avail < GZIP_MEMBER_LEN(len) ||
+       memcmp(sub + GZIP_SUBFIELD_HEAD + len, gzipEmptyTail, GZIP_TAIL_LEN)) {
+        return -1;
+    }
+    return len;
+}
+
+static void load_gzip_table(struct decompressor *d, off_t fileSize) {
+    unsigned char foot[GZIP_MEMBER_LEN(GZIP_FOOTER_DATA)];
+    unsigned char *buf, *entries, *p;
+    uint64_t tableLen;
+    uint32_t numFrames, got = 0;
+    size_t left;
+    long len;
+
+    if(fileSize < (off_t)sizeof(foot) ||
+       !read_at(d -> fd, foot, sizeof(foot), fileSize - sizeof(foot)) ||
+       gzip_member_data(foot, sizeof(foot), 'M', 'F') != GZIP_FOOTER_DATA) {
+        return;
+    }
+    p = foot + GZIP_HEAD_LEN + GZIP_XLEN_LEN + GZIP_SUBFIELD_HEAD;
+    numFrames = get_le32(p);
+    tableLen = get_le64(p + 4);
+    if(tableLen > (uint64_t)(fileSize - sizeof(foot)) ||
+       tableLen < (uint64_t)numFrames * TABLE_ENTRY_LEN) {
+        return;
+    }
+
+    buf = grow_or_die(NULL, tableLen);
+    entries = grow_or_die(NULL, (size_t)numFrames * TABLE_ENTRY_LEN);
+    if(read_at(d -> fd, buf, tableLen, fileSize - sizeof(foot) - tableLen)) {
+        for(p = buf, left = tableLen; left; p += len, left -= len) {
+            if((len = gzip_member_data(p, left, 'M', 'X')) < 0 ||
+               len % TABLE_ENTRY_LEN ||
+               got + len / TABLE_ENTRY_LEN > numFrames) {
+                break;
+            }
+            memcpy(entries + got * TABLE_ENTRY_LEN,
+                   p + GZIP_HEAD_LEN + GZIP_XLEN_LEN + GZIP_SUBFIELD_HEAD,
+                   len);
+            got += len / TABLE_ENTRY_LEN;
+            len = GZIP_MEMBER_LEN(len);
+        }
+        if(!left && got == numFrames) {
+            set_table(d, entries, numFrames);
+        }
+    }
+    free(buf);
+    free(entries);
+}
+
+/* Reads the next piece of compressed input. Returns 0 at end of file. */
+static int decomp_refill(struct decompressor *d) {
+    ssize_t num;
+
+    if(d -> eof) {
+        return 0;
+    }
+
+    do {
+        num = read(d -> fd, d -> in, d -> inCap);
+    } while(num == -1 && errno == EINTR);
+
+    if(num == -1) {
+        perror("Couldn't read archive");
+        exit(errno);
+    }
+
+    d -> inPos = 0;
+    d -> inLen = num;
+    d -> eof = !num;
+    return num > 0;
+}
+
+static size_t gzip_read(struct decompressor *d, char *dst, size_t n) {
+    z_stream *zs = &d -> x.zs;
+
+    for(;;) {
+        size_t done;
+        int ret;
+
+        if(d -> ended) {
+            if(d -> inPos == d -> inLen && !decomp_refill(d)) {
+                return 0;
+            }
+            /* Another member follows, unless all that is left is padding */
+            if((unsigned char)d -> in[d -> inPos] != gzipMagic[0]) {
+                d -> inPos = d -> inLen;
+                d -> eof = 1;
+                return 0;
+            }
+            inflateReset(zs);
+            d -> ended = 0;
+        }
+
+        zs -> next_in = (Bytef *)d -> in + d -> inPos;
+        zs -> avail_in = d -> inLen - d -> inPos;
+        zs -> next_out = (Bytef *)dst;
+        zs -> avail_out = n;
+
+        ret = inflate(zs, Z_NO_FLUSH);
+        if(ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+            decomp_corrupt(zs -> msg ? zs -> msg : "corrupt data");
+        }
+        d -> inPos = d -> inLen - zs -> avail_in;
+        done = n - zs -> avail_out;
+        d -> ended = ret == Z_STREAM_END;
+
+        if(done) {
+            return done;
+        }
+        if(!d -> ended && d -> inPos == d -> inLen && !decomp_refill(d)) {
+            decomp_truncated();
+        }
+    }
+}
+
+#ifdef HAVE_ZSTD
+static size_t zstd_read(struct decompressor *d, char *dst, size_t n) {
+    ZSTD_outBuffer out;
+
+    out.dst = dst;
+    out.size = n;
+    out.pos = 0;
+
+    for(;;) {
+        ZSTD_inBuffer in;
+
+        in.src = d -> in;
+        in.size = d -> inLen;
+        in.pos = d -> inPos;
+        d -> zret = ZSTD_decompressStream(d -> x.zd, &out, &in);
+        if(ZSTD_isError(d -> zret)) {
+            decomp_corrupt(ZSTD_getErrorName(d -> zret));
+        }
+        d -> inPos = in.pos;
+
+        if(out.pos) {
+            return out.pos;
+        }
+        if(d -> inPos == d -> inLen && !decomp_refill(d)) {
+            if(!d -> zret) {
+                return 0;
+            }
+            decomp_truncated();
+        }
+    }
+}
+#endif
+
+static size_t serial_read(struct decompressor *d, char *dst, size_t n) {
+#ifdef HAVE_ZSTD
+    if(d -> method == COMP_ZSTD) {
+        return zstd_read(d, dst, n);
+    }
+#endif
+    return gzip_read(d, dst, n);
+}
+
+static void *decomp_worker(void *arg) {
+    struct decompressor *d = arg;
+    struct decomp_ctx x;
+    char *src = NULL;
+    size_t srcCap = 0;
+
+    dctx_init(&x, d -> method);
+
+    pthread_mutex_lock(&d -> lock);
+    for(;;) {
+        struct frame_buf *s;
+        size_t srcLen, dataLen;
+        long f;
+
+        while(!d -> closing && (d -> take == d -> numFrames ||
+                                d -> take - d -> flush >= d -> numSlots)) {
+            pthread_cond_wait(&d -> freed, &d -> lock);
+        }
+        if(d -> closing) {
+            break;
+        }
+        f = d -> take++;
+        s = &d -> slots[f % d -> numSlots];
+        pthread_mutex_unlock(&d -> lock);
+
+        srcLen = d -> frameComp[f + 1] - d -> frameComp[f];
+        dataLen = d -> frameData[f + 1] - d -> frameData[f];
+        if(srcLen > srcCap) {
+            src = grow_or_die(src, srcCap = srcLen);
+        }
+        if(dataLen > s -> cap) {
+            s -> data = grow_or_die(s -> data, s -> cap = dataLen);
+        }
+        if(!read_at(d -> fd, src, srcLen, d -> frameComp[f])) {
+            decomp_truncated();
+        }
+        decompress_frame(&x, d -> method, src, srcLen, s -> data, dataLen);
+        s -> len = dataLen;
+
+        pthread_mutex_lock(&d -> lock);
+        s -> state = JOB_DONE;
+        pthread_cond_broadcast(&d -> done);
+    }
+    pthread_mutex_unlock(&d -> lock);
+
+    free(src);
+    dctx_free(&x, d -> method);
+    return NULL;
+}
+
+/* Hands out decompressed frames in order as the workers finish them */
+static size_t parallel_read(struct decompressor *d, char *dst, size_t n) {
+    for(;;) {
+        struct frame_buf *s;
+        size_t avail;
+
+        if(d -> flush == d -> numFrames) {
+            return 0;
+        }
+        s = &d -> slots[d -> flush % d -> numSlots];
+
+        pthread_mutex_lock(&d -> lock);
+        while(s -> state != JOB_DONE) {
+            pthread_cond_wait(&d -> done, &d -> lock);
+        }
+        pthread_mutex_unlock(&d -> lock);
+
+        if((avail = s -> len - d -> slotPos)) {
+            if(avail > n) {
+                avail = n;
+            }
+            memcpy(dst, s -> data + d -> slotPos, avail);
+            d -> slotPos += avail;
+            return avail;
+        }
+
+        pthread_mutex_lock(&d -> lock);
+        s -> state = JOB_FREE;
+        d -> flush++;
+        d -> slotPos = 0;
+        pthread_cond_broadcast(&d -> freed);
+        pthread_mutex_unlock(&d -> lock);
+    }
+}
+
+/* Starts decompressing fd. pre holds bytes of the stream that were already
+ * read from it while detecting the format. The frame table of a regular
+ * file read from its start is loaded if it has one. */
+struct decompressor *decomp_start(int fd, int method, const char *pre,
+                                  size_t preLen) {
+    struct decompressor *d;
+    struct stat sb;
+
+    if(!comp_supported(method)) {
+        fprintf(stderr, "Archive is zstd compressed, but this mytar was "
+                "built without zstd support\n");
+        exit(EXIT_FAILURE);
+    }
+
+    errno = 0;
+    d = calloc(1, sizeof(struct decompressor));
+    if(errno) {
+        perror("Couldn't calloc decompressor");
+        exit(errno);
+    }
+    d -> fd = fd;
+    d -> method = method;
+    d -> inCap = preLen > DECOMP_IN_SIZE ? preLen : DECOMP_IN_SIZE;
+    if(!(d -> in = malloc(d -> inCap))) {
+        perror("Couldn't malloc decompression buffer");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(d -> in, pre, preLen);
+    d -> inLen = preLen;
+    dctx_init(&d -> x, method);
+
+    if(fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) &&
+       lseek(fd, 0, SEEK_CUR) == (off_t)preLen) {
+        if(method == COMP_GZIP) {
+            load_gzip_table(d, sb.st_size);
+        }
+        else {
+            load_zstd_table(d, sb.st_size);
+        }
+    }
+    return d;
+}
+
+/* Whether decomp_seek() can jump to any offset */
+int decomp_seekable(struct decompressor *d) {
+    return d -> frameData && !d -> threads;
+}
+
+/* Index of the frame holding an uncompressed offset, numFrames past the
+ * end */
+static long find_frame(struct decompressor *d, off_t offset) {
+    long lo = 0, hi = d -> numFrames;
+
+    while(lo < hi) {
+        long mid = lo + (hi - lo + 1) / 2;
+
+        if(d -> frameData[mid] <= offset) {
+            lo = mid;
+        }
+        else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+/* Moves to an uncompressed offset by restarting at the frame holding it.
+ * Returns 0, having done nothing, if there is no frame table or the offset
+ * is further on in the current frame, where reading through is cheaper. */
+int decomp_seek(struct decompressor *d, off_t offset) {
+    long f;
+
+    if(!decomp_seekable(d)) {
+        return 0;
+    }
+    f = find_frame(d, offset);
+    if(offset >= d -> offset && f == find_frame(d, d -> offset)) {
+        return 0;
+    }
+
+    if(lseek(d -> fd, d -> frameComp[f], SEEK_SET) == -1) {
+        perror("Couldn't lseek in archive");
+        exit(errno);
+    }
+    dctx_reset(&d -> x, d -> method);
+    d -> inPos = d -> inLen = 0;
+    d -> eof = 0;
+    d -> ended = 0;
+#ifdef HAVE_ZSTD
+    d -> zret = 0;
+#endif
+    d -> offset = offset;
+    d -> discard = offset - d -> frameData[f];
+    return 1;
+}
+
+/* Has numThreads threads decompress whole frames ahead of the reader from
+ * now on. Needs a frame table and must come before the first read, else
+ * it does nothing. Seeking is off afterwards. */
+void decomp_parallel(struct decompressor *d, int numThreads) {
+    int i;
+
+    if(numThreads <= 1 || !d -> frameData || d -> threads || d -> offset) {
+        return;
+    }
+
+    d -> numThreads = numThreads;
+    d -> numSlots = numThreads * COMP_AHEAD;
+    pthread_mutex_init(&d -> lock, NULL);
+    pthread_cond_init(&d -> freed, NULL);
+    pthread_cond_init(&d -> done, NULL);
+
+    errno = 0;
+    d -> slots = calloc(d -> numSlots, sizeof(struct frame_buf));
+    d -> threads = calloc(numThreads, sizeof(pthread_t));
+    if(errno) {
+        perror("Couldn't calloc decompressor");
+        exit(errno);
+    }
+    for(i = 0; i < numThreads; i++) {
+        if((errno = pthread_create(&d -> threads[i], NULL, decomp_worker,
+                                   d))) {
+            perror("Couldn't start decompression thread");
+            exit(errno);
+        }
+    }
+}
+
+/* Fills dst with up to n bytes of the decompressed stream. Returns 0 only
+ * at its end. */
+size_t decomp_read(struct decompressor *d, char *dst, size_t n) {
+    size_t got;
+
+    if(d -> threads) {
+        got = parallel_read(d, dst, n);
+        d -> offset += got;
+        return got;
+    }
+
+    /* Catch up with a seek into the middle of a frame */
+    while(d -> discard) {
+        got = serial_read(d, dst, d -> discard < (off_t)n ?
+                                  (size_t)d -> discard : n);
+        if(!got) {
+            decomp_truncated();
+        }
+        d -> discard -= got;
+    }
+
+    got = serial_read(d, dst, n);
+    d -> offset += got;
+    return got;
+}
+
+void decomp_finish(struct decompressor *d) {
+    int i;
+
+    if(d -> threads) {
+        pthread_mutex_lock(&d -> lock);
+        d -> closing = 1;
+        pthread_cond_broadcast(&d -> freed);
+        pthread_mutex_unlock(&d -> lock);
+        for(i = 0; i < d -> numThreads; i++) {
+            pthread_join(d -> threads[i], NULL);
+        }
+
+        pthread_mutex_destroy(&d -> lock);
+        pthread_cond_destroy(&d -> freed);
+        pthread_cond_destroy(&d -> done);
+        for(i = 0; i < d -> numSlots; i++) {
+            free(d -> slots[i].data);
+        }
+        free(d -> slots);
+        free(d -> threads);
+    }
+
+    dctx_free(&d -> x, d -> method);
+    free(d -> frameComp);
+    free(d -> frameData);
+    free(d -> in);
+    free(d);
+}
@@ -0,0 +1,55 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Compression stage between the archive buffer and its fd. The writer cuts
+ * the stream into COMP_CHUNK sized pieces and compresses each one on its
+ * own, in parallel, as a complete gzip member or zstd frame; any gzip or
+ * zstd tool reads the result as one stream. A table of frame sizes goes
+ * at the end (zstd's seekable format, or empty gzip members carrying it
+ * in their extra field), so that readers of a regular file can restart at
+ * any frame, or decompress several frames at once. Readers pick the format
+ * from the first bytes. zstd needs HAVE_ZSTD. */
+
+#define COMP_NONE 0
+#define COMP_GZIP 1
+#define COMP_ZSTD 2
+
+/* Uncompressed bytes per gzip member or zstd frame */
+#define COMP_CHUNK (1024 * 1024)
+/* Chunks queued or in progress per compression thread */
+#define COMP_AHEAD 2
+#define COMP_GZIP_LEVEL 6
+#define COMP_ZSTD_LEVEL 3
+/* Enough of the stream to tell the formats apart */
+#define COMP_MAGIC_LEN 4
+
+struct compressor;
+struct decompressor;
+
+int comp_supported(int method);
+
+int comp_detect(const unsigned char *head, size_t n);
+
+struct compressor *comp_start(int fd, int method, int numThreads);
+
+void comp_write(struct compressor *c, const char *src, size_t n);
+
+void comp_finish(struct compressor *c);
+
+struct decompressor *decomp_start(int fd, int method, const char *pre,
+                                  size_t preLen);
+
+int decomp_seekable(struct decompressor *d);
+
+int decomp_seek(struct decompressor *d, off_t offset);
+
+void decomp_parallel(struct decompressor *d, int numThreads);
+
+size_t decomp_read(struct decompressor *d, char *dst, size_t n);
+
+void decomp_finish(struct decompressor *d);
+
+#endif
@@ -4,9 +4,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
-#include <pwd.h>
 #include <stdlib.h>
-#include <grp.h>
 #include <dirent.h>
 #include <fcntl.h>
 
@@ -14,9 +12,20 @@
 #include "util.h"
 #include "header.h"
 #include "given.h"
+#include "codec.h"
+#include "blockio.h"
+#include "mytar.h"
+#include "walk.h"
+#include "idcache.h"
+#include "index.h"
+#include "pax.h"
+#include "hardlink.h"
+#include "snapshot.h"
+#include "dedup.h"
+#include "append.h"
 
 #define MAX_NAME 100
-#define MAX_PATH 256
+#define PREFIX_SIZE 155
 #define BLK_SIZE 512
 #define LNK_SIZE 100
 #define UID_SIZE 8
@@ -28,100 +37,79 @@
 #define MTIME_MAX 077777777777
 #define ALL_PERMS 07777 
 #define REG_FLAG '0'
+#define HARDLINK_FLAG '1'
 #define LINK_FLAG '2'
 #define DIR_FLAG '5'
-
+/* Where old readers put the body of a sparse member */
+#define SPARSE_DIR "GNUSparseFile.0/"
+
+/* Set when create was asked for a sidecar index ('i') */
+static struct idx_builder *index_builder;
+/* Files with several links that are already in the archive */
+static struct hlink_table *hard_links;
+/* Set when create was asked to store repeated contents once ('D') */
+static struct dedup_table *dedup;
+/* Set for incremental create ('g'): what was archived last time, and
+ * what will have been archived after this run */
+static struct snapshot *snapshot_old;
+static struct snap_builder *snapshot_new;
+/* Set for update ('u'): what the archive already holds */
+static struct archived *archived;
+/* Where 'v' lists members; stderr when the archive itself is on stdout */
+static FILE *verbose_out;
+
+/* Names come from the per run cache. An id without a name just leaves
+ * the field empty; readers fall back to the numeric id. */
 void set_uname(uid_t uid, char *dest){
-    struct passwd *pw;
-    char *name = (char *)malloc(NAME_SIZE);
-
-    if(!name){
-        perror("malloc");
-        exit(EXIT_FAILURE);
-    }
-
-    if (!(pw = getpwuid(uid))){
-        perror("uid not found");
-        exit(EXIT_FAILURE);
-    }
+    const char *name = idcache_uname(uid);
 
-    if (strlen(pw -> pw_name) >= NAME_SIZE){
-        strncpy(name, pw -> pw_name, NAME_SIZE - 1);
+    if (name){
+        strncpy(dest, name, NAME_SIZE - 1);
     }
-
-    else{
-        strcpy(name, pw -> pw_name);
-    }
-
-    strcpy(dest, name);
-    free(name);
     return;
 }
 
 void set_grname(gid_t gid, char *dest){
+    const char *name = idcache_gname(gid);
 
-    struct group *g;
-    char *name = (char *)malloc(NAME_SIZE);
-
-    if(!name){
-        perror("malloc");
-        exit(EXIT_FAILURE);
+    if (name){
+        strncpy(dest, name, NAME_SIZE - 1);
     }
-
-    if (!(g = getgrgid(gid))){
-        perror("gid not found");
-        exit(EXIT_FAILURE);
-    }
-
-    if (strlen(g -> gr_name) >= NAME_SIZE){
-        strncpy(name, g -> gr_name, NAME_SIZE - 1);
-    }
-
-    else{
-        strcpy(name, g -> gr_name);
-    }
-
-    strcpy(dest, name);
-    free(name);
     return;
 }
 
 /* returns the index that fits as much of the last part of "path"
- * into 100 chars */
+ * into 100 chars, or -1 if there is no '/' to split at that leaves
+ * the rest for the 155 char prefix */
 int splice_name(char *path){
 
     int idx = (strlen(path) - 1) - MAX_NAME;
 
     while (path[idx] != '/'){
         if(!path[idx]){
-            perror("path too long");
             return -1;
         }
         idx++;
     }
 
+    if (idx > PREFIX_SIZE){
+        return -1;
+    }
+
     return idx;
 
 }
 
-int write_header(char *path, int outfile, struct stat *sb,
-                 char typeflg, int strictBool, int verboseBool){
-
-    struct header h;
-
-    /* to deal with padding 0s at the end */
-    memset(&h, 0, BLK_SIZE);
-
-    if (verboseBool){
-            printf("%s\n", path);
-        }
+/* puts path in the name and prefix fields. Returns -1 if it doesn't fit,
+ * leaving as much of it there as does. */
+int put_name(struct header *h, char *path){
 
     if (strlen(path) <= MAX_NAME){
         if (strlen(path) == MAX_NAME){
-            strncpy(h.name, path, MAX_NAME);
+            strncpy(h -> name, path, MAX_NAME);
         }
         else{
-            strcpy(h.name, path);
+            strcpy(h -> name, path);
         }
     }
 
@@ -129,58 +117,135 @@ int write_header(char *path, int outfile, struct stat *sb,
     else{
         int splice_idx = splice_name(path);
         if (splice_idx == -1){
+            memcpy(h -> name, path, MAX_NAME);
             return -1;
         }
         if (strlen(path + splice_idx + 1) == MAX_NAME){
-            strncpy(h.name, path + splice_idx + 1, MAX_NAME);
+            strncpy(h -> name, path + splice_idx + 1, MAX_NAME);
         }
         else{
-            strcpy(h.name, path + splice_idx + 1);
+            strcpy(h -> name, path + splice_idx + 1);
+        }
+        strncpy(h -> prefix, path, splice_idx);
+    }
+
+    return 0;
+}
+
+/* reads where the symlink path points, into a buffer the caller frees */
+char *read_link(char *path, struct stat *sb){
+    size_t cap = sb -> st_size > 0 ? sb -> st_size + 1 : LNK_SIZE;
+    char *target = NULL;
+    ssize_t len;
+
+    for (;;){
+        if (!(target = realloc(target, cap))){
+            perror("realloc");
+            exit(EXIT_FAILURE);
         }
-        strncpy(h.prefix, path, splice_idx);
+        if ((len = readlink(path, target, cap)) == -1){
+            perror("readlink");
+            target[0] = '\0';
+            return target;
+        }
+        /* it may have changed since the lstat() */
+        if ((size_t)len < cap){
+            target[len] = '\0';
+            return target;
+        }
+        cap *= 2;
+    }
+}
+
+/* linkname is the member a hard link ('1') points at, NULL otherwise.
+ * Whatever doesn't fit the ustar header goes in an extended header first,
+ * unless strictBool asks for plain ustar. */
+int write_header(char *path, struct archive_io *out, struct stat *sb,
+                 char typeflg, const char *linkname, int strictBool,
+                 int verboseBool){
+
+    struct header h;
+    struct pax_buf pax;
+    char *target = NULL;
+    int exact_mtime = 0;
+
+    /* to deal with padding 0s at the end */
+    memset(&h, 0, BLK_SIZE);
+    memset(&pax, 0, sizeof(pax));
+
+    if (verboseBool){
+            fprintf(verbose_out, "%s\n", path);
+        }
+
+    if (put_name(&h, path) == -1){
+        if (strictBool){
+            perror("path too long");
+            return -1;
+        }
+        pax_add(&pax, PAX_PATH, path);
+    }
+
+    if (S_ISLNK(sb -> st_mode)){
+        target = read_link(path, sb);
+        linkname = target;
+    }
+    if (linkname && strlen(linkname) > LNK_SIZE){
+        if (strictBool){
+            perror("link too long");
+            free(target);
+            return -1;
+        }
+        pax_add(&pax, PAX_LINKPATH, linkname);
     }
 
     if (sb -> st_uid > UID_MAX){
         if (strictBool){
             perror("Uid too large");
+            free(target);
             return -1;
         }
         insert_special_int(h.uid, UID_SIZE, sb -> st_uid);
     }
     else{
-        sprintf(h.uid, "%07o", (int) sb -> st_uid);
+        hdr_put_octal(h.uid, sizeof(h.uid), sb -> st_uid);
     }
 
     if (sb -> st_gid > GID_MAX){
         if (strictBool){
             perror("Gid too large");
+            free(target);
             return -1;
         }
         insert_special_int(h.gid, UID_SIZE, sb -> st_gid);
     }
 
     else{
-        sprintf(h.gid, "%07o", (int) sb -> st_gid);
+        hdr_put_octal(h.gid, sizeof(h.gid), sb -> st_gid);
     }
 
-    /* check if its a file since dir and symlinks must be size 0 */
-    if(S_ISREG(sb -> st_mode)){
+    /* check if its a file since dir and symlinks must be size 0, and so
+     * must hard links, which have no body of their own. Directories
+     * written with their listing carry it as a body. */
+    if((S_ISREG(sb -> st_mode) && typeflg != HARDLINK_FLAG) ||
+       typeflg == DUMPDIR_FLAG){
 
         if (sb -> st_size > _SIZE_MAX){
             if (strictBool){
                 perror("size too big");
+                free(target);
                 return -1;
             }
             insert_special_int(h.size, MTM_SIZE, sb -> st_size);
+            pax_add_num(&pax, PAX_SIZE, sb -> st_size);
         }
 
         else{
-            sprintf(h.size, "%011o", (int)sb -> st_size);
+            hdr_put_octal(h.size, sizeof(h.size), sb -> st_size);
         }
     }
 
     else{
-        sprintf(h.size, "%011o", 0);
+        hdr_put_octal(h.size, sizeof(h.size), 0);
     }
 
     *h.typeflag = typeflg;
@@ -188,183 +253,591 @@ int write_header(char *path, int outfile, struct stat *sb,
     if (sb -> st_mtime > MTIME_MAX){
         if (strictBool){
             perror("mtime too big");
+            free(target);
             return -1;
         }
         insert_special_int(h.mtime, MTM_SIZE, sb -> st_mtime);
+        exact_mtime = 1;
     }
 
     else{
-        sprintf(h.mtime, "%011o", (int) sb -> st_mtime);
+        hdr_put_octal(h.mtime, sizeof(h.mtime), sb -> st_mtime);
     }
 
-    if (S_ISLNK(sb -> st_mode)){
-        readlink(path, h.linkname, LNK_SIZE);
+    /* the field needs no terminator when the target fills it */
+    if (linkname){
+        size_t len = strlen(linkname);
+
+        memcpy(h.linkname, linkname, len < LNK_SIZE ? len : LNK_SIZE);
     }
 
     /* & with 07777 since we only want the permissions part of the field */
-    sprintf(h.mode, "%07o", sb -> st_mode & ALL_PERMS);
+    hdr_put_octal(h.mode, sizeof(h.mode), sb -> st_mode & ALL_PERMS);
 
     strcpy(h.magic, "ustar");
     strcpy(h.version, "00");
     set_uname(sb -> st_uid, (char *)&h.uname);
     set_grname(sb -> st_gid, (char *)&h.gname);
-    sprintf(h.chksum, "%07o", calc_checksum((unsigned char *)&h));
-
-    if (write(outfile, &h, BLK_SIZE) == -1){
-        perror("write");
-        exit(EXIT_FAILURE);
+    hdr_put_octal(h.chksum, sizeof(h.chksum),
+                  calc_checksum((unsigned char *)&h));
+
+    /* an extended header costs a block or two anyway, so it might as well
+     * have the mtime to the nanosecond */
+    if (pax.len || exact_mtime){
+        pax_add_time(&pax, PAX_MTIME, sb -> st_mtim.tv_sec,
+                     sb -> st_mtim.tv_nsec);
+        pax_write(out, path, sb -> st_mtime, &pax);
     }
+    aio_write(out, &h, BLK_SIZE);
+    free(target);
 
     return 0;
 
 }
 
-void write_content (int infile, int outfile){
+/* copies exactly the size recorded in the header, then pads to a block */
+void write_content (int infile, struct archive_io *out, off_t size){
+
+    aio_copy_from_fd(out, infile, size);
+    aio_pad_block(out);
+
+    return;
+
+}
+
+/* Archives a file with holes in GNU's sparse format 1.0: an extended
+ * header with its real name and size, then a regular member holding the
+ * map of its data extents and only those */
+int write_sparse(char *path, struct archive_io *out, struct stat *sb,
+                 int infile, struct sparse_map *map, int verboseBool){
+    struct pax_buf pax;
+    struct stat body = *sb;
+    char name[MAX_NAME];
+    const char *base = strrchr(path, '/');
+    size_t i;
+
+    memset(&pax, 0, sizeof(pax));
+    pax_add_num(&pax, "GNU.sparse.major", 1);
+    pax_add_num(&pax, "GNU.sparse.minor", 0);
+    pax_add(&pax, "GNU.sparse.name", path);
+    pax_add_num(&pax, "GNU.sparse.realsize", sb -> st_size);
+
+    snprintf(name, sizeof(name), "%s%s", SPARSE_DIR, base ? base + 1 : path);
+    body.st_size = sparse_map_size(map) + sparse_data_size(map);
 
-    ssize_t num;
-    char buff[BLK_SIZE];
-    memset(buff, 0, BLK_SIZE);
+    if (verboseBool){
+        fprintf(verbose_out, "%s\n", path);
+    }
+    pax_write(out, path, sb -> st_mtime, &pax);
+    if (write_header(name, out, &body, REG_FLAG, NULL, 0, 0) == -1){
+        return -1;
+    }
 
-    while((num = read(infile, buff, BLK_SIZE)) > 0){
-        if (write(outfile, buff, BLK_SIZE) == -1){
-            perror("write");
+    sparse_write_map(out, map);
+    for (i = 0; i < map -> count; i++){
+        if (lseek(infile, map -> extents[i].offset, SEEK_SET) == -1){
+            perror("lseek");
             exit(EXIT_FAILURE);
         }
-        memset(buff, 0, BLK_SIZE);
+        aio_copy_from_fd(out, infile, map -> extents[i].size);
     }
+    aio_pad_block(out);
 
-    return;
+    return 0;
+}
 
+/* Nonzero if an incremental create can leave path out, because it is in
+ * the last snapshot just as it is now. Directories always go in. */
+int unchanged(const char *path, const struct stat *sb){
+    return snapshot_old && !S_ISDIR(sb -> st_mode) &&
+           snap_unchanged(snapshot_old, path, sb);
 }
 
-void archive(char *path, int outfile, int verboseBool, int strictBool){
-    struct stat sb;
+/* Nonzero if a regular file or symlink won't go in this time: it is
+ * unchanged since the last snapshot, or ('u') the archive already has it
+ * at least as new */
+int left_out(const char *path, const struct stat *sb){
+    return unchanged(path, sb) ||
+           (archived && !archived_newer(archived, path, sb -> st_mtime));
+}
 
-    if (lstat(path, &sb) == -1){
-        perror("stat");
+/* adds one thing in a directory to the directory's listing */
+void list_kid(struct dumpdir *listing, const char *path,
+              const struct stat *sb){
+    char code = DUMPDIR_ARCHIVED;
+
+    if (S_ISDIR(sb -> st_mode)){
+        code = DUMPDIR_DIR;
+    }
+    /* including things that never get archived, so that extracting the
+     * listing doesn't take them for deleted */
+    else if ((!S_ISREG(sb -> st_mode) && !S_ISLNK(sb -> st_mode)) ||
+             unchanged(path, sb)){
+        code = DUMPDIR_UNCHANGED;
+    }
+    dumpdir_add(listing, code, path);
+}
+
+/* writes the member for one file system object. For regular files the
+ * first pre_len bytes of the body may already have been read into pre, with
+ * infile open just past them; with no pre the file is opened here. Incremental
+ * creates pass directories with their listing. */
+void emit_member(char *path, struct stat *sb, struct archive_io *out,
+                 int infile, const char *pre, size_t pre_len,
+                 const struct dumpdir *listing, int verboseBool,
+                 int strictBool){
+    /* Index entries point at the first header, extended or not */
+    off_t start = out -> offset;
+    int written = 0;
+    char typeflg = 0;
+
+    /* Directories are listed anew every time, so only what they hold
+     * needs remembering */
+    if (snapshot_new && (S_ISREG(sb -> st_mode) || S_ISLNK(sb -> st_mode))){
+        snap_add(snapshot_new, path, sb);
+        if (unchanged(path, sb)){
+            return;
+        }
+    }
+    if (archived && !archived_newer(archived, path, sb -> st_mtime)){
         return;
     }
 
-    /* if it is a directory */
-    if (S_ISDIR(sb.st_mode)){
-        DIR *d;
-        struct dirent *e;
-        char *new_path = (char *)malloc(MAX_PATH);
+    if (S_ISDIR(sb -> st_mode) && listing){
+        struct stat body = *sb;
 
-        if (!new_path){
-            perror("malloc");
-            exit(EXIT_FAILURE);
+        typeflg = DUMPDIR_FLAG;
+        body.st_size = listing -> len;
+        if (write_header(path, out, &body, typeflg, NULL, strictBool,
+                         verboseBool) != -1){
+            aio_write(out, listing -> data, listing -> len);
+            aio_pad_block(out);
+            written = 1;
         }
+    }
 
-        if (strlen(path) >= MAX_PATH - 1){
-            fprintf(stderr, "path too long");
-            free(new_path);
-            return;
+    else if (S_ISDIR(sb -> st_mode)){
+        typeflg = DIR_FLAG;
+        written = write_header(path, out, sb, typeflg, NULL, strictBool,
+                               verboseBool) != -1;
+    }
+
+    else if (S_ISREG(sb -> st_mode)){
+        struct sparse_map map;
+        const char *target = NULL;
+        int opened = 0;
+
+        /* Another name for a file already archived: store just the link.
+         * Without an extended header, only if the first name fits. */
+        if (sb -> st_nlink > 1){
+            target = hlink_find(hard_links, sb -> st_dev, sb -> st_ino,
+                                sb -> st_nlink, path);
+        }
+        if (target && (!strictBool || strlen(target) <= LNK_SIZE)){
+            typeflg = HARDLINK_FLAG;
+            written = write_header(path, out, sb, typeflg, target,
+                                   strictBool, verboseBool) != -1;
         }
 
-        strcat(path, "/");
+        else{
+            if (!pre){
+                if ((infile = open(path, O_RDONLY)) == -1){
+                    perror("open");
+                    exit(EXIT_FAILURE);
+                }
+                opened = 1;
+            }
 
-        write_header(path, outfile, &sb, DIR_FLAG, strictBool, verboseBool);
+            typeflg = REG_FLAG;
+            /* The same bytes and metadata as a file already archived:
+             * link to that */
+            target = NULL;
+            if (dedup && sb -> st_size > 0){
+                target = dedup_find(dedup, path, sb, infile, pre, pre_len);
+            }
+            if (target && (!strictBool || strlen(target) <= LNK_SIZE)){
+                typeflg = HARDLINK_FLAG;
+                written = write_header(path, out, sb, typeflg, target,
+                                       strictBool, verboseBool) != -1;
+            }
+            /* S keeps the archive plain ustar, so holes are stored as
+             * zeros. Files read ahead whole come without infile unless
+             * they're short of blocks and may have holes. */
+            else if (!strictBool && infile != -1 &&
+                sparse_scan(infile, sb, &map)){
+                written = write_sparse(path, out, sb, infile, &map,
+                                       verboseBool) != -1;
+                sparse_free(&map);
+            }
+            else if((write_header(path, out, sb, REG_FLAG, NULL,
+                             strictBool, verboseBool)) != -1){
+                aio_write(out, pre, pre_len);
+                write_content(infile, out, sb -> st_size - pre_len);
+                written = 1;
+            }
 
-        if(!(d = opendir(path))){
-            perror("opendir");
-            exit(EXIT_FAILURE);
+            if (opened){
+                close(infile);
+            }
         }
+    }
 
-        /*recursive aspect */
-        while ((e = readdir(d))){
-            if (strcmp(e -> d_name, ".") && strcmp(e -> d_name, "..")){
+    else if (S_ISLNK(sb -> st_mode)){
+        typeflg = LINK_FLAG;
+        written = write_header(path, out, sb, typeflg, NULL, strictBool,
+                               verboseBool) != -1;
+    }
 
-                if ((strlen(path) + strlen(e -> d_name)) < MAX_PATH){
-                    strcpy(new_path, path);
-                    strcat(new_path, e -> d_name);
-                    archive(new_path, outfile, verboseBool, strictBool);
-                }
+    if (written && index_builder){
+        idx_add(index_builder, path, start, typeflg == REG_FLAG ?
+                sb -> st_size : 0, typeflg, sb -> st_mtime);
+    }
 
-                else{
-                    perror("path too long");
-                }
+    return;
+}
+
+/* One thing in a directory, looked at before the directory's own member
+ * is written so that its listing can go in there */
+struct dir_kid {
+    char *path;
+    struct stat sb;
+};
+
+/* reads and lstat()s everything in the directory path, which ends in '/',
+ * in readdir() order. Things that can't be archived are left out. Kid
+ * paths have room for the '/' archive_tree() adds to directories. */
+struct dir_kid *read_kids(char *path, size_t *num_kids){
+    DIR *d;
+    struct dirent *e;
+    struct dir_kid *kids = NULL;
+    size_t cap = 0;
+
+    *num_kids = 0;
+    if(!(d = opendir(path))){
+        perror("opendir");
+        exit(EXIT_FAILURE);
+    }
+
+    while ((e = readdir(d))){
+        struct dir_kid *kid;
+        size_t len;
+
+        if (!strcmp(e -> d_name, ".") || !strcmp(e -> d_name, "..")){
+            continue;
+        }
+        len = strlen(path) + strlen(e -> d_name);
+
+        if (*num_kids == cap){
+            cap = cap ? cap * 2 : 16;
+            if (!(kids = realloc(kids, cap * sizeof(struct dir_kid)))){
+                perror("realloc");
+                exit(EXIT_FAILURE);
             }
         }
-        closedir(d);
-        free(new_path);
+        kid = &kids[*num_kids];
+        if (!(kid -> path = malloc(len + 2))){
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        strcpy(kid -> path, path);
+        strcat(kid -> path, e -> d_name);
+
+        if (lstat(kid -> path, &kid -> sb) == -1){
+            perror("stat");
+            free(kid -> path);
+            continue;
+        }
+        (*num_kids)++;
     }
+    closedir(d);
+
+    return kids;
+}
 
-    /* if it is a regular file */
-    else if (S_ISREG(sb.st_mode)){
-        int infile;
+/* archives path, already lstat()ed into sb, and everything under it */
+void archive_tree(char *path, struct stat *sb, struct archive_io *out,
+                  int verboseBool, int strictBool){
 
-        if ((infile = open(path, O_RDONLY)) == -1){
-            perror("open");
-            exit(EXIT_FAILURE);
+    /* if it is a directory */
+    if (S_ISDIR(sb -> st_mode)){
+        struct dir_kid *kids;
+        struct dumpdir listing;
+        size_t num_kids, i;
+
+        strcat(path, "/");
+        kids = read_kids(path, &num_kids);
+
+        memset(&listing, 0, sizeof(listing));
+        if (snapshot_new){
+            for (i = 0; i < num_kids; i++){
+                list_kid(&listing, kids[i].path, &kids[i].sb);
+            }
+            dumpdir_end(&listing);
         }
+        emit_member(path, sb, out, -1, NULL, 0,
+                    snapshot_new ? &listing : NULL, verboseBool, strictBool);
+        free(listing.data);
 
-        if((write_header(path, outfile, &sb, REG_FLAG,
-                         strictBool, verboseBool)) != -1){
-            write_content(infile, outfile);
+        /*recursive aspect */
+        for (i = 0; i < num_kids; i++){
+            archive_tree(kids[i].path, &kids[i].sb, out, verboseBool,
+                         strictBool);
+            free(kids[i].path);
         }
-        close(infile);
+        free(kids);
     }
 
-    else if (S_ISLNK(sb.st_mode)){
-        write_header(path, outfile, &sb, LINK_FLAG, strictBool, verboseBool);
+    /* regular files and symlinks */
+    else{
+        emit_member(path, sb, out, -1, NULL, 0, NULL, verboseBool,
+                    strictBool);
     }
 
     return;
 
 }
 
-/* make start an array of paths */
-int create_cmd(int verboseBool, int strictBool, int num_paths,
-                char *outfile_name, char **paths) {
+void archive(char *path, struct archive_io *out, int verboseBool,
+             int strictBool){
+    struct stat sb;
+
+    if (lstat(path, &sb) == -1){
+        perror("stat");
+        return;
+    }
+    archive_tree(path, &sb, out, verboseBool, strictBool);
+}
+
+/* Same output as calling archive() on each path, but the tree is walked
+ * and files are read ahead by num_jobs threads while we write */
+void archive_parallel(char **paths, int num_paths, struct archive_io *out,
+                      struct tar_opts *opts){
+    struct walk *w;
+    struct walk_entry e;
+
+    /* Files left out of an incremental create or an update aren't
+     * worth reading */
+    w = walk_start(paths, num_paths, opts -> numJobs,
+                   snapshot_old || archived ? left_out : NULL);
+
+    while (walk_next(w, &e)){
+        struct dumpdir listing;
+        const char *kid_path;
+        const struct stat *kid_sb;
+        int i;
+
+        memset(&listing, 0, sizeof(listing));
+        if (snapshot_new && S_ISDIR(e.sb -> st_mode)){
+            for (i = 0; i < walk_kids(&e); i++){
+                if (walk_kid(&e, i, &kid_path, &kid_sb)){
+                    list_kid(&listing, kid_path, kid_sb);
+                }
+            }
+            dumpdir_end(&listing);
+        }
+        emit_member(e.path, e.sb, out, e.fd, e.data, e.dataLen,
+                    listing.data ? &listing : NULL, opts -> verboseBool,
+                    opts -> strictBool);
+        free(listing.data);
+        walk_release(w, &e);
+    }
 
-    int outfile, i = 0;
-    char *path, *stop_blocks;
+    walk_finish(w);
+}
 
-    outfile = open(outfile_name, O_RDWR | O_CREAT | O_TRUNC,
-                   S_IRUSR | S_IWUSR | S_IRGRP);
+/* Archives paths through out, which is open on outfile, then writes the
+ * end of archive blocks and anything that goes alongside. Appending
+ * cuts off whatever of the old archive is left beyond the new end. */
+void write_archive(struct tar_opts *opts, int num_paths, char **paths,
+                   struct archive_io *out, int outfile, char *outfile_name,
+                   int appendBool){
 
-    if(outfile == -1){
-        perror("open");
-        exit(EXIT_FAILURE);
+    int i = 0;
+    char *stop_blocks;
+
+    hard_links = hlink_open();
+    if (opts -> dedupBool){
+        dedup = dedup_open();
+    }
+    if (opts -> snapshotName){
+        snapshot_old = snap_open(opts -> snapshotName);
+        snapshot_new = snap_begin();
     }
 
-    path = (char *) malloc(MAX_PATH);
     stop_blocks = (char *)malloc(BLK_SIZE * 2);
 
-    if (!path || !stop_blocks){
+    if (!stop_blocks){
         perror("malloc");
         exit(EXIT_FAILURE);
     }
 
-    memset(stop_blocks, 0, BLK_SIZE);
+    memset(stop_blocks, 0, BLK_SIZE * 2);
 
     if (num_paths == 0){
         paths[0] = ".";
         num_paths = 1;
     }
 
+    if (opts -> numJobs > 1){
+        for (i = 0; i < num_paths; i++){
+            size_t len = strlen(paths[i]);
+            if (len > 1 && paths[i][len - 1] == '/'){
+                paths[i][len - 1] = '\0';
+            }
+        }
+        archive_parallel(paths, num_paths, out, opts);
+        num_paths = 0;
+    }
+
     while(num_paths){
 
+        /* with room for the '/' a directory gets */
+        char *path = malloc(strlen(paths[i]) + 2);
+
+        if (!path){
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
         strcpy(path, paths[i]);
         if (path[strlen(path) - 1] == '/'){
             path[strlen(path) - 1] = '\0';
         }
-        archive(path, outfile, verboseBool, strictBool);
-
+        archive(path, out, opts -> verboseBool, opts -> strictBool);
+    
         i++;
         num_paths--;
     }
 
 
-    if (write(outfile, stop_blocks, BLK_SIZE * 2) == -1){
-        perror("write");
+    aio_write(out, stop_blocks, BLK_SIZE * 2);
+    aio_close(out);
+    if (appendBool && ftruncate(outfile, lseek(outfile, 0, SEEK_CUR))){
+        perror("Couldn't truncate archive");
         exit(EXIT_FAILURE);
     }
+    hlink_close(hard_links);
+    hard_links = NULL;
+    if (dedup){
+        dedup_close(dedup);
+        dedup = NULL;
+    }
+
+    /* Only once the archive is complete, so a failed run can be redone */
+    if (snapshot_new){
+        snap_write(snapshot_new, opts -> snapshotName);
+        snapshot_new = NULL;
+    }
+    if (snapshot_old){
+        snap_close(snapshot_old);
+        snapshot_old = NULL;
+    }
+
+    /* After the last write, so the index matches the archive's mtime */
+    if (index_builder){
+        idx_write(index_builder, outfile_name, outfile);
+        index_builder = NULL;
+    }
 
-    free(path);
     free(stop_blocks);
-    close(outfile);
+}
+
+/* make start an array of paths */
+int create_cmd(struct tar_opts *opts, int num_paths,
+                char *outfile_name, char **paths) {
+
+    int outfile;
+    struct archive_io *out;
+
+    verbose_out = stdout;
+    if (!strcmp(outfile_name, STDIO_ARCHIVE)){
+        outfile = STDOUT_FILENO;
+        verbose_out = stderr;
+    }
+    else{
+        outfile = open(outfile_name, O_RDWR | O_CREAT | O_TRUNC,
+                       S_IRUSR | S_IWUSR | S_IRGRP);
+    }
+
+    if(outfile == -1){
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+
+    out = aio_open_writer(outfile, opts -> recordSize, opts -> blockingBool);
+    if (opts -> compression){
+        aio_compress(out, opts -> compression, opts -> numJobs);
+    }
+
+    if (opts -> indexBool){
+        index_builder = idx_begin();
+    }
+
+    write_archive(opts, num_paths, paths, out, outfile, outfile_name, 0);
+
+    if (outfile != STDOUT_FILENO){
+        close(outfile);
+    }
+
+    return 0;
+}
+
+/* Adds paths to the end of an existing archive ('r'), or with updateBool
+ * only those newer than the archive's copy ('u'). Only the trailer is
+ * rewritten, along with the rest of its record when blocking. */
+int append_cmd(struct tar_opts *opts, int num_paths,
+               char *archive_name, char **paths, int updateBool) {
+
+    int fd;
+    off_t end, start;
+    struct archive_io *out;
+
+    verbose_out = stdout;
+    if ((fd = open(archive_name, O_RDWR | O_CREAT,
+                   S_IRUSR | S_IWUSR | S_IRGRP)) == -1){
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+
+    if (opts -> indexBool){
+        index_builder = idx_begin();
+    }
+    if (updateBool){
+        archived = archived_open();
+    }
+    end = append_find_end(fd, archive_name, opts -> recordSize,
+                          &index_builder, archived);
+
+    /* Records have to stay where they were, so the start of the one the
+     * trailer was in is written again */
+    start = opts -> blockingBool ? end - end % opts -> recordSize : end;
+    if (lseek(fd, start, SEEK_SET) == -1){
+        perror("lseek");
+        exit(EXIT_FAILURE);
+    }
+    out = aio_open_writer(fd, opts -> recordSize, opts -> blockingBool);
+    out -> offset = start;
+    if (end > start){
+        char *head = malloc(end - start);
+
+        if (!head){
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        if (pread(fd, head, end - start, start) != end - start){
+            perror("Couldn't read archive");
+            exit(EXIT_FAILURE);
+        }
+        aio_write(out, head, end - start);
+        free(head);
+    }
+
+    write_archive(opts, num_paths, paths, out, fd, archive_name, 1);
+
+    if (archived){
+        archived_close(archived);
+        archived = NULL;
+    }
+    close(fd);
 
     return 0;
 }
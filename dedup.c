@@ -0,0 +1,249 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "dedup.h"
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+
+struct dedup {
+    off_t size;
+    uint64_t hash;
+    /* What the link would take on from this copy when extracted */
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    time_t mtime;
+    char *path;
+    struct dedup *next;
+};
+
+struct dedup_table {
+    struct dedup **buckets;
+    size_t numBuckets;
+    size_t count;
+    /* One chunk of the file being looked up, one of the earlier copy */
+    char *buf;
+    char *other;
+};
+
+/* Word at a time hash of a file's contents, fed in pieces of any size */
+struct content_hash {
+    uint64_t h;
+    uint64_t len;
+    unsigned char tail[8];
+    size_t tailLen;
+};
+
+static uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static void hash_word(struct content_hash *c, uint64_t w) {
+    c -> h ^= rotl(w * PRIME2, 31) * PRIME1;
+    c -> h = rotl(c -> h, 27) * PRIME1 + PRIME3;
+}
+
+static void hash_update(struct content_hash *c, const char *p, size_t n) {
+    uint64_t w;
+
+    c -> len += n;
+    while(n && c -> tailLen) {
+        c -> tail[c -> tailLen++] = *p++;
+        n--;
+        if(c -> tailLen == sizeof(w)) {
+            memcpy(&w, c -> tail, sizeof(w));
+            hash_word(c, w);
+            c -> tailLen = 0;
+        }
+    }
+    for(; n >= sizeof(w); p += sizeof(w), n -= sizeof(w)) {
+        memcpy(&w, p, sizeof(w));
+        hash_word(c, w);
+    }
+    memcpy(c -> tail, p, n);
+    c -> tailLen += n;
+}
+
+static uint64_t hash_final(struct content_hash *c) {
+    uint64_t w = 0, h;
+
+    memcpy(&w, c -> tail, c -> tailLen);
+    hash_word(c, w ^ c -> len);
+    h = c -> h;
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    return h ^ (h >> 32);
+}
+
+/* Reads up to n bytes at off of a file whose first preLen bytes are
+ * already in pre. Returns how many, or -1. */
+static ssize_t read_at(int fd, const char *pre, size_t preLen, char *buf,
+                       size_t n, off_t off) {
+    size_t got = 0;
+    ssize_t r;
+
+    if((size_t)off < preLen) {
+        got = preLen - off < n ? preLen - off : n;
+        memcpy(buf, pre + off, got);
+    }
+    while(got < n && fd != -1) {
+        if((r = pread(fd, buf + got, n - got, off + got)) == -1) {
+            return -1;
+        }
+        if(r == 0) {
+            break;
+        }
+        got += r;
+    }
+    return got;
+}
+
+/* Nonzero if the file at path holds exactly the size bytes of the one
+ * being looked up */
+static int same_contents(struct dedup_table *t, const char *path, off_t size,
+                         int fd, const char *pre, size_t preLen) {
+    off_t off;
+    ssize_t got;
+    int other, same = 1;
+
+    if((other = open(path, O_RDONLY)) == -1) {
+        return 0;
+    }
+    for(off = 0; same && off < size; off += got) {
+        size_t want = size - off < DEDUP_CHUNK ? size - off : DEDUP_CHUNK;
+
+        got = read_at(fd, pre, preLen, t -> buf, want, off);
+        same = got == (ssize_t)want &&
+               read_at(other, NULL, 0, t -> other, want, off) == got &&
+               !memcmp(t -> buf, t -> other, want);
+    }
+    /* and the earlier copy hasn't grown since */
+    same = same && read_at(other, NULL, 0, t -> other, 1, size) == 0;
+    close(other);
+    return same;
+}
+
+static void grow(struct dedup_table *t) {
+    size_t n = t -> numBuckets * 2, i;
+    struct dedup **buckets = calloc(n, sizeof(struct dedup *));
+
+    if(!buckets) {
+        perror("Couldn't calloc dedup table");
+        exit(EXIT_FAILURE);
+    }
+    for(i = 0; i < t -> numBuckets; i++) {
+        struct dedup *e = t -> buckets[i], *next;
+
+        for(; e; e = next) {
+            size_t b = e -> hash % n;
+
+            next = e -> next;
+            e -> next = buckets[b];
+            buckets[b] = e;
+        }
+    }
+    free(t -> buckets);
+    t -> buckets = buckets;
+    t -> numBuckets = n;
+}
+
+struct dedup_table *dedup_open(void) {
+    struct dedup_table *t = calloc(1, sizeof(struct dedup_table));
+
+    if(!t || !(t -> buckets = calloc(DEDUP_START_BUCKETS,
+                                     sizeof(struct dedup *))) ||
+       !(t -> buf = malloc(DEDUP_CHUNK)) ||
+       !(t -> other = malloc(DEDUP_CHUNK))) {
+        perror("Couldn't calloc dedup table");
+        exit(EXIT_FAILURE);
+    }
+    t -> numBuckets = DEDUP_START_BUCKETS;
+    return t;
+}
+
+/* Returns the name an earlier file with the same bytes, mode, owner and
+ * mtime as path (lstat()ed into sb) was archived under, or NULL if there is
+ * none, in which case path is remembered for the files still to come. The
+ * file's first preLen bytes may already be in pre; the rest is read from
+ * fd without moving it. */
+const char *dedup_find(struct dedup_table *t, const char *path,
+                       const struct stat *sb, int fd, const char *pre,
+                       size_t preLen) {
+    off_t size = sb -> st_size;
+    struct content_hash c;
+    struct dedup *e;
+    uint64_t hash;
+    ssize_t got;
+    off_t off;
+    size_t b;
+
+    memset(&c, 0, sizeof(c));
+    for(off = 0; off < size; off += got) {
+        size_t want = size - off < DEDUP_CHUNK ? size - off : DEDUP_CHUNK;
+
+        /* Shrunk or unreadable: let create deal with it as usual */
+        if((got = read_at(fd, pre, preLen, t -> buf, want, off)) <= 0) {
+            return NULL;
+        }
+        hash_update(&c, t -> buf, got);
+    }
+    hash = hash_final(&c);
+
+    b = hash % t -> numBuckets;
+    for(e = t -> buckets[b]; e; e = e -> next) {
+        if(e -> size == size && e -> hash == hash &&
+           e -> mode == sb -> st_mode && e -> uid == sb -> st_uid &&
+           e -> gid == sb -> st_gid && e -> mtime == sb -> st_mtime &&
+           same_contents(t, e -> path, size, fd, pre, preLen)) {
+            return e -> path;
+        }
+    }
+
+    if(t -> count == DEDUP_MAX_ENTRIES) {
+        return NULL;
+    }
+    if(!(e = malloc(sizeof(struct dedup))) || !(e -> path = strdup(path))) {
+        perror("Couldn't malloc dedup table entry");
+        exit(EXIT_FAILURE);
+    }
+    e -> size = size;
+    e -> hash = hash;
+    e -> mode = sb -> st_mode;
+    e -> uid = sb -> st_uid;
+    e -> gid = sb -> st_gid;
+    e -> mtime = sb -> st_mtime;
+    e -> next = t -> buckets[b];
+    t -> buckets[b] = e;
+
+    if(++t -> count > t -> numBuckets * 2) {
+        grow(t);
+    }
+    return NULL;
+}
+
+void dedup_close(struct dedup_table *t) {
+    size_t i;
+
+    for(i = 0; i < t -> numBuckets; i++) {
+        struct dedup *e = t -> buckets[i], *next;
+
+        for(; e; e = next) {
+            next = e -> next;
+            free(e -> path);
+            free(e);
+        }
+    }
+    free(t -> buf);
+    free(t -> other);
+    free(t -> buckets);
+    free(t);
+}
@@ -0,0 +1,32 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* Regular files create has already archived, by size and a hash of their
+ * contents, so that a later file with the same bytes ('D') becomes a link
+ * member pointing at the first copy instead of another copy of the body.
+ * A hash match is only trusted once the two files compare equal, and only
+ * taken when both have the same mode, owner and mtime, since extracting
+ * the link gives them one inode. */
+
+#define DEDUP_START_BUCKETS 1024
+/* Past this many files the table stops taking new ones, but files already
+ * in it still match */
+#define DEDUP_MAX_ENTRIES (1024 * 1024)
+/* Bytes hashed or compared per read */
+#define DEDUP_CHUNK (64 * 1024)
+
+struct dedup_table;
+
+struct dedup_table *dedup_open(void);
+
+const char *dedup_find(struct dedup_table *t, const char *path,
+                       const struct stat *sb, int fd, const char *pre,
+                       size_t preLen);
+
+void dedup_close(struct dedup_table *t);
+
+#endif
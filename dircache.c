@@ -0,0 +1,222 @@
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include "dircache.h"
+
+struct dentry {
+    char *path;
+    size_t len;
+    unsigned int hash;
+    /* -1 once evicted, the directory is still known to exist */
+    int fd;
+    struct dentry *next;
+};
+
+struct dircache {
+    struct dentry **buckets;
+    size_t numBuckets;
+    size_t count;
+    /* Entries holding an open fd, oldest first */
+    struct dentry *open[DCACHE_MAX_FDS];
+    int openHead;
+    int openCount;
+    int maxFds;
+    /* Consecutive members nearly always share a parent */
+    struct dentry *last;
+};
+
+static unsigned int hash_path(const char *path, size_t len) {
+    unsigned int h = 5381;
+
+    while(len--) {
+        h = h * 33 + (unsigned char)*path++;
+    }
+    return h;
+}
+
+static struct dentry *find(struct dircache *c, const char *path, size_t len,
+                           unsigned int hash) {
+    struct dentry *e;
+
+    for(e = c -> buckets[hash % c -> numBuckets]; e; e = e -> next) {
+        if(e -> hash == hash && e -> len == len &&
+           !memcmp(e -> path, path, len)) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void grow(struct dircache *c) {
+    size_t n = c -> numBuckets * 2, i;
+    struct dentry **buckets = calloc(n, sizeof(struct dentry *));
+
+    if(!buckets) {
+        perror("Couldn't calloc dircache");
+        exit(EXIT_FAILURE);
+    }
+    for(i = 0; i < c -> numBuckets; i++) {
+        struct dentry *e = c -> buckets[i], *next;
+
+        for(; e; e = next) {
+            next = e -> next;
+            e -> next = buckets[e -> hash % n];
+            buckets[e -> hash % n] = e;
+        }
+    }
+    free(c -> buckets);
+    c -> buckets = buckets;
+    c -> numBuckets = n;
+}
+
+/* Makes e the newest holder of an fd, closing the oldest one's if the
+ * limit is reached */
+static void track_open(struct dircache *c, struct dentry *e) {
+    if(c -> openCount == c -> maxFds) {
+        struct dentry *victim = c -> open[c -> openHead];
+
+        close(victim -> fd);
+        victim -> fd = -1;
+        c -> open[c -> openHead] = e;
+        c -> openHead = (c -> openHead + 1) % c -> maxFds;
+        return;
+    }
+    c -> open[(c -> openHead + c -> openCount++) % c -> maxFds] = e;
+}
+
+/* fd of the directory named by the first len bytes of path. Missing
+ * directories are created on the way down. The fd stays valid until the
+ * next call into the cache. */
+static int dir_fd(struct dircache *c, const char *path, size_t len) {
+    struct dentry *e;
+    unsigned int hash;
+    size_t i;
+    int parentFd, fd;
+
+    while(len && path[len - 1] == '/') {
+        len--;
+    }
+    if(!len) {
+        return AT_FDCWD;
+    }
+
+    e = c -> last;
+    if(e && e -> fd >= 0 && e -> len == len && !memcmp(e -> path, path, len)) {
+        return e -> fd;
+    }
+
+    hash = hash_path(path, len);
+    if((e = find(c, path, len, hash)) && e -> fd >= 0) {
+        c -> last = e;
+        return e -> fd;
+    }
+
+    for(i = len; i && path[i - 1] != '/'; i--)
+        ;
+    parentFd = dir_fd(c, path, i);
+
+    if(!e) {
+        errno = 0;
+        e = malloc(sizeof(struct dentry));
+        if(errno || !(e -> path = malloc(len + 1))) {
+            perror("Couldn't malloc dircache entry");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(e -> path, path, len);
+        e -> path[len] = '\0';
+        e -> len = len;
+        e -> hash = hash;
+
+        if(mkdirat(parentFd, e -> path + i, DCACHE_DIR_PERMS) &&
+           errno != EEXIST) {
+            perror("Couldn't mkdir");
+            exit(errno);
+        }
+
+        if(++c -> count > c -> numBuckets * 2) {
+            grow(c);
+        }
+        e -> next = c -> buckets[hash % c -> numBuckets];
+        c -> buckets[hash % c -> numBuckets] = e;
+    }
+
+    if((fd = openat(parentFd, e -> path + i,
+                    O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+        perror("Couldn't open directory");
+        exit(errno);
+    }
+    e -> fd = fd;
+    track_open(c, e);
+    c -> last = e;
+    return fd;
+}
+
+/* How many descriptors the cache keeps open: DCACHE_MAX_FDS, or a
+ * DCACHE_FD_SHARE of the open file limit if that is less */
+int dcache_max_fds(void) {
+    struct rlimit rl;
+
+    if(getrlimit(RLIMIT_NOFILE, &rl) || rl.rlim_cur == RLIM_INFINITY ||
+       rl.rlim_cur / DCACHE_FD_SHARE >= DCACHE_MAX_FDS) {
+        return DCACHE_MAX_FDS;
+    }
+    return rl.rlim_cur / DCACHE_FD_SHARE ? rl.rlim_cur / DCACHE_FD_SHARE : 1;
+}
+
+struct dircache *dcache_open(void) {
+    struct dircache *c;
+
+    errno = 0;
+    c = calloc(1, sizeof(struct dircache));
+    if(errno) {
+        perror("Couldn't calloc dircache");
+        exit(errno);
+    }
+    c -> maxFds = dcache_max_fds();
+    c -> numBuckets = DCACHE_START_BUCKETS;
+    c -> buckets = calloc(c -> numBuckets, sizeof(struct dentry *));
+    if(!c -> buckets) {
+        perror("Couldn't calloc dircache");
+        exit(EXIT_FAILURE);
+    }
+    return c;
+}
+
+/* Returns a descriptor for the directory path lives in, creating it if
+ * need be, and points *base at path's last component. The descriptor
+ * belongs to the cache and stays valid until the next call into it. */
+int dcache_parent(struct dircache *c, const char *path, const char **base) {
+    size_t len = strlen(path), i;
+
+    while(len && path[len - 1] == '/') {
+        len--;
+    }
+    for(i = len; i && path[i - 1] != '/'; i--)
+        ;
+    *base = path + i;
+    return dir_fd(c, path, i);
+}
+
+void dcache_close(struct dircache *c) {
+    size_t i;
+
+    for(i = 0; i < c -> numBuckets; i++) {
+        struct dentry *e = c -> buckets[i], *next;
+
+        for(; e; e = next) {
+            next = e -> next;
+            if(e -> fd >= 0) {
+                close(e -> fd);
+            }
+            free(e -> path);
+            free(e);
+        }
+    }
+    free(c -> buckets);
+    free(c);
+}
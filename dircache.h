@@ -0,0 +1,27 @@
+#ifndef DIRCACHE_H
+#define DIRCACHE_H
+
+/* Directories extract has already created or found, by path, with an open
+ * descriptor so that members can be created with the *at() calls instead
+ * of resolving their whole path again. At most DCACHE_MAX_FDS descriptors
+ * are kept open; directories that lose theirs are reopened from their
+ * parent when next needed. */
+
+#define DCACHE_MAX_FDS 256
+/* Never more than 1/DCACHE_FD_SHARE of the open file limit */
+#define DCACHE_FD_SHARE 4
+#define DCACHE_START_BUCKETS 1024
+/* Mode for ancestors that have no member of their own (yet) */
+#define DCACHE_DIR_PERMS 0774
+
+struct dircache;
+
+struct dircache *dcache_open(void);
+
+int dcache_max_fds(void);
+
+int dcache_parent(struct dircache *c, const char *path, const char **base);
+
+void dcache_close(struct dircache *c);
+
+#endif
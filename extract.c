@@ -4,98 +4,349 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include <utime.h>
+#include <dirent.h>
 #include <sys/stat.h>
 #include <sys/time.h>
-#include <math.h>
+#include <stdint.h>
 #include "util.h"
 #include "header.h"
+#include "codec.h"
+#include "blockio.h"
+#include "mytar.h"
+#include "index.h"
+#include "filter.h"
+#include "pax.h"
+#include "pool.h"
+#include "dircache.h"
+#include "idcache.h"
+#include "snapshot.h"
 
-#define OCTAL 8
-#define BLK_SIZE 512
 #define REG_FLAG '0'
 #define REG_FLAG_ALT '\0'
+#define HARDLINK_FLAG '1'
 #define SYM_FLAG '2'
 #define DIR_FLAG '5'
-#define MAX_NAME 100
-#define MAX_PREFIX 155
-#define MAX_LINK 100
-#define EMPTY_BLOCK_CHKSUM 256
 #define MAGIC_LEN 6
 #define VERSION_LEN 2
+#define DIR_LIST_START 64
+#define DIR_PATHS_START 4096
+#define ALL_PERMS 07777
+
+/* Directory metadata held back until everything else is extracted: members
+ * created inside a directory change its mtime, and its archived mode may
+ * not let us create them at all. All the paths share one buffer. */
+struct dir_meta {
+    size_t pathOffset;
+    int depth;
+    mode_t mode;
+    time_t mtime;
+    long mtimeNsec;
+};
+
+struct dir_list {
+    struct dir_meta *dirs;
+    size_t count;
+    size_t cap;
+    char *paths;
+    size_t pathsLen;
+    size_t pathsCap;
+};
+
+static void defer_dir(struct dir_list *l, const char *path, mode_t mode,
+                      time_t mtime, long mtimeNsec) {
+    size_t len = strlen(path) + 1, i;
+    struct dir_meta *d;
+
+    if(l -> count == l -> cap) {
+        l -> cap = l -> cap ? l -> cap * 2 : DIR_LIST_START;
+        if(!(l -> dirs = realloc(l -> dirs, l -> cap * sizeof(*l -> dirs)))) {
+            perror("Couldn't realloc dir list");
+            exit(EXIT_FAILURE);
+        }
+    }
+    while(l -> pathsLen + len > l -> pathsCap) {
+        l -> pathsCap = l -> pathsCap ? l -> pathsCap * 2 : DIR_PATHS_START;
+        if(!(l -> paths = realloc(l -> paths, l -> pathsCap))) {
+            perror("Couldn't realloc dir list");
+            exit(EXIT_FAILURE);
+        }
+    }
 
-/* checks if the path contains non-existent dirs and creates them */
-void check_dirs(char *path){
+    d = &l -> dirs[l -> count++];
+    d -> pathOffset = l -> pathsLen;
+    d -> mode = mode;
+    d -> mtime = mtime;
+    d -> mtimeNsec = mtimeNsec;
+    d -> depth = 0;
+    /* A trailing slash doesn't make it any deeper */
+    for(i = 0; i + 2 < len; i++) {
+        d -> depth += path[i] == '/';
+    }
+    memcpy(l -> paths + l -> pathsLen, path, len);
+    l -> pathsLen += len;
+}
 
-    int idx;
-    char *cpy;
-    mode_t perms = S_IRWXU | S_IRWXG | S_IROTH;
-    errno = 0;
-    cpy = (char *)malloc((strlen(path) + 1) * sizeof(char));
+/* Deepest first, and later in the archive first among equals */
+static int deepest_first(const void *a, const void *b) {
+    const struct dir_meta *x = a, *y = b;
 
-    if (errno){
-        perror("malloc failed in check_dirs");
-        exit(EXIT_FAILURE);
+    if(x -> depth != y -> depth) {
+        return y -> depth - x -> depth;
     }
+    return x -> pathOffset < y -> pathOffset ? 1 : -1;
+}
 
-    strcpy(cpy, path);
+/* Sets every deferred directory's exact mode and mtime. Going deepest
+ * first means no directory is locked down before we are done below it. */
+static void apply_dirs(struct dir_list *l, struct dircache *dirs) {
+    struct timespec times[2];
+    size_t i;
 
-    for (idx = 0; cpy[idx]; idx++){
-        if (cpy[idx] == '/'){
-            if (idx >= strlen(path) - 1){
-                free(cpy);
-                return;
-            }
-            cpy[idx] = '\0';
-            if(mkdir(cpy, perms) && errno != EEXIST) {
-                perror("Couldn't mkdir");
-                exit(errno);
-            }
-            cpy[idx] = '/';
+    qsort(l -> dirs, l -> count, sizeof(*l -> dirs), deepest_first);
+
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    for(i = 0; i < l -> count; i++) {
+        const char *path = l -> paths + l -> dirs[i].pathOffset, *baseName;
+        int parentFd = dcache_parent(dirs, path, &baseName);
+
+        if(fchmodat(parentFd, baseName, l -> dirs[i].mode, 0)) {
+            perror("Couldn't set mode");
+            exit(errno);
+        }
+        times[1].tv_sec = l -> dirs[i].mtime;
+        times[1].tv_nsec = l -> dirs[i].mtimeNsec;
+        if(utimensat(parentFd, baseName, times, AT_SYMLINK_NOFOLLOW)) {
+            perror("Couldn't set utime");
+            exit(errno);
         }
     }
 
-    free(cpy);
-    return;
+    free(l -> dirs);
+    free(l -> paths);
+}
 
+/* Hard links wait until every regular file is in place, since with a
+ * pool the file they point at may still be being written. Both names of
+ * each link live in one shared buffer. */
+struct link_list {
+    size_t *offsets;
+    size_t count;
+    size_t cap;
+    char *paths;
+    size_t pathsLen;
+    size_t pathsCap;
+};
+
+static void defer_link(struct link_list *l, const char *target,
+                       const char *path) {
+    size_t targetLen = strlen(target) + 1, pathLen = strlen(path) + 1;
+
+    if(l -> count == l -> cap) {
+        l -> cap = l -> cap ? l -> cap * 2 : DIR_LIST_START;
+        if(!(l -> offsets = realloc(l -> offsets,
+                                    l -> cap * sizeof(*l -> offsets)))) {
+            perror("Couldn't realloc link list");
+            exit(EXIT_FAILURE);
+        }
+    }
+    while(l -> pathsLen + targetLen + pathLen > l -> pathsCap) {
+        l -> pathsCap = l -> pathsCap ? l -> pathsCap * 2 : DIR_PATHS_START;
+        if(!(l -> paths = realloc(l -> paths, l -> pathsCap))) {
+            perror("Couldn't realloc link list");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    l -> offsets[l -> count++] = l -> pathsLen;
+    memcpy(l -> paths + l -> pathsLen, target, targetLen);
+    memcpy(l -> paths + l -> pathsLen + targetLen, path, pathLen);
+    l -> pathsLen += targetLen + pathLen;
 }
 
-void extract_file_content (int infile, int outfile, unsigned int file_size){
-    char *buff;
-    int padding = file_size % BLK_SIZE;
+/* Creates the deferred hard links, replacing whatever has the name. A
+ * target that wasn't extracted (say it was filtered out) only costs its
+ * links. */
+static void apply_links(struct link_list *l, struct dircache *dirs) {
+    size_t i;
+
+    for(i = 0; i < l -> count; i++) {
+        const char *target = l -> paths + l -> offsets[i], *baseName;
+        const char *path = target + strlen(target) + 1;
+        int parentFd = dcache_parent(dirs, path, &baseName);
+
+        if(linkat(AT_FDCWD, target, parentFd, baseName, 0) &&
+           (errno != EEXIST || unlinkat(parentFd, baseName, 0) ||
+            linkat(AT_FDCWD, target, parentFd, baseName, 0))) {
+            fprintf(stderr, "Couldn't link %s to %s: %s\n", path, target,
+                    strerror(errno));
+        }
+    }
 
-    errno = 0;
-    buff = malloc(sizeof(char) * file_size);
-    if(errno) {
-        perror("Couldn't malloc buff");
-        exit(errno);
+    free(l -> offsets);
+    free(l -> paths);
+}
+
+/* Removes name, in the directory dirFd, along with anything under it */
+static void remove_tree(int dirFd, const char *name) {
+    DIR *d;
+    struct dirent *e;
+    int fd;
+
+    if(!unlinkat(dirFd, name, 0)) {
+        return;
+    }
+    if(errno == EISDIR || errno == EPERM) {
+        if((fd = openat(dirFd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW))
+           == -1) {
+            perror("Couldn't open directory to remove");
+            return;
+        }
+        if(!(d = fdopendir(fd))) {
+            perror("Couldn't open directory to remove");
+            close(fd);
+            return;
+        }
+        while((e = readdir(d))) {
+            if(strcmp(e -> d_name, ".") && strcmp(e -> d_name, "..")) {
+                remove_tree(dirfd(d), e -> d_name);
+            }
+        }
+        closedir(d);
+        if(!unlinkat(dirFd, name, AT_REMOVEDIR)) {
+            return;
+        }
     }
+    fprintf(stderr, "Couldn't remove %s: %s\n", name, strerror(errno));
+}
 
-    if(read(infile, buff, file_size) == -1) {
-        perror("Couldn't read from archive");
-        exit(errno);
+static int cmp_names(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Reads a directory member's listing and deletes whatever the directory
+ * holds that isn't in it, which is what went away between the archive
+ * before this one in the chain and this one */
+static void purge_dir(struct archive_io *in, int parentFd,
+                      const char *baseName, unsigned long size) {
+    char *body, *name, **names;
+    size_t numNames = 0;
+    struct dirent *e;
+    DIR *d;
+    int fd;
+
+    if(size > DUMPDIR_MAX_SIZE) {
+        fprintf(stderr, "Directory listing is corrupted! Exiting.");
+        exit(EXIT_FAILURE);
+    }
+    /* One name per two bytes at most, plus the NUL for a missing end */
+    if(!(body = malloc(size + 1)) ||
+       !(names = malloc((size / 2 + 1) * sizeof(char *)))) {
+        perror("Couldn't malloc directory listing");
+        exit(EXIT_FAILURE);
+    }
+    if(aio_read(in, body, size) != size) {
+        fprintf(stderr, "Archive is truncated! Exiting.");
+        exit(EXIT_FAILURE);
     }
+    aio_skip(in, AIO_PADDED(size) - size);
+    body[size] = '\0';
 
-    if(write(outfile, buff, file_size) == -1) {
-        perror("Couldn't write file");
-        exit(errno);
+    /* Each name is behind its one letter code */
+    for(name = body; name < body + size && *name;
+        name += strlen(name) + 1) {
+        names[numNames++] = name + 1;
     }
+    qsort(names, numNames, sizeof(char *), cmp_names);
 
-    if(lseek(infile, BLK_SIZE - padding, SEEK_CUR) == -1){
-        perror("lseek padding of file content failed");
+    if((fd = openat(parentFd, baseName, O_RDONLY | O_DIRECTORY)) == -1 ||
+       !(d = fdopendir(fd))) {
+        perror("Couldn't open directory");
         exit(errno);
     }
-    
+    while((e = readdir(d))) {
+        name = e -> d_name;
+        if(strcmp(name, ".") && strcmp(name, "..") &&
+           !bsearch(&name, names, numNames, sizeof(char *), cmp_names)) {
+            remove_tree(dirfd(d), name);
+        }
+    }
+    closedir(d);
+
+    free(names);
+    free(body);
+}
+
+/* works out who should own a member: the archived user and group names
+ * mapped through this system's databases, or the numeric ids from the
+ * header where a name is missing or unknown here */
+void member_owner(struct hdr_info *info, uid_t *uid, gid_t *gid){
+    *uid = idcache_uid(info -> uname, info -> uid);
+    *gid = idcache_gid(info -> gname, info -> gid);
+}
+
+/* Streams the body through the reader, so memory use stays at one record
+ * no matter how big the member is */
+void extract_file_content (struct archive_io *in, int outfile,
+                           unsigned long file_size){
+
+    aio_copy_to_fd(in, outfile, file_size);
+    aio_skip(in, AIO_PADDED(file_size) - file_size);
+
     return;
 }
 
+/* Recreates a sparse member: data goes at each extent's offset and
+ * ftruncate() sets the length, leaving holes in between instead of
+ * writing out zeros */
+void extract_sparse_content(struct archive_io *in, int outfile,
+                            off_t size, off_t realSize){
+    struct sparse_map map;
+    off_t mapLen, data;
+    size_t i;
+
+    mapLen = sparse_read_map(in, size, realSize, &map);
+    data = sparse_data_size(&map);
+
+    for(i = 0; i < map.count; i++) {
+        if(lseek(outfile, map.extents[i].offset, SEEK_SET) == -1) {
+            perror("Couldn't lseek in extracted file");
+            exit(errno);
+        }
+        aio_copy_to_fd(in, outfile, map.extents[i].size);
+    }
+    if(ftruncate(outfile, realSize)) {
+        perror("Couldn't set extracted file size");
+        exit(errno);
+    }
+
+    aio_skip(in, AIO_PADDED(size) - mapLen - data);
+    sparse_free(&map);
+}
+
 int extract_cmd(char* fileName, char *directories[], int numDirectories,
-         int verboseBool, int strictBool) {
+         struct tar_opts *opts) {
     int fd;
-    struct header headerBuffer;
+    int verboseBool = opts -> verboseBool, strictBool = opts -> strictBool;
+    const struct header *headerBuffer;
+    struct archive_io *in;
+    struct idx_hits hits;
+    int useIndex;
+    struct path_filter *filter = NULL;
+    char **literals;
+    int numLiterals = -1;
+    struct xpool *pool = NULL;
+    struct dircache *dirs = dcache_open();
+    struct dir_list deferred;
+    struct link_list links;
 
     errno = 0;
-    fd = open(fileName, O_RDONLY);
+    if(!strcmp(fileName, STDIO_ARCHIVE)) {
+        fd = STDIN_FILENO;
+    }
+    else {
+        fd = open(fileName, O_RDONLY);
+    }
     
     if(errno) {
         fprintf(stderr, "Couldn't open file %s: %s",
@@ -103,130 +354,132 @@ int extract_cmd(char* fileName, char *directories[], int numDirectories,
         exit(errno);
     }
 
+    in = aio_open_reader(fd, opts -> recordSize);
+    memset(&deferred, 0, sizeof(deferred));
+    memset(&links, 0, sizeof(links));
+
+    /* With path arguments and a current index, only the matching headers
+     * are visited instead of the whole archive */
+    memset(&hits, 0, sizeof(hits));
+    if(directories) {
+        filter = filter_compile(directories, numDirectories,
+                                opts -> firstBool);
+        numLiterals = filter_literals(filter, &literals);
+    }
+    useIndex = numLiterals > 0 &&
+               idx_find(fileName, in, literals, numLiterals, &hits);
+
+    /* Workers pread() bodies on their own, which needs archive offsets to
+     * be file offsets - true for mapped archives. Otherwise stay serial. */
+    if(opts -> numJobs > 1 && in -> mapped) {
+        pool = xpool_start(fd, opts -> numJobs);
+    }
+    /* A compressed archive read from end to end can have its frames
+     * decompressed on the job threads instead */
+    else if(opts -> numJobs > 1 && !useIndex) {
+        aio_parallel(in, opts -> numJobs);
+    }
+
     errno = 0;
-    while(read(fd, &headerBuffer, sizeof(struct header)) > 0) {
+    /* Headers are parsed in place, out of the mapping or record buffer.
+     * Append and update add later copies of the same paths, so only with
+     * 'q' does reading stop once every argument has matched. That holds
+     * for index hits too, which include the later copies. */
+    while(!(filter && filter_done(filter)) &&
+          (headerBuffer = (const struct header *)idx_next_header(in,
+                          useIndex ? &hits : NULL))) {
         unsigned long int fileSize;
-        unsigned char typeFlag = headerBuffer.typeflag[0];
-        struct stat statBuffer;
-        struct utimbuf newTime;
+        unsigned char typeFlag;
         char *filePath;
         char *pathNoLead;
-        mode_t permissions, default_perms;
-        int expectedChecksum, readChecksum;
+        const char *baseName;
+        int parentFd;
+        mode_t permissions;
+        int status;
+        struct hdr_info info;
+        struct pax_info px;
         struct timespec times[2];
+        uid_t owner = -1;
+        gid_t group = -1;
 
         /* Check read() error */
         if(errno) {
             perror("Couldn't read header");
             exit(errno);
         }
-
-
-        fileSize = strtol(headerBuffer.size, NULL, OCTAL);
-        expectedChecksum = calc_checksum((unsigned char *) &headerBuffer);
-        readChecksum = strtol(headerBuffer.chksum, NULL, OCTAL);
+        /* Any extended headers first, then the member they describe */
+        status = pax_decode(in, &headerBuffer, &info, &px);
 
         /* Check for valid end of archive */
-        if(readChecksum == 0 && expectedChecksum == EMPTY_BLOCK_CHKSUM) {
-            int nextExpected;
-            int nextRead;
-
+        if(status == HDR_ZERO) {
             /* Read next block */
-            errno = 0;
-            read(fd, &headerBuffer, sizeof(struct header));
-            if(errno) {
-                perror("Couldn't check next block");
-                exit(errno);
+            if(!(headerBuffer = (const struct header *)aio_next(in,
+                                 sizeof(struct header)))) {
+                fprintf(stderr, "Archive is truncated! Exiting.");
+                exit(EXIT_FAILURE);
             }
 
-            nextExpected = calc_checksum((unsigned char *)&headerBuffer);
-            nextRead = strtol(headerBuffer.chksum, NULL, OCTAL);
-
             /* Check if next block is also all zeroes */
-            if(nextRead != 0 || nextExpected != EMPTY_BLOCK_CHKSUM) {
+            if(!is_zero_block((unsigned char *)headerBuffer)) {
                 fprintf(stderr, "Archive is corrupted! Exiting.");
                 exit(EXIT_FAILURE);
             }
 
-
             /* If we haven't errored out by now, we must be at the end
              * of a valid archive! We're all done. */
-            exit(EXIT_SUCCESS);
+            break;
         }
 
         /* Validate checksum */
-        if(expectedChecksum != readChecksum) {
+        if(status == HDR_BAD) {
             fprintf(stderr,
-                    "Expected checksum %d doesn't match read checksum %d\n",
-                    expectedChecksum, readChecksum);
+                    "Expected checksum %d doesn't match read checksum %ld\n",
+                    info.sum, info.chksum);
             exit(EXIT_FAILURE);
         }
 
+        fileSize = info.size;
+        typeFlag = info.type;
+
         /* Check for magic string - minus one since strncmp stops on null */
-        if(strncmp("ustar", headerBuffer.magic, MAGIC_LEN - 1) != 0) {
+        if(strncmp("ustar", headerBuffer->magic, MAGIC_LEN - 1) != 0) {
             fprintf(stderr, "Magic string doesn't check out: \"%s\"\n",
-                    (char *)&headerBuffer.magic);
+                    (char *)&headerBuffer->magic);
             exit(EXIT_FAILURE);
         }
 
         /* Check for version, IF in strict mode */
-        if(strictBool && strncmp("00", headerBuffer.version, VERSION_LEN) != 0){
+        if(strictBool && strncmp("00", headerBuffer->version, VERSION_LEN) != 0){
             /* The .2 limits the # chars we print */
             fprintf(stderr, "Version doesn't check out: \"%.2s\"\n",
-                    (char *)&headerBuffer.version);
+                    (char *)&headerBuffer->version);
             exit(EXIT_FAILURE);
         }    
 
         errno = 0;
-        /* +4 for leading "./", concat "/", and null-terminator */
-        filePath = calloc(MAX_NAME + MAX_PREFIX + 4, sizeof(char));
+        /* +2 for leading "./" */
+        filePath = malloc(strlen(info.path) + 3);
         if(errno) {
-            perror("Couldn't calloc filePath");
+            perror("Couldn't malloc filePath");
             exit(errno);
         }
 
-        /* NOTE: We're using strncat to avoid undefined behavior.
-         * Prefix and name aren't necessarily null-terminated, and the normal
-         * strcat just looks for a null terminator in the source string
-         * to stop. strncat stops at the null terminator or after n chars,
-         * whichever comes first. */
-
         /* Leading ./ for a valid relative path */
-        strcat(filePath, "./");
-        /* If there's something in prefix, add it and a slash */
-        if(headerBuffer.prefix[0]) {
-            strncat(filePath, (char *)&headerBuffer.prefix, MAX_PREFIX);
-            strcat(filePath, "/");
-        }
-        /* Add the name unconditionally */
-        strncat(filePath, (char *)&headerBuffer.name, MAX_NAME);
+        strcpy(filePath, "./");
+        strcat(filePath, info.path);
 
         /* Make a path without the leading ./ for directory validation */
         pathNoLead = filePath + 2;
-        /* If we've passed a non-null directories[], check all directories
-         * against the beginning of current fullName and don't print if
-         * it doesn't match an element of directories[]. */
-        if(directories) {
-            int i;
-            int inDirectoriesBool = 0;
-            for(i = 0; i < numDirectories; i++) {
-                int pathLength = strlen(directories[i]);
-                if(strncmp(pathNoLead, directories[i], pathLength) == 0) {
-                    inDirectoriesBool = 1;
-                    break;
-                }
-            }
-            if(!inDirectoriesBool) {
+        /* Check the member against the compiled path arguments */
+        if(filter) {
+            if(!filter_match(filter, pathNoLead, typeFlag == DIR_FLAG ||
+                             typeFlag == DUMPDIR_FLAG)) {
                 if(fileSize > 0) {
                     /* Skip the body */
-                    if(lseek(fd, (fileSize / BLK_SIZE + 1) * BLK_SIZE,
-                             SEEK_CUR) == -1) {
-                        perror("Couldn't lseek to next header");
-                        exit(errno);
-                    }
+                    aio_skip(in, AIO_PADDED(fileSize));
                 }
-                continue;
                 free(filePath);
+                continue;
             }
         }
 
@@ -234,20 +487,22 @@ int extract_cmd(char* fileName, char *directories[], int numDirectories,
             printf("%s", filePath);
         }
 
-        check_dirs(pathNoLead);
-
-        /* we dont need a second arg since we are guaranteed a string of
-         * octal digits */
-        permissions = (mode_t)strtol(headerBuffer.mode, NULL, OCTAL);
-
-        default_perms = S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH;
+        /* Everything below is relative to the member's parent */
+        parentFd = dcache_parent(dirs, pathNoLead, &baseName);
+        if(pool) {
+            xpool_claim(pool, pathNoLead);
+        }
 
-        if (permissions & S_IXUSR || permissions & S_IXGRP ||
-            permissions & S_IXOTH){
-            default_perms = default_perms|S_IRWXU|S_IRWXG|S_IRWXO;
+        /* Exactly the archived mode, but set-id bits only come back
+         * along with the archived owner */
+        permissions = info.mode & ALL_PERMS;
+        if(!opts -> ownerBool) {
+            permissions &= ~(S_ISUID | S_ISGID);
         }
 
-        permissions |= default_perms;
+        if(opts -> ownerBool) {
+            member_owner(&info, &owner, &group);
+        }
 
         /* P.S. I know that I don't have to put every case in curly brackets
          * normally. But this gets around a quirk of C that throws a fit
@@ -258,62 +513,99 @@ int extract_cmd(char* fileName, char *directories[], int numDirectories,
             case REG_FLAG_ALT:
             case REG_FLAG: {
                 int new_file;
-                /* NOTE: This currently grants everything to user.
-                 * We'll either need to change these perms in this call,
-                 * or just set them again later. If user mysteriously has
-                 * perms, this is probably the culprit. */
-
-                /* old ver
-                if((new_file = creat(filePath, permissions)) == -1) {
-                    perror("Couldn't create file");
-                    exit(errno);
-                }
-                */
 
-                /* using open */
+                /* Hand it to a worker, which also sets its metadata.
+                 * Sparse members need their map read first, so they
+                 * stay here. */
+                if(pool && !px.sparse) {
+                    xpool_add(pool, in -> offset, fileSize, pathNoLead,
+                              parentFd, baseName, permissions, info.mtime,
+                              info.mtimeNsec, owner, group);
+                    aio_skip(in, AIO_PADDED(fileSize));
+                    free(filePath);
+                    errno = 0;
+                    continue;
+                }
 
-                if((new_file = open(filePath, O_RDWR|O_CREAT|O_TRUNC,
-                                    permissions)) == -1){
+                if((new_file = openat(parentFd, baseName,
+                                      O_WRONLY|O_CREAT|O_TRUNC,
+                                      XPOOL_CREATE_PERMS)) == -1){
                     perror("open");
                     exit(EXIT_FAILURE);
                 }
 
-                extract_file_content(fd, new_file, fileSize);
+                if(px.sparse) {
+                    extract_sparse_content(in, new_file, fileSize,
+                                           px.realSize);
+                }
+                else {
+                    extract_file_content(in, new_file, fileSize);
+                }
+                xpool_metadata(new_file, permissions, info.mtime,
+                               info.mtimeNsec, owner, group);
+                close(new_file);
                 break;
             }
             case SYM_FLAG: {
-                /* We're doing this to catch issues with it possibly not being
-                 * null-terminated. Basically just slapping on our own
-                 * null-terminator(s) at the end. */ 
-                char *linkValue; 
-                errno = 0;
-                linkValue = calloc(MAX_LINK + 1, sizeof(char));
-                if(errno) {
-                    perror("Couldn't calloc linkValue");
-                    exit(errno);
-                }
-
-                strncpy(linkValue, (char *)&headerBuffer.linkname,
-                    MAX_LINK);
-
                 /* Make a symlink with name filePath that points
-                 * to linkValue. It's easy to get mixed up here! */
+                 * to the linkname. It's easy to get mixed up here! */
                 errno = 0;
-                if(symlink(linkValue, filePath) && errno != EEXIST) {
+                if(symlinkat(info.linkname, parentFd, baseName) &&
+                   errno != EEXIST) {
                     perror("Couldn't create symlink");
                     exit(errno);
                 }
 
-                free(linkValue);
+                /* No fd to go through for a symlink itself, but the
+                 * cached parent still saves the path walk */
+                if(opts -> ownerBool && fchownat(parentFd, baseName, owner,
+                                                 group, AT_SYMLINK_NOFOLLOW)) {
+                    perror("Couldn't restore owner");
+                }
+                times[0].tv_sec = 0;
+                times[0].tv_nsec = UTIME_OMIT;
+                times[1].tv_sec = info.mtime;
+                times[1].tv_nsec = info.mtimeNsec;
+                if(utimensat(parentFd, baseName, times, AT_SYMLINK_NOFOLLOW)) {
+                    perror("Couldn't set utime");
+                    exit(errno);
+                }
+                break;
+            }
+            case HARDLINK_FLAG: {
+                /* Same inode, so nothing else to restore */
+                defer_link(&links, info.linkname, pathNoLead);
                 break;
             }
+            case DUMPDIR_FLAG:
             case DIR_FLAG: {
-                /* NOTE: Again, watch out for these perms. */
                 errno = 0;
-                if(mkdir(filePath, permissions) && errno != EEXIST) {
+                if(mkdirat(parentFd, baseName, S_IRWXU) && errno != EEXIST) {
                     perror("Couldn't mkdir");
                     exit(errno);
                 }
+
+                if(opts -> ownerBool && fchownat(parentFd, baseName, owner,
+                                                 group, AT_SYMLINK_NOFOLLOW)) {
+                    perror("Couldn't restore owner");
+                }
+
+                /* Mode and mtime once nothing else goes in */
+                defer_dir(&deferred, pathNoLead, permissions, info.mtime,
+                          info.mtimeNsec);
+
+                /* With 'g', directory listings from an incremental create
+                 * delete what is gone; otherwise they are just skipped */
+                if(typeFlag == DUMPDIR_FLAG && opts -> snapshotName) {
+                    /* Nothing under it may still be on its way */
+                    if(pool) {
+                        xpool_wait(pool);
+                    }
+                    purge_dir(in, parentFd, baseName, fileSize);
+                }
+                else if(fileSize > 0) {
+                    aio_skip(in, AIO_PADDED(fileSize));
+                }
                 break;
             }
             default: {
@@ -321,150 +613,25 @@ int extract_cmd(char* fileName, char *directories[], int numDirectories,
                 exit(EXIT_FAILURE);
             }
         }
-       
-        
-        /* Stat the created file to get its current times */
-        if(lstat(filePath, &statBuffer)) {
-            perror("Failed to stat created file!");
-            exit(errno);
-        }
-
-        /* Preserve atime */
-        newTime.actime = statBuffer.st_atime;
-        /* Set mtime to mtime from header */
-        newTime.modtime = strtol(headerBuffer.mtime, NULL, OCTAL);
-
-        times[0].tv_sec = newTime.actime;
-        times[0].tv_nsec = 0;
-        times[1].tv_sec = newTime.modtime;
-        times[1].tv_nsec = 0;
-
-        if (utimensat(AT_FDCWD, filePath, times, AT_SYMLINK_NOFOLLOW)){
-            perror("Couldn't set utime");
-            exit(errno);
-        }
-
-        /* old ver
-        if(utime(filePath, &newTime)) {
-            perror("Couldn't set utime");
-            exit(errno);
-        }
-        */
-
-        /* NOTE: We shouldn't be touching the created file after this.
-         * The mtime could be disturbed. Do any operations on it before 
-         * setting mtime. */
 
         free(filePath);
         errno = 0;
     }
-    close(fd);
- 
-    /* Set directory mtimes on second pass */ 
-    errno = 0;
-    while(read(fd, &headerBuffer, sizeof(struct header)) > 0) {
-        unsigned long int fileSize;
-        char *filePath, *pathNoLead;
-        fileSize = strtol(headerBuffer.size, NULL, OCTAL);
-      
-        /* Check read() error */
-        if(errno) {
-            perror("Couldn't read header");
-            exit(errno);
-        }
-
-        filePath = calloc(MAX_NAME + MAX_PREFIX + 4, sizeof(char));
-        if(errno) {
-            perror("Couldn't calloc filePath");
-            exit(errno);
-        }
-
-        strcat(filePath, "./");
-        /* If there's something in prefix, add it and a slash */
-        if(headerBuffer.prefix[0]) {
-            strncat(filePath, (char *)&headerBuffer.prefix, MAX_PREFIX);
-            strcat(filePath, "/");
-        }
-        /* Add the name unconditionally */
-        strncat(filePath, (char *)&headerBuffer.name, MAX_NAME);
-
-        pathNoLead = filePath + 2;
-
-        if(directories) {
-            int i;
-            int inDirectoriesBool = 0;
-            for(i = 0; i < numDirectories; i++) {
-                int pathLength = strlen(directories[i]);
-                if(strncmp(pathNoLead, directories[i], pathLength) == 0){
-                    inDirectoriesBool = 1;
-                    break;
-                }
-            }
-            if(!inDirectoriesBool) {
-                if(fileSize > 0) {
-                    /* Skip the body */
-                    if(lseek(fd, (fileSize / BLK_SIZE + 1) * BLK_SIZE,
-                             SEEK_CUR) == -1) {
-                        perror("Couldn't lseek to next header");
-                        exit(errno);
-                    }
-                }
-                continue;
-                free(filePath);
-            }
-        }
 
-        
-        if(*headerBuffer.typeflag == DIR_FLAG) {
-            struct stat statBuffer;
-            struct utimbuf newTime;
-            char *filePath;
-
-            errno = 0;
-            /* +4 for leading "./", concat "/", and null-terminator */
-            filePath = calloc(MAX_NAME + MAX_PREFIX + 4, sizeof(char));
-            if(errno) {
-                perror("Couldn't calloc filePath");
-                exit(errno);
-            }
-
-            /* Leading ./ for a valid relative path */
-            strcat(filePath, "./");
-            /* If there's something in prefix, add it and a slash */
-            if(headerBuffer.prefix[0]) {
-                strncat(filePath, (char *)&headerBuffer.prefix, MAX_PREFIX);
-                strcat(filePath, "/");
-            }
-            /* Add the name unconditionally */
-            strncat(filePath, (char *)&headerBuffer.name, MAX_NAME);
-
-        
-            if(lstat(filePath, &statBuffer)) {
-                perror("Failed to stat created file!");
-                exit(errno);
-            } 
- 
-            /* Preserve atime */
-            newTime.actime = statBuffer.st_atime;
-            /* Set mtime to mtime from header */
-            newTime.modtime = strtol(headerBuffer.mtime, NULL, OCTAL);
-            /* Actually write the time */
-            if(utime(filePath, &newTime)) {
-                perror("Couldn't set utime");
-                exit(errno);
-            }
-        }
+    if(pool) {
+        xpool_finish(pool);
+    }
+    apply_links(&links, dirs);
+    apply_dirs(&deferred, dirs);
 
-        /* Skip over the body to next header */
-        if(fileSize > 0) {
-            /* If the file has size > 0, skip ahead by the required # blocks */
-            if(lseek(fd, (fileSize / BLK_SIZE + 1) * BLK_SIZE, SEEK_CUR) == -1){
-                perror("Couldn't lseek to next header");
-                exit(errno);
-            }
-        }
-        errno = 0;
-        free(filePath);
+    dcache_close(dirs);
+    if(filter) {
+        filter_free(filter);
+    }
+    free(hits.offsets);
+    aio_close(in);
+    if(fd != STDIN_FILENO) {
+        close(fd);
     }
     return 0;
 }
@@ -0,0 +1,223 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fnmatch.h>
+#include "filter.h"
+
+/* Trie over the literal arguments. Children are a sibling list; argument
+ * counts are small enough per node that this beats a 256 way table. */
+struct tnode {
+    char c;
+    /* Index of the literal that ends here, or -1 */
+    int literal;
+    struct tnode *child;
+    struct tnode *sibling;
+};
+
+struct path_filter {
+    struct tnode *root;
+    char **literals;
+    int numLiterals;
+    /* Set once a literal has matched a non-directory of the same name */
+    char *seen;
+    int numSeen;
+    int firstOnly;
+    char **globs;
+    int numGlobs;
+    char **excludes;
+    int numExcludes;
+};
+
+static struct tnode *new_node(char c) {
+    struct tnode *n = calloc(1, sizeof(struct tnode));
+
+    if(!n) {
+        perror("Couldn't calloc filter");
+        exit(EXIT_FAILURE);
+    }
+    n -> c = c;
+    n -> literal = -1;
+    return n;
+}
+
+static void add_literal(struct path_filter *f, const char *path, int idx) {
+    struct tnode *n = f -> root;
+
+    for(; *path; path++) {
+        struct tnode *kid;
+
+        for(kid = n -> child; kid && kid -> c != *path; kid = kid -> sibling) {
+        }
+        if(!kid) {
+            kid = new_node(*path);
+            kid -> sibling = n -> child;
+            n -> child = kid;
+        }
+        n = kid;
+    }
+
+    /* A repeated argument is the same literal */
+    if(n -> literal == -1) {
+        n -> literal = idx;
+    }
+    else {
+        f -> seen[idx] = 1;
+        f -> numSeen++;
+    }
+}
+
+struct path_filter *filter_compile(char **args, int numArgs, int firstOnly) {
+    struct path_filter *f = calloc(1, sizeof(struct path_filter));
+    int i;
+
+    if(!f) {
+        perror("Couldn't calloc filter");
+        exit(EXIT_FAILURE);
+    }
+
+    f -> root = new_node('\0');
+    f -> literals = calloc(numArgs + 1, sizeof(char *));
+    f -> seen = calloc(numArgs + 1, sizeof(char));
+    f -> globs = calloc(numArgs + 1, sizeof(char *));
+    f -> excludes = calloc(numArgs + 1, sizeof(char *));
+    if(!f -> literals || !f -> seen || !f -> globs || !f -> excludes) {
+        perror("Couldn't calloc filter");
+        exit(EXIT_FAILURE);
+    }
+    f -> firstOnly = firstOnly;
+
+    for(i = 0; i < numArgs; i++) {
+        if(!strncmp(args[i], EXCLUDE_OPT, strlen(EXCLUDE_OPT))) {
+            f -> excludes[f -> numExcludes++] = args[i] + strlen(EXCLUDE_OPT);
+        }
+        else if(strpbrk(args[i], GLOB_CHARS)) {
+            f -> globs[f -> numGlobs++] = args[i];
+        }
+        else {
+            f -> literals[f -> numLiterals] = args[i];
+            add_literal(f, args[i], f -> numLiterals++);
+        }
+    }
+
+    return f;
+}
+
+/* True if pattern matches name, name without its trailing '/', or any of
+ * the directories leading up to it */
+static int glob_match(const char *pattern, const char *name) {
+    char buf[4096];
+    size_t len = strlen(name), i;
+
+    if(len >= sizeof(buf)) {
+        return !fnmatch(pattern, name, 0);
+    }
+    strcpy(buf, name);
+
+    for(i = len; i > 0; i--) {
+        if(i == len || buf[i] == '/') {
+            buf[i] = '\0';
+            if(!fnmatch(pattern, buf, 0)) {
+                return 1;
+            }
+            if(i < len) {
+                buf[i] = '/';
+            }
+        }
+    }
+    return !fnmatch(pattern, name, 0);
+}
+
+/* Returns nonzero if the member should be listed/extracted. Walks name
+ * through the trie once, so the cost doesn't grow with the number of
+ * literal arguments. */
+int filter_match(struct path_filter *f, const char *name, int isDir) {
+    struct tnode *n = f -> root;
+    const char *p;
+    int matched = 0, i;
+
+    for(i = 0; i < f -> numExcludes; i++) {
+        if(glob_match(f -> excludes[i], name)) {
+            return 0;
+        }
+    }
+
+    if(!f -> numLiterals && !f -> numGlobs) {
+        return 1;
+    }
+
+    for(p = name; *p; p++) {
+        struct tnode *kid;
+
+        /* A literal ending on a component boundary selects this member */
+        if(n -> literal != -1 &&
+           (*p == '/' || (p > name && p[-1] == '/'))) {
+            matched = 1;
+        }
+
+        for(kid = n -> child; kid && kid -> c != *p; kid = kid -> sibling) {
+        }
+        if(!kid) {
+            n = NULL;
+            break;
+        }
+        n = kid;
+    }
+
+    /* Exact match. With firstOnly a later copy of the same file no longer
+     * counts, though a glob or a shorter literal may still select it. */
+    if(n && n -> literal != -1) {
+        if(isDir) {
+            matched = 1;
+        }
+        else if(!f -> seen[n -> literal]) {
+            f -> seen[n -> literal] = 1;
+            f -> numSeen++;
+            matched = 1;
+        }
+        else if(!f -> firstOnly) {
+            matched = 1;
+        }
+    }
+
+    for(i = 0; !matched && i < f -> numGlobs; i++) {
+        matched = glob_match(f -> globs[i], name);
+    }
+
+    return matched;
+}
+
+/* True once, with firstOnly, nothing later in the archive can match: every
+ * argument was a literal and each has matched its (non-directory) member */
+int filter_done(struct path_filter *f) {
+    return f -> firstOnly && f -> numLiterals && !f -> numGlobs &&
+           f -> numSeen == f -> numLiterals;
+}
+
+/* Hands out the literal arguments, for index lookups. Returns -1 instead
+ * if some argument is a glob, since those can't be looked up by prefix. */
+int filter_literals(struct path_filter *f, char ***literals) {
+    if(f -> numGlobs || !f -> numLiterals) {
+        return -1;
+    }
+    *literals = f -> literals;
+    return f -> numLiterals;
+}
+
+static void free_node(struct tnode *n) {
+    while(n) {
+        struct tnode *next = n -> sibling;
+
+        free_node(n -> child);
+        free(n);
+        n = next;
+    }
+}
+
+void filter_free(struct path_filter *f) {
+    free_node(f -> root);
+    free(f -> literals);
+    free(f -> seen);
+    free(f -> globs);
+    free(f -> excludes);
+    free(f);
+}
@@ -0,0 +1,26 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+/* Member selection for list and extract. Path arguments are compiled once:
+ * literal paths into a prefix trie, arguments with wildcards into globs,
+ * and "--exclude=PATTERN" arguments into exclude globs. A literal selects
+ * the member it names and, for directories, everything under it. With
+ * firstOnly, a literal stops selecting its member after the first copy,
+ * and filter_done() tells the caller when the rest can be skipped. */
+
+#define EXCLUDE_OPT "--exclude="
+#define GLOB_CHARS "*?["
+
+struct path_filter;
+
+struct path_filter *filter_compile(char **args, int numArgs, int firstOnly);
+
+int filter_match(struct path_filter *f, const char *name, int isDir);
+
+int filter_done(struct path_filter *f);
+
+int filter_literals(struct path_filter *f, char ***literals);
+
+void filter_free(struct path_filter *f);
+
+#endif
@@ -1,27 +1,31 @@
-#include <arpa/inet.h>
 #include <string.h>
 #include <stdint.h>
-uint32_t extract_special_int(char *where, int len) {
+int64_t extract_special_int(const char *where, size_t len) {
   /* For interoperability with GNU tar. GNU seems to
   * set the high–order bit of the first byte, then
   * treat the rest of the field as a binary integer
   * in network byte order.
-  * I don’t know for sure if it’s a 32 or 64–bit int, but for
-  * this version, we’ll only support 32. (well, 31)
+  * The whole field is the number, so up to 63 bits fit
+  * in the 12 byte size and mtime fields.
   * returns the integer on success, –1 on failure.
-  * In spite of the name of htonl(), it converts int32 t
   */
-  int32_t val = -1;
-  if ((len >= sizeof(val)) && (where[0] & 0x80)) {
-    /* the top bit is set and we have space
-    * extract the last four bytes */
-    val = *(int32_t *)(where+len-sizeof(val));
-    val = ntohl(val); /* convert to host byte order */
+  int64_t val = -1;
+  size_t i;
+  if ((len > 0) && (where[0] & 0x80) && !(where[0] & 0x40)) {
+    /* the top bit is set and the number isn't negative:
+    * read it a byte at a time, most significant first */
+    val = where[0] & 0x3f;
+    for (i = 1; i < len; i++) {
+      if (val >> 55) {
+        return -1; /* more than we can hold */
+      }
+      val = val << 8 | (unsigned char)where[i];
+    }
   }
   return val;
 }
 
-int insert_special_int(char *where, size_t size, int32_t val) {
+int insert_special_int(char *where, size_t size, int64_t val) {
   /* For interoperability with GNU tar. GNU seems to
   * set the high–order bit of the first byte, then
   * treat the rest of the field as a binary integer
@@ -31,16 +35,20 @@ int insert_special_int(char *where, size_t size, int32_t val) {
   * otherwise
   */
     int err=0;
-    if ( val < 0 || ( size < sizeof(val)) ) {
-      /* if it’s negative, bit 31 is set and we can’t use the flag
-      * if len is too small, we can’t write it. Either way, we’re
-      * done.
+    size_t i;
+    if ( val < 0 || size < 1 ||
+         ( size < sizeof(val) + 1 && val >> (size * 8 - 2) ) ) {
+      /* if it’s negative, we can’t use the flag
+      * if the field is too small for it, we can’t write it.
+      * Either way, we’re done.
       */
       err++;
     } else {
       /* game on....*/
       memset(where, 0, size); /* Clear out the buffer */
-      *(int32_t *)(where+size-sizeof(val)) = htonl(val); /* place the int */
+      for (i = size; i-- > 0 && val; val >>= 8) {
+        where[i] = val & 0xff; /* place the int, lowest byte last */
+      }
       *where |= 0x80; /* set that high–order bit */
     }
   return err;
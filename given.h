@@ -1,8 +1,11 @@
 #ifndef GIVEN_H
 #define GIVEN_H
 
-uint32_t extract_special_int(char *where, int len);
+#include <stddef.h>
+#include <stdint.h>
 
-int insert_special_int(char *where, size_t size, int32_t val);
+int64_t extract_special_int(const char *where, size_t len);
+
+int insert_special_int(char *where, size_t size, int64_t val);
 
 #endif
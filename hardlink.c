@@ -0,0 +1,125 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "hardlink.h"
+
+struct hlink {
+    dev_t dev;
+    ino_t ino;
+    /* Links still to come */
+    nlink_t left;
+    char *path;
+    struct hlink *next;
+};
+
+struct hlink_table {
+    struct hlink **buckets;
+    size_t numBuckets;
+    size_t count;
+    /* Handed out by the last hlink_find(), freed by the next one */
+    char *retired;
+};
+
+static size_t hash_id(dev_t dev, ino_t ino) {
+    uint64_t h = (uint64_t)ino * 0x9E3779B97F4A7C15ULL ^ (uint64_t)dev;
+
+    return (size_t)(h ^ (h >> 32));
+}
+
+static void grow(struct hlink_table *t) {
+    size_t n = t -> numBuckets * 2, i;
+    struct hlink **buckets = calloc(n, sizeof(struct hlink *));
+
+    if(!buckets) {
+        perror("Couldn't calloc link table");
+        exit(EXIT_FAILURE);
+    }
+    for(i = 0; i < t -> numBuckets; i++) {
+        struct hlink *e = t -> buckets[i], *next;
+
+        for(; e; e = next) {
+            size_t b = hash_id(e -> dev, e -> ino) % n;
+
+            next = e -> next;
+            e -> next = buckets[b];
+            buckets[b] = e;
+        }
+    }
+    free(t -> buckets);
+    t -> buckets = buckets;
+    t -> numBuckets = n;
+}
+
+struct hlink_table *hlink_open(void) {
+    struct hlink_table *t = calloc(1, sizeof(struct hlink_table));
+
+    if(!t || !(t -> buckets = calloc(HLINK_START_BUCKETS,
+                                     sizeof(struct hlink *)))) {
+        perror("Couldn't calloc link table");
+        exit(EXIT_FAILURE);
+    }
+    t -> numBuckets = HLINK_START_BUCKETS;
+    return t;
+}
+
+/* Returns the name the file (dev, ino) was first archived under, or NULL
+ * if this is the first time it is seen, in which case path is remembered
+ * for the nlink - 1 links still to come. The name stays valid until the
+ * next call. */
+const char *hlink_find(struct hlink_table *t, dev_t dev, ino_t ino,
+                       nlink_t nlink, const char *path) {
+    size_t b = hash_id(dev, ino) % t -> numBuckets;
+    struct hlink *e, **prev;
+
+    free(t -> retired);
+    t -> retired = NULL;
+
+    for(prev = &t -> buckets[b]; (e = *prev); prev = &e -> next) {
+        if(e -> dev != dev || e -> ino != ino) {
+            continue;
+        }
+        /* Last link: nobody else will ask, so drop the entry */
+        if(--e -> left == 0) {
+            *prev = e -> next;
+            t -> retired = e -> path;
+            t -> count--;
+            free(e);
+            return t -> retired;
+        }
+        return e -> path;
+    }
+
+    if(!(e = malloc(sizeof(struct hlink))) || !(e -> path = strdup(path))) {
+        perror("Couldn't malloc link table entry");
+        exit(EXIT_FAILURE);
+    }
+    e -> dev = dev;
+    e -> ino = ino;
+    e -> left = nlink - 1;
+    e -> next = t -> buckets[b];
+    t -> buckets[b] = e;
+
+    if(++t -> count > t -> numBuckets * 2) {
+        grow(t);
+    }
+    return NULL;
+}
+
+void hlink_close(struct hlink_table *t) {
+    size_t i;
+
+    for(i = 0; i < t -> numBuckets; i++) {
+        struct hlink *e = t -> buckets[i], *next;
+
+        for(; e; e = next) {
+            next = e -> next;
+            free(e -> path);
+            free(e);
+        }
+    }
+    free(t -> retired);
+    free(t -> buckets);
+    free(t);
+}
@@ -0,0 +1,22 @@
+#ifndef HARDLINK_H
+#define HARDLINK_H
+
+#include <sys/types.h>
+
+/* Files with more than one link that create has already archived, by
+ * (st_dev, st_ino), so later names for the same file become link members
+ * instead of another copy of the body. An entry goes away once all of the
+ * file's links have been seen. */
+
+#define HLINK_START_BUCKETS 1024
+
+struct hlink_table;
+
+struct hlink_table *hlink_open(void);
+
+const char *hlink_find(struct hlink_table *t, dev_t dev, ino_t ino,
+                       nlink_t nlink, const char *path);
+
+void hlink_close(struct hlink_table *t);
+
+#endif
@@ -1,3 +1,6 @@
+#ifndef HEADER_H
+#define HEADER_H
+
 struct header {
     char name[100];
     char mode[8];
@@ -19,3 +22,5 @@ struct header {
     /* Do not interact with this! It is otherwise insignificant. */
     char padding[12];
 };
+
+#endif
@@ -0,0 +1,132 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pwd.h>
+#include <grp.h>
+#include <sys/types.h>
+#include "idcache.h"
+
+struct id_entry {
+    long id;
+    /* Empty when the lookup failed */
+    char name[ID_NAME_SIZE + 1];
+    int found;
+    struct id_entry *next;
+};
+
+/* id -> name, and name -> id, for users and groups */
+static struct id_entry *unameCache[ID_BUCKETS];
+static struct id_entry *gnameCache[ID_BUCKETS];
+static struct id_entry *uidCache[ID_BUCKETS];
+static struct id_entry *gidCache[ID_BUCKETS];
+
+static unsigned int hash_name(const char *name) {
+    unsigned int h = 5381;
+
+    while(*name) {
+        h = h * 33 + (unsigned char)*name++;
+    }
+    return h % ID_BUCKETS;
+}
+
+static struct id_entry *add_entry(struct id_entry **table, unsigned int b,
+                                  long id, const char *name, int found) {
+    struct id_entry *e = malloc(sizeof(struct id_entry));
+
+    if(!e) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    e -> id = id;
+    e -> found = found;
+    /* Names are cut to what fits in the header field */
+    strncpy(e -> name, name ? name : "", ID_NAME_SIZE);
+    e -> name[ID_NAME_SIZE] = '\0';
+    e -> next = table[b];
+    table[b] = e;
+    return e;
+}
+
+static struct id_entry *find_id(struct id_entry **table, long id) {
+    struct id_entry *e;
+
+    for(e = table[(unsigned long)id % ID_BUCKETS]; e; e = e -> next) {
+        if(e -> id == id) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static struct id_entry *find_name(struct id_entry **table, const char *name) {
+    struct id_entry *e;
+
+    for(e = table[hash_name(name)]; e; e = e -> next) {
+        if(!strcmp(e -> name, name)) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/* Returns the user name for uid, or NULL if it has none */
+const char *idcache_uname(uid_t uid) {
+    struct id_entry *e = find_id(unameCache, uid);
+
+    if(!e) {
+        struct passwd *pw = getpwuid(uid);
+
+        e = add_entry(unameCache, (unsigned long)uid % ID_BUCKETS, uid,
+                      pw ? pw -> pw_name : NULL, pw != NULL);
+    }
+    return e -> found ? e -> name : NULL;
+}
+
+/* Returns the group name for gid, or NULL if it has none */
+const char *idcache_gname(gid_t gid) {
+    struct id_entry *e = find_id(gnameCache, gid);
+
+    if(!e) {
+        struct group *g = getgrgid(gid);
+
+        e = add_entry(gnameCache, (unsigned long)gid % ID_BUCKETS, gid,
+                      g ? g -> gr_name : NULL, g != NULL);
+    }
+    return e -> found ? e -> name : NULL;
+}
+
+/* Maps a user name from an archive back to a local uid, falling back to
+ * the numeric id from the header if the name is empty or unknown here */
+uid_t idcache_uid(const char *name, uid_t fallback) {
+    struct id_entry *e;
+
+    if(!name[0]) {
+        return fallback;
+    }
+
+    if(!(e = find_name(uidCache, name))) {
+        struct passwd *pw = getpwnam(name);
+
+        e = add_entry(uidCache, hash_name(name), pw ? (long)pw -> pw_uid : 0,
+                      name, pw != NULL);
+    }
+    return e -> found ? (uid_t)e -> id : fallback;
+}
+
+/* Group counterpart of idcache_uid() */
+gid_t idcache_gid(const char *name, gid_t fallback) {
+    struct id_entry *e;
+
+    if(!name[0]) {
+        return fallback;
+    }
+
+    if(!(e = find_name(gidCache, name))) {
+        struct group *g = getgrnam(name);
+
+        e = add_entry(gidCache, hash_name(name), g ? (long)g -> gr_gid : 0,
+                      name, g != NULL);
+    }
+    return e -> found ? (gid_t)e -> id : fallback;
+}
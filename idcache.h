@@ -0,0 +1,20 @@
+#ifndef IDCACHE_H
+#define IDCACHE_H
+
+#include <sys/types.h>
+
+#define ID_NAME_SIZE 32
+#define ID_BUCKETS 256
+
+/* Per run cache of user and group name lookups. Both hits and misses are
+ * remembered, so each distinct id or name costs at most one NSS call. */
+
+const char *idcache_uname(uid_t uid);
+
+const char *idcache_gname(gid_t gid);
+
+uid_t idcache_uid(const char *name, uid_t fallback);
+
+gid_t idcache_gid(const char *name, gid_t fallback);
+
+#endif
@@ -0,0 +1,343 @@
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "index.h"
+#include "blockio.h"
+
+#define ENTRIES_START 256
+#define NAMES_START 4096
+
+struct idx_builder {
+    struct idx_entry *entries;
+    long count;
+    long cap;
+    char *names;
+    size_t namesLen;
+    size_t namesCap;
+};
+
+struct idx {
+    const char *map;
+    size_t mapLen;
+    const struct idx_entry *entries;
+    const char *names;
+    long count;
+};
+
+/* qsort() has no context argument, so the name table rides along here */
+static const char *sortNames;
+
+struct idx_builder *idx_begin(void) {
+    struct idx_builder *b = calloc(1, sizeof(struct idx_builder));
+
+    if(!b) {
+        perror("Couldn't calloc index");
+        exit(EXIT_FAILURE);
+    }
+    return b;
+}
+
+/* Records one member. name is the full path as list prints it. */
+void idx_add(struct idx_builder *b, const char *name, off_t headerOffset,
+             off_t size, char type, time_t mtime) {
+    size_t len = strlen(name);
+    struct idx_entry *e;
+
+    if(b -> count == b -> cap) {
+        b -> cap = b -> cap ? b -> cap * 2 : ENTRIES_START;
+        if(!(b -> entries = realloc(b -> entries,
+                                    b -> cap * sizeof(struct idx_entry)))) {
+            perror("Couldn't realloc index");
+            exit(EXIT_FAILURE);
+        }
+    }
+    while(b -> namesLen + len + 1 > b -> namesCap) {
+        b -> namesCap = b -> namesCap ? b -> namesCap * 2 : NAMES_START;
+        if(!(b -> names = realloc(b -> names, b -> namesCap))) {
+            perror("Couldn't realloc index names");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    e = &b -> entries[b -> count++];
+    memset(e, 0, sizeof(struct idx_entry));
+    e -> nameOffset = b -> namesLen;
+    e -> nameLen = len;
+    e -> headerOffset = headerOffset;
+    e -> size = size;
+    e -> mtime = mtime;
+    e -> type = type;
+
+    memcpy(b -> names + b -> namesLen, name, len + 1);
+    b -> namesLen += len + 1;
+}
+
+/* Sorts by name, keeping archive order between equal names so the last
+ * copy of an appended file stays last */
+static int cmp_entries(const void *a, const void *b) {
+    const struct idx_entry *x = a, *y = b;
+    int c = strcmp(sortNames + x -> nameOffset, sortNames + y -> nameOffset);
+
+    if(c) {
+        return c;
+    }
+    return x -> headerOffset < y -> headerOffset ? -1 :
+           x -> headerOffset > y -> headerOffset;
+}
+
+/* Sorts and writes the sidecar for archiveName, then frees the builder.
+ * archiveFd must be the finished archive so its size and mtime can be
+ * stamped into the index. */
+void idx_write(struct idx_builder *b, const char *archiveName, int archiveFd) {
+    struct idx_file_header h;
+    struct stat sb;
+    char *idxName, *tmpName;
+    FILE *f;
+
+    if(fstat(archiveFd, &sb) == -1) {
+        perror("Couldn't stat archive for index");
+        exit(errno);
+    }
+
+    sortNames = b -> names;
+    qsort(b -> entries, b -> count, sizeof(struct idx_entry), cmp_entries);
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, IDX_MAGIC, IDX_MAGIC_LEN);
+    h.count = b -> count;
+    h.archiveSize = sb.st_size;
+    h.archiveMtime = sb.st_mtim.tv_sec;
+    h.archiveMtimeNsec = sb.st_mtim.tv_nsec;
+    h.namesOffset = sizeof(h) + b -> count * sizeof(struct idx_entry);
+
+    idxName = malloc(strlen(archiveName) + strlen(IDX_SUFFIX) + 1);
+    tmpName = malloc(strlen(archiveName) + strlen(IDX_SUFFIX) + 5);
+    if(!idxName || !tmpName) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(idxName, "%s%s", archiveName, IDX_SUFFIX);
+    sprintf(tmpName, "%s.tmp", idxName);
+
+    /* Written aside and renamed so a reader never sees half an index */
+    if(!(f = fopen(tmpName, "w"))) {
+        perror("Couldn't create index");
+        exit(errno);
+    }
+    if(fwrite(&h, sizeof(h), 1, f) != 1 ||
+       (b -> count && fwrite(b -> entries, sizeof(struct idx_entry),
+                             b -> count, f) != (size_t)b -> count) ||
+       (b -> namesLen && fwrite(b -> names, b -> namesLen, 1, f) != 1) ||
+       fclose(f)) {
+        perror("Couldn't write index");
+        exit(errno);
+    }
+    if(rename(tmpName, idxName)) {
+        perror("Couldn't rename index");
+        exit(errno);
+    }
+
+    free(idxName);
+    free(tmpName);
+    free(b -> entries);
+    free(b -> names);
+    free(b);
+}
+
+/* Nonzero if every entry's name lies inside the name table, NUL
+ * terminated, and its header inside the archive */
+static int entries_valid(const char *map, size_t mapLen,
+                         const struct idx_file_header *h, off_t archiveSize) {
+    const struct idx_entry *e = (const struct idx_entry *)(map + sizeof(*h));
+    const char *names = map + h -> namesOffset;
+    uint64_t namesLen = mapLen - h -> namesOffset, i;
+
+    for(i = 0; i < h -> count; i++, e++) {
+        if(e -> nameOffset >= namesLen ||
+           e -> nameLen >= namesLen - e -> nameOffset ||
+           names[e -> nameOffset + e -> nameLen] ||
+           e -> headerOffset > (uint64_t)archiveSize - AIO_BLOCK) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Maps the sidecar of archiveName. Returns NULL if there is none, or if it
+ * is damaged or older than the archive. */
+struct idx *idx_open(const char *archiveName, int archiveFd) {
+    const struct idx_file_header *h;
+    struct stat asb, isb;
+    struct idx *x;
+    char *idxName;
+    void *map;
+    int fd;
+
+    if(fstat(archiveFd, &asb) == -1 || !S_ISREG(asb.st_mode)) {
+        return NULL;
+    }
+
+    if(!(idxName = malloc(strlen(archiveName) + strlen(IDX_SUFFIX) + 1))) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(idxName, "%s%s", archiveName, IDX_SUFFIX);
+    fd = open(idxName, O_RDONLY);
+    free(idxName);
+    if(fd == -1) {
+        return NULL;
+    }
+
+    if(fstat(fd, &isb) == -1 || isb.st_size < (off_t)sizeof(*h)) {
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, isb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+        return NULL;
+    }
+
+    /* A damaged index is ignored, and the archive scanned instead */
+    h = map;
+    if(memcmp(h -> magic, IDX_MAGIC, IDX_MAGIC_LEN) ||
+       h -> archiveSize != (uint64_t)asb.st_size ||
+       asb.st_size < AIO_BLOCK ||
+       h -> archiveMtime != asb.st_mtim.tv_sec ||
+       h -> archiveMtimeNsec != asb.st_mtim.tv_nsec ||
+       h -> count > (isb.st_size - sizeof(*h)) / sizeof(struct idx_entry) ||
+       h -> namesOffset != sizeof(*h) + h -> count * sizeof(struct idx_entry) ||
+       h -> namesOffset > (uint64_t)isb.st_size ||
+       !entries_valid(map, isb.st_size, h, asb.st_size)) {
+        munmap(map, isb.st_size);
+        return NULL;
+    }
+
+    if(!(x = calloc(1, sizeof(struct idx)))) {
+        perror("Couldn't calloc index");
+        exit(EXIT_FAILURE);
+    }
+    x -> map = map;
+    x -> mapLen = isb.st_size;
+    x -> entries = (const struct idx_entry *)(x -> map + sizeof(*h));
+    x -> names = x -> map + h -> namesOffset;
+    x -> count = h -> count;
+    return x;
+}
+
+static const char *entry_name(struct idx *x, long i) {
+    return x -> names + x -> entries[i].nameOffset;
+}
+
+/* First entry whose name is >= key */
+static long lower_bound(struct idx *x, const char *key) {
+    long lo = 0, hi = x -> count;
+
+    while(lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+
+        if(strcmp(entry_name(x, mid), key) < 0) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static int cmp_offsets(const void *a, const void *b) {
+    off_t x = *(const off_t *)a, y = *(const off_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Finds every member starting with one of the prefixes, the way list and
+ * extract match their path arguments. Returns their header offsets in
+ * archive order (caller frees), with the count in numHits. */
+off_t *idx_lookup(struct idx *x, char **prefixes, int numPrefixes,
+                  long *numHits) {
+    off_t *hits = NULL;
+    long n = 0, cap = 0, i, j;
+    int p;
+
+    for(p = 0; p < numPrefixes; p++) {
+        size_t len = strlen(prefixes[p]);
+
+        /* Sorted, so all names with this prefix are one run */
+        for(i = lower_bound(x, prefixes[p]); i < x -> count &&
+            !strncmp(entry_name(x, i), prefixes[p], len); i++) {
+            if(n == cap) {
+                cap = cap ? cap * 2 : ENTRIES_START;
+                if(!(hits = realloc(hits, cap * sizeof(off_t)))) {
+                    perror("Couldn't realloc index hits");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            hits[n++] = x -> entries[i].headerOffset;
+        }
+    }
+
+    /* Overlapping prefixes can find a member twice */
+    qsort(hits, n, sizeof(off_t), cmp_offsets);
+    for(i = j = 0; i < n; i++) {
+        if(!j || hits[j - 1] != hits[i]) {
+            hits[j++] = hits[i];
+        }
+    }
+
+    *numHits = j;
+    return hits;
+}
+
+long idx_count(struct idx *x) {
+    return x -> count;
+}
+
+/* The i'th entry in name order, with its name */
+const struct idx_entry *idx_get(struct idx *x, long i, const char **name) {
+    *name = entry_name(x, i);
+    return &x -> entries[i];
+}
+
+void idx_close(struct idx *x) {
+    munmap((void *)x -> map, x -> mapLen);
+    free(x);
+}
+
+/* Looks the path arguments up in the archive's index, if it has a current
+ * one. Returns nonzero and fills in hits if the index could be used. */
+int idx_find(const char *archiveName, struct archive_io *in, char **prefixes,
+             int numPrefixes, struct idx_hits *hits) {
+    struct idx *x;
+
+    memset(hits, 0, sizeof(struct idx_hits));
+
+    /* Jumping to offsets needs a plain file, or a compressed one with a
+     * frame table */
+    if(!aio_seekable(in) || !(x = idx_open(archiveName, in -> fd))) {
+        return 0;
+    }
+
+    hits -> offsets = idx_lookup(x, prefixes, numPrefixes, &hits -> count);
+    idx_close(x);
+    return 1;
+}
+
+/* Returns the next header block to look at: the next one in the archive,
+ * or with hits only the next matching one. NULL when there are no more. */
+const void *idx_next_header(struct archive_io *in, struct idx_hits *hits) {
+    if(hits) {
+        if(hits -> next == hits -> count) {
+            return NULL;
+        }
+        aio_seek(in, hits -> offsets[hits -> next++]);
+    }
+    return aio_next(in, AIO_BLOCK);
+}
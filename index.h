@@ -0,0 +1,73 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* Sidecar member index, written next to the archive as <archive>.idx.
+ * The file is an idx_file_header, then count idx_entry records sorted by
+ * name, then the NUL terminated names they point at. It records the
+ * archive's size and mtime and is ignored once they no longer match. */
+
+#define IDX_SUFFIX ".idx"
+#define IDX_MAGIC "MYTARIX1"
+#define IDX_MAGIC_LEN 8
+
+struct idx_file_header {
+    char magic[IDX_MAGIC_LEN];
+    uint64_t count;
+    uint64_t archiveSize;
+    int64_t archiveMtime;
+    int64_t archiveMtimeNsec;
+    /* File offset of the name table */
+    uint64_t namesOffset;
+};
+
+struct idx_entry {
+    /* Offset of the name in the name table */
+    uint64_t nameOffset;
+    /* Offset of the member's header block in the archive */
+    uint64_t headerOffset;
+    uint64_t size;
+    int64_t mtime;
+    uint32_t nameLen;
+    char type;
+    char pad[3];
+};
+
+/* Header offsets of the members a lookup matched, in archive order */
+struct idx_hits {
+    off_t *offsets;
+    long count;
+    long next;
+};
+
+struct idx_builder;
+struct idx;
+struct archive_io;
+
+struct idx_builder *idx_begin(void);
+
+void idx_add(struct idx_builder *b, const char *name, off_t headerOffset,
+             off_t size, char type, time_t mtime);
+
+void idx_write(struct idx_builder *b, const char *archiveName, int archiveFd);
+
+struct idx *idx_open(const char *archiveName, int archiveFd);
+
+off_t *idx_lookup(struct idx *x, char **prefixes, int numPrefixes,
+                  long *numHits);
+
+long idx_count(struct idx *x);
+
+const struct idx_entry *idx_get(struct idx *x, long i, const char **name);
+
+void idx_close(struct idx *x);
+
+int idx_find(const char *archiveName, struct archive_io *in, char **prefixes,
+             int numPrefixes, struct idx_hits *hits);
+
+const void *idx_next_header(struct archive_io *in, struct idx_hits *hits);
+
+#endif
@@ -8,12 +8,13 @@
 #include <time.h> 
 #include "util.h"
 #include "header.h"
-#include "given.h"
+#include "codec.h"
+#include "blockio.h"
+#include "mytar.h"
+#include "index.h"
+#include "filter.h"
+#include "pax.h"
 
-#define OCTAL 8
-#define BLOCKSIZE 512
-#define MAX_NAME_LEN 255
-#define EMPTY_BLOCK_CHKSUM 256
 #define MAGIC_LEN 6
 #define VERSION_LEN 2
 /* equivalent to 100 000 000 */
@@ -21,29 +22,38 @@
 #define PERMS_LEN 9
 #define REG_FLAG '0'
 #define REG_FLAG_ALT '\0'
+#define HARDLINK_FLAG '1'
 #define SYM_FLAG '2'
 #define DIR_FLAG '5'
+/* A directory with a listing of its contents, from incremental create */
+#define DUMPDIR_FLAG 'D'
 #define OWNER_LEN 17
-#define SPECIAL_INT_MASK 0x800000
 #define MTIME_STR_LEN 16
 
 extern int errno;
 
 int list_cmd(char* fileName, char *directories[], int numDirectories,
-    int verboseBool, int strictBool) {
+    struct tar_opts *opts) {
 
     int fd;
-    struct header headerBuffer;
-     
-    /* Validate if fileName is a .tar */
-    if(!strstr(fileName, ".tar")) {
-        fprintf(stderr, "Passed file is not a .tar!\n");
-        exit(EXIT_FAILURE);
-    }
+    int verboseBool = opts -> verboseBool, strictBool = opts -> strictBool;
+    const struct header *headerBuffer;
+    struct archive_io *in;
+    struct idx_hits hits;
+    int useIndex;
+    struct path_filter *filter = NULL;
+    char **literals;
+    int numLiterals = -1;
+    struct idx_builder *builder = NULL;
 
     /* Open the tarfile and exit on any errors */
     errno = 0;
-    fd = open(fileName, O_RDONLY);
+    if(!strcmp(fileName, STDIO_ARCHIVE)) {
+        fd = STDIN_FILENO;
+    }
+    else {
+        fd = open(fileName, O_RDONLY);
+    }
 
     if(errno) {
         fprintf(stderr, "Couldn't open file %s: %s",
@@ -51,18 +61,43 @@ int list_cmd(char* fileName, char *directories[], int numDirectories,
         exit(errno);
     }
 
+    in = aio_open_reader(fd, opts -> recordSize);
+
+    /* 'i' indexes the archive as a side effect of listing all of it */
+    if(opts -> indexBool && !directories) {
+        builder = idx_begin();
+    }
+
+    /* With path arguments and a current index, only the matching headers
+     * are visited instead of the whole archive */
+    memset(&hits, 0, sizeof(hits));
+    if(directories) {
+        filter = filter_compile(directories, numDirectories,
+                                opts -> firstBool);
+        numLiterals = filter_literals(filter, &literals);
+    }
+    useIndex = numLiterals > 0 &&
+               idx_find(fileName, in, literals, numLiterals, &hits);
+
     errno = 0;
-    while(read(fd, &headerBuffer, sizeof(struct header)) > 0) {
-        char *fullName;
-        int i, expectedChecksum, readChecksum;
-        unsigned long int fileSize;
-        char *ownerGroup;
+    /* Headers are parsed in place, out of the mapping or record buffer.
+     * Append and update add later copies of the same paths, so only with
+     * 'q' does reading stop once every argument has matched. That holds
+     * for index hits too, which include the later copies. */
+    while(!(filter && filter_done(filter)) &&
+          (headerBuffer = (const struct header *)idx_next_header(in,
+                          useIndex ? &hits : NULL))) {
+        off_t headerOffset = in -> offset - sizeof(struct header);
+        int i, status;
+        off_t fileSize;
+        /* Trimmed to OWNER_LEN when printed */
+        char ownerGroup[2 * HDR_NAME_SIZE];
         char perms[] = "-rwxrwxrwx";
         int mask = STARTING_MASK;
-        int readMode = strtol(headerBuffer.mode, NULL, OCTAL);
+        struct hdr_info info;
+        struct pax_info px;
         struct tm m_time;
-        long int readTime;
-        char *mtime_str;
+        char mtime_str[MTIME_STR_LEN + 1];
 
         /* Check read() error */
         if(errno) {
@@ -70,201 +105,147 @@ int list_cmd(char* fileName, char *directories[], int numDirectories,
             exit(errno);
         }
 
-        fileSize = strtol(headerBuffer.size, NULL, OCTAL);
-        expectedChecksum = calc_checksum((unsigned char *)&headerBuffer);
-        readChecksum = strtol(headerBuffer.chksum, NULL, OCTAL);
-   
-        /* Check for valid end of archive */
-        if(readChecksum == 0 && expectedChecksum == EMPTY_BLOCK_CHKSUM) {
-            int nextExpected;
-            int nextRead;
+        /* Any extended headers first, then the member they describe */
+        status = pax_decode(in, &headerBuffer, &info, &px);
 
+        /* Check for valid end of archive */
+        if(status == HDR_ZERO) {
             /* Read next block */
-            errno = 0;
-            read(fd, &headerBuffer, sizeof(struct header));
-            if(errno) {
-                perror("Couldn't check next block");
-                exit(errno);
+            if(!(headerBuffer = (const struct header *)aio_next(in,
+                                 sizeof(struct header)))) {
+                fprintf(stderr, "Archive is truncated! Exiting.");
+                exit(EXIT_FAILURE);
             }
 
-            nextExpected = calc_checksum((unsigned char *)&headerBuffer);
-            nextRead = strtol(headerBuffer.chksum, NULL, OCTAL);
-
             /* Check if next block is also all zeroes */
-            if(nextRead != 0 || nextExpected != EMPTY_BLOCK_CHKSUM) {
+            if(!is_zero_block((unsigned char *)headerBuffer)) {
                 fprintf(stderr, "Archive is corrupted! Exiting.");
                 exit(EXIT_FAILURE);
             }
 
             /* If we haven't errored out by now, we must be at the end
              * of a valid archive! We're all done. */
-            exit(EXIT_SUCCESS);
+            break;
         }
-    
+
         /* Validate checksum */
-        if(expectedChecksum != readChecksum) {
+        if(status == HDR_BAD) {
             fprintf(stderr,
-                    "Expected checksum %d doesn't match read checksum %d\n",
-                    expectedChecksum, readChecksum);
+                    "Expected checksum %d doesn't match read checksum %ld\n",
+                    info.sum, info.chksum);
             exit(EXIT_FAILURE);
         }
 
+        fileSize = info.size;
+
         /* Check for magic string - minus one since strncmp stops on null */
-        if(strncmp("ustar", headerBuffer.magic, MAGIC_LEN - 1) != 0) {
+        if(strncmp("ustar", headerBuffer->magic, MAGIC_LEN - 1) != 0) {
             fprintf(stderr, "Magic string doesn't check out: \"%s\"\n",
-                (char *)&headerBuffer.magic);
+                (char *)&headerBuffer->magic);
             exit(EXIT_FAILURE);
         }
 
         /* Check for version, IF in strict mode */
-        if(strictBool && strncmp("00", headerBuffer.version, VERSION_LEN) != 0){
+        if(strictBool && strncmp("00", headerBuffer->version, VERSION_LEN) != 0){
             /* The .2 limits the # chars we print */
             fprintf(stderr, "Version doesn't check out: \"%.2s\"\n",
-                (char *)&headerBuffer.version);
+                (char *)&headerBuffer->version);
             exit(EXIT_FAILURE);
         }       
 
-        /* Add d or l for directory/link */
-        if(*(headerBuffer.typeflag) == DIR_FLAG) {
-            *perms = 'd';
-        }
-        else if(*(headerBuffer.typeflag) == SYM_FLAG) {
-            *perms = 'l';
+        if(builder) {
+            idx_add(builder, info.path, headerOffset,
+                    px.sparse ? px.realSize : fileSize, info.type,
+                    info.mtime);
         }
 
-        /* Check each perms bit and set accordingly */
-        for(i = 0; i < PERMS_LEN; i++) {
-            if(!(mask & readMode)) {
-                perms[i + 1] = '-';
+        /* Check the member against the compiled path arguments */
+        if(filter) {
+            if(!filter_match(filter, info.path, info.type == DIR_FLAG ||
+                             info.type == DUMPDIR_FLAG)) {
+                if(fileSize > 0) {
+                    /* Skip the body */
+                    aio_skip(in, AIO_PADDED(fileSize));
+                }
+                continue;
             }
-            mask >>= 1;
-        }
-
-        errno = 0;
-        ownerGroup = calloc(OWNER_LEN + 1, sizeof(char));
-        if(errno) {
-            perror("Couldn't calloc ownerGroup");
-            exit(errno);
         }
 
-        if(headerBuffer.uname[0]) {
-            snprintf(ownerGroup, OWNER_LEN + 1, "%s/%s",
-                (char *)&headerBuffer.uname, 
-                (char*)&headerBuffer.gname);
+        if(!verboseBool) {
+            printf("%s\n", info.path);
         }
         else {
-            int uidCheck = strtol(headerBuffer.uid, NULL, OCTAL);
-            if(uidCheck & SPECIAL_INT_MASK) {
-                /* extract special ints here */
-                uint32_t special_uid = 
-                    extract_special_int(headerBuffer.uid,
-                    sizeof(headerBuffer.uid));
-                uint32_t special_gid =
-                     extract_special_int(headerBuffer.gid,
-                     sizeof(headerBuffer.gid));
-                snprintf(ownerGroup, OWNER_LEN + 1, "%ld/%ld",
-                     (long int)special_uid,
-                     (long int)special_gid);
+            /* Add d or l for directory/link */
+            if(info.type == DIR_FLAG || info.type == DUMPDIR_FLAG) {
+                *perms = 'd';
             }
-            else {
-                /* strtol as usual and concat */
-                long int uid = strtol(headerBuffer.uid, NULL, OCTAL);
-                long int gid = strtol(headerBuffer.gid, NULL, OCTAL);
-                snprintf(ownerGroup, OWNER_LEN + 1, "%ld/%ld", uid, gid); 
+            else if(info.type == SYM_FLAG) {
+                *perms = 'l';
+            }
+            else if(info.type == HARDLINK_FLAG) {
+                *perms = 'h';
             }
-        }
-                
-        errno = 0;
-        /* +2 to make space for slash and null-term */
-        fullName = calloc(MAX_NAME_LEN + 2, sizeof(char));
-        if(errno) {
-            perror("Couldn't calloc fullName");
-        }
-        
-        /* Check if prefix exists */
-        /* We're using the alternative 'n' methods here to avoid undefined
-         * behaviour if either the prefix or name isn't null terminated.
-         * (Which is entirely possible with the standard) */
-        if(headerBuffer.prefix[0]) {
-            strncpy(fullName, (char *)&headerBuffer.prefix,
-                 sizeof(headerBuffer.prefix));
-            strcat(fullName, "/");
-            strncat(fullName, (char *)&headerBuffer.name,
-                 sizeof(headerBuffer.name));
-        }
-        else {
-            strncpy(fullName, (char *)&headerBuffer.name,
-                sizeof(headerBuffer.name));
-        }
 
-        errno = 0;
-        mtime_str = calloc(MTIME_STR_LEN + 1, sizeof(char));
-        if(errno) {
-            perror("Couldn't calloc mtime_str");
-            exit(errno);
-        }
+            /* Check each perms bit and set accordingly */
+            for(i = 0; i < PERMS_LEN; i++) {
+                if(!(mask & info.mode)) {
+                    perms[i + 1] = '-';
+                }
+                mask >>= 1;
+            }
 
-        /* Read mtime and format it into a tm struct */
-        readTime = strtol(headerBuffer.mtime, NULL, OCTAL);
-        memcpy(&m_time, localtime(&readTime), sizeof(struct tm));
+            /* Names if the archive has them, else the numeric ids */
+            if(info.uname[0]) {
+                snprintf(ownerGroup, sizeof(ownerGroup), "%s/%s",
+                    info.uname, info.gname);
+            }
+            else {
+                snprintf(ownerGroup, sizeof(ownerGroup), "%ld/%ld",
+                    info.uid, info.gid);
+            }
 
-        /* Format the time into a string */
-        errno = 0;
-        strftime((char *)mtime_str, MTIME_STR_LEN + 1, "%Y-%m-%d %H:%M",
-             &m_time);
-        if(errno) {
-            perror("Couldn't format time");
-            exit(errno);
-        }
+            /* Read mtime and format it into a tm struct */
+            memcpy(&m_time, localtime(&info.mtime), sizeof(struct tm));
 
-        /* If we've passed a non-null directories[], check all directories
-         * against the beginning of current fullName and don't print if
-         * it doesn't match an element of directories[]. */
-        if(directories) {
-            int inDirectoriesBool = 0;
-            for(i = 0; i < numDirectories; i++) {
-                int pathLength = strlen(directories[i]);
-                if(strncmp(fullName, directories[i], pathLength) == 0) {
-                    inDirectoriesBool = 1;
-                    break;
-                }
-            }
-            if(!inDirectoriesBool) {
-                if(fileSize > 0) {
-                    /* Skip the body */
-                    if(lseek(fd, (fileSize / BLOCKSIZE + 1) * BLOCKSIZE,
-                             SEEK_CUR) == -1) {
-                        perror("Couldn't lseek to next header");
-                        exit(errno);
-                    }
-                }
-                continue;
-                free(fullName);
+            /* Format the time into a string */
+            errno = 0;
+            strftime(mtime_str, MTIME_STR_LEN + 1, "%Y-%m-%d %H:%M",
+                 &m_time);
+            if(errno) {
+                perror("Couldn't format time");
+                exit(errno);
             }
-        }
 
-        if(!verboseBool) {
-            printf("%s\n", fullName); 
-        }
-        else {
-            printf("%10.10s %17.17s %8ld %16.16s %s\n",
-                 perms, ownerGroup, fileSize, mtime_str, fullName);
+            /* A sparse file's real size, not what it takes up here */
+            printf("%10.10s %17.17s %8ld %16.16s %s",
+                 perms, ownerGroup, (long)(px.sparse ? px.realSize : fileSize),
+                 mtime_str, info.path);
+            if(info.type == HARDLINK_FLAG) {
+                printf(" link to %s", info.linkname);
+            }
+            printf("\n");
         }
 
         /* Skip over the body to next header */
         if(fileSize > 0) {
             /* If the file has size > 0, skip ahead by the required # blocks */
-            if(lseek(fd, (fileSize / BLOCKSIZE + 1) * BLOCKSIZE, SEEK_CUR)
-                == -1) {
-                perror("Couldn't lseek to next header");
-                exit(errno);
-            }
+            aio_skip(in, AIO_PADDED(fileSize));
         }
 
-        free(fullName);
         /* Clear for next read() */
         errno = 0;
     }
-    close(fd);
+
+    if(builder) {
+        idx_write(builder, fileName, fd);
+    }
+    if(filter) {
+        filter_free(filter);
+    }
+    free(hits.offsets);
+    aio_close(in);
+    if(fd != STDIN_FILENO) {
+        close(fd);
+    }
     return 0;
 }
@@ -3,58 +3,132 @@
 #include <stdlib.h>
 #include <errno.h>
 #include "mytar.h"
+#include "blockio.h"
+#include "pool.h"
+#include "compress.h"
+
+#define USAGE "Usage: mytar [ctxruvSpizZDq]f[bjg] tarfile [ blocks ] [ jobs ] " \
+    "[ snapshot ] [ path [ ... ] ]\n"
 
 extern int errno;
 
 int main(int argc, char *argv[]){
 
-    char *options;
-    int num_ops, verboseBool = 0, strictBool = 0, idx = 1, path_idx = 3;
+    char *options, *tarfile = NULL;
+    int num_ops, idx = 1, path_idx = 2;
     char **paths;
+    struct tar_opts opts;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.recordSize = DEFAULT_RECORD_SIZE;
+    opts.numJobs = 1;
 
     if (argc < 3){
-        fprintf(stderr, "Usage: mytar [ctxvS]f tarfile [ path [ ... ] ]\n");
+        fprintf(stderr, USAGE);
         exit(EXIT_FAILURE);
     }
     options = argv[1];
     num_ops = strlen(options);
 
-    if (num_ops < 2 || num_ops > 4){
-        fprintf(stderr, "Usage: mytar [ctxvS]f tarfile [ path [ ... ] ]\n");
+    if (num_ops < 2){
+        fprintf(stderr, USAGE);
         exit(EXIT_FAILURE);
     }
 
-    if (options[0] != 'c' && options[0] != 't' && options[0] != 'x'){
-        fprintf(stderr, "Usage: mytar [ctxvS]f tarfile [ path [ ... ] ]\n");
-        printf("second argument requires a c, t or x as first char\n");
+    if (options[0] != 'c' && options[0] != 't' && options[0] != 'x' &&
+        options[0] != 'r' && options[0] != 'u'){
+        fprintf(stderr, USAGE);
+        printf("second argument requires a c, t, x, r or u as first char\n");
         exit(EXIT_FAILURE);
     }
 
-    while (options[idx] != 'f'){
-
-        /* we hit the end of the second argument without encountering an 'f' */
-        if (options[idx] == '\0'){
-            fprintf(stderr, "Usage: mytar [ctxvS]f tarfile [ path [ ... ] ]\n");
-            printf("f required in second argument\n");
-            exit(EXIT_FAILURE);
-        }
-        else if (options[idx] == 'v'){
-            verboseBool = 1;
+    /* Options that take a value consume the next command line arguments
+     * in the order the letters appear, like tar's bundled options. */
+    for (idx = 1; options[idx]; idx++){
+        if (options[idx] == 'v'){
+            opts.verboseBool = 1;
         }
         else if(options[idx] == 'S'){
-            strictBool = 1;
+            opts.strictBool = 1;
+        }
+        else if(options[idx] == 'p'){
+            opts.ownerBool = 1;
+        }
+        else if(options[idx] == 'i'){
+            opts.indexBool = 1;
+        }
+        else if(options[idx] == 'D'){
+            opts.dedupBool = 1;
+        }
+        else if(options[idx] == 'q'){
+            opts.firstBool = 1;
+        }
+        else if(options[idx] == 'z'){
+            opts.compression = COMP_GZIP;
+        }
+        else if(options[idx] == 'Z'){
+            if (!comp_supported(COMP_ZSTD)){
+                fprintf(stderr, "This mytar was built without zstd support\n");
+                exit(EXIT_FAILURE);
+            }
+            opts.compression = COMP_ZSTD;
+        }
+        else if(options[idx] == 'f' && !tarfile && path_idx < argc){
+            tarfile = argv[path_idx++];
+        }
+        else if(options[idx] == 'b' && !opts.blockingBool && path_idx < argc){
+            long factor = strtol(argv[path_idx++], NULL, 10);
+
+            if (factor < 1 || factor > MAX_BLOCKING_FACTOR){
+                fprintf(stderr, "Blocking factor must be 1 to %d\n",
+                        MAX_BLOCKING_FACTOR);
+                exit(EXIT_FAILURE);
+            }
+            opts.recordSize = factor * AIO_BLOCK;
+            opts.blockingBool = 1;
         }
+        else if(options[idx] == 'j' && opts.numJobs == 1 && path_idx < argc){
+            long jobs = strtol(argv[path_idx++], NULL, 10);
 
+            if (jobs < 1 || jobs > MAX_JOBS){
+                fprintf(stderr, "Number of jobs must be 1 to %d\n", MAX_JOBS);
+                exit(EXIT_FAILURE);
+            }
+            opts.numJobs = jobs;
+        }
+        else if(options[idx] == 'g' && !opts.snapshotName && path_idx < argc){
+            opts.snapshotName = argv[path_idx++];
+        }
         else{
-            fprintf(stderr, "Usage: mytar [ctxvS]f tarfile [ path [ ... ] ]\n");
+            fprintf(stderr, USAGE);
             printf("Invalid character in second argument\n");
             exit(EXIT_FAILURE);
         }
-        idx++;
+    }
+
+    if (!tarfile){
+        fprintf(stderr, USAGE);
+        printf("f required in second argument\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Appending rewrites the end of the archive in place */
+    if ((options[0] == 'r' || options[0] == 'u') &&
+        (opts.compression || !strcmp(tarfile, STDIO_ARCHIVE))){
+        fprintf(stderr, "%c needs an uncompressed, named archive\n",
+                options[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    /* The index lives next to the archive, so it needs a real name */
+    if (opts.indexBool && !strcmp(tarfile, STDIO_ARCHIVE)){
+        fprintf(stderr, "i needs a named archive, not %s\n", STDIO_ARCHIVE);
+        exit(EXIT_FAILURE);
     }
 
     errno = 0;
-    paths = malloc(sizeof(char *) * (argc - path_idx));
+    /* +1 so that create always has room for its default "." */
+    paths = malloc(sizeof(char *) * (argc - path_idx + 1));
     if(errno) {
         perror("Couldn't malloc paths");
         exit(errno);
@@ -67,24 +141,29 @@ int main(int argc, char *argv[]){
 
     switch(options[0]){
         case 'c':
-            create_cmd(verboseBool, strictBool, idx, argv[2], paths);
+            create_cmd(&opts, idx, tarfile, paths);
+            break;
+
+        case 'r':
+        case 'u':
+            append_cmd(&opts, idx, tarfile, paths, options[0] == 'u');
             break;
 
         case 't':
             if(idx) {
-                list_cmd(argv[2], paths, idx, verboseBool, strictBool);
+                list_cmd(tarfile, paths, idx, &opts);
             }
             else {
-                list_cmd(argv[2], NULL, 0, verboseBool, strictBool);
+                list_cmd(tarfile, NULL, 0, &opts);
             }
             break;
 
         case 'x':
             if(idx) {
-                extract_cmd(argv[2], paths, idx, verboseBool, strictBool);
+                extract_cmd(tarfile, paths, idx, &opts);
             }
             else {
-                extract_cmd(argv[2], NULL, 0, verboseBool, strictBool);
+                extract_cmd(tarfile, NULL, 0, &opts);
             }
             break;
     }
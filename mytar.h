@@ -1,8 +1,45 @@
+#include <stddef.h>
+
+/* Archive name meaning stdin (t, x) or stdout (c) */
+#define STDIO_ARCHIVE "-"
+
+/* Everything the command line can change about a run */
+struct tar_opts {
+    int verboseBool;
+    int strictBool;
+    /* Bytes moved per archive read()/write() */
+    size_t recordSize;
+    /* Set by 'b': archive is written in whole records of recordSize */
+    int blockingBool;
+    /* Set by 'j': number of worker threads */
+    int numJobs;
+    /* Set by 'p': extract restores archived owners */
+    int ownerBool;
+    /* Set by 'i': create (or list) writes a sidecar member index */
+    int indexBool;
+    /* Set by 'z' (gzip) or 'Z' (zstd) for create, as a COMP_* value.
+     * list and extract recognise compressed archives on their own. */
+    int compression;
+    /* Set by 'D': create stores files with the same contents as one
+     * already archived as links to it */
+    int dedupBool;
+    /* Set by 'q': list and extract take only the first copy of each
+     * literal path argument and stop reading once all have been found */
+    int firstBool;
+    /* Set by 'g': snapshot file. create archives only what changed since
+     * it was written and rewrites it; extract deletes what the archive's
+     * directory listings say is gone. */
+    char *snapshotName;
+};
+
 int list_cmd(char* fileName, char *directories[], int numDirectories,
-     int verboseBool, int strictBool);
+     struct tar_opts *opts);
 
 int extract_cmd(char* fileName, char *directories[], int numDirectories,
-     int verboseBool, int strictBool);
+     struct tar_opts *opts);
 
-int create_cmd(int verboseBool, int strictBool, int num_paths,
+int create_cmd(struct tar_opts *opts, int num_paths,
     char *outfile_name, char **paths);
+
+int append_cmd(struct tar_opts *opts, int num_paths,
+    char *archive_name, char **paths, int updateBool);
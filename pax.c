@@ -0,0 +1,507 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "util.h"
+#include "pax.h"
+
+#define PAX_HEADER_MODE 0644
+/* Directory old readers put extended headers in as plain files */
+#define PAX_DIR "PaxHeaders/"
+/* Longest "<num>\n" line of a sparse map */
+#define MAP_LINE_SIZE 24
+
+#define SPARSE_MAJOR "GNU.sparse.major"
+#define SPARSE_MINOR "GNU.sparse.minor"
+#define SPARSE_NAME "GNU.sparse.name"
+#define SPARSE_REALSIZE "GNU.sparse.realsize"
+/* Digits of a fraction of a second that fit in a timespec */
+#define NSEC_DIGITS 9
+
+/* Everything collected from the extended headers before a member. Names
+ * are NULL unless given, and point into the buffers below. */
+struct pax_ext {
+    char *path;
+    char *linkpath;
+    int64_t size;
+    int64_t mtime;
+    long mtimeNsec;
+    int64_t major;
+    int64_t minor;
+    int64_t realSize;
+};
+
+/* Names of any length, kept until the next pax_decode() */
+static char *pathBuf;
+static size_t pathCap;
+static char *linkBuf;
+static size_t linkCap;
+
+static void pax_truncated(void) {
+    fprintf(stderr, "Archive is truncated! Exiting.");
+    exit(EXIT_FAILURE);
+}
+
+static void sparse_corrupt(void) {
+    fprintf(stderr, "Sparse map is corrupted! Exiting.");
+    exit(EXIT_FAILURE);
+}
+
+void pax_add(struct pax_buf *b, const char *key, const char *value) {
+    size_t base = strlen(key) + strlen(value) + 3, len, digits = 1;
+
+    /* The length covers the whole record, its own digits included */
+    while((size_t)snprintf(NULL, 0, "%zu", base + digits) > digits) {
+        digits++;
+    }
+    len = base + digits;
+
+    if(b -> len + len + 1 > b -> cap) {
+        while(b -> len + len + 1 > b -> cap) {
+            b -> cap = b -> cap ? b -> cap * 2 : PAX_BUF_START;
+        }
+        if(!(b -> data = realloc(b -> data, b -> cap))) {
+            perror("Couldn't realloc extended header");
+            exit(EXIT_FAILURE);
+        }
+    }
+    sprintf(b -> data + b -> len, "%zu %s=%s\n", len, key, value);
+    b -> len += len;
+}
+
+void pax_add_num(struct pax_buf *b, const char *key, int64_t value) {
+    char num[MAP_LINE_SIZE];
+
+    snprintf(num, sizeof(num), "%lld", (long long)value);
+    pax_add(b, key, num);
+}
+
+/* Adds a time in seconds, with its fraction if it has one */
+void pax_add_time(struct pax_buf *b, const char *key, time_t sec, long nsec) {
+    char num[2 * MAP_LINE_SIZE];
+
+    if(nsec) {
+        snprintf(num, sizeof(num), "%lld.%0*ld", (long long)sec, NSEC_DIGITS,
+                 nsec);
+    }
+    else {
+        snprintf(num, sizeof(num), "%lld", (long long)sec);
+    }
+    pax_add(b, key, num);
+}
+
+/* Writes b as the extended header of the member called name, and empties
+ * it. Old readers see a plain file under PAX_DIR. */
+void pax_write(struct archive_io *out, const char *name, time_t mtime,
+               struct pax_buf *b) {
+    struct header h;
+    const char *base = strrchr(name, '/');
+    size_t len;
+
+    memset(&h, 0, sizeof(h));
+
+    base = base ? base + 1 : name;
+    len = strlen(base);
+    if(len > sizeof(h.name) - sizeof(PAX_DIR)) {
+        len = sizeof(h.name) - sizeof(PAX_DIR);
+    }
+    memcpy(h.name, PAX_DIR, sizeof(PAX_DIR) - 1);
+    memcpy(h.name + sizeof(PAX_DIR) - 1, base, len);
+
+    hdr_put_octal(h.mode, sizeof(h.mode), PAX_HEADER_MODE);
+    hdr_put_octal(h.uid, sizeof(h.uid), 0);
+    hdr_put_octal(h.gid, sizeof(h.gid), 0);
+    hdr_put_octal(h.size, sizeof(h.size), b -> len);
+    hdr_put_octal(h.mtime, sizeof(h.mtime), mtime > 0 ? mtime : 0);
+    *h.typeflag = PAX_FLAG;
+    memcpy(h.magic, "ustar", sizeof(h.magic));
+    memcpy(h.version, "00", sizeof(h.version));
+    hdr_put_octal(h.chksum, sizeof(h.chksum),
+                  calc_checksum((unsigned char *)&h));
+
+    aio_write(out, &h, sizeof(h));
+    aio_write(out, b -> data, b -> len);
+    aio_pad_block(out);
+
+    free(b -> data);
+    memset(b, 0, sizeof(*b));
+}
+
+/* A record's decimal value, or -1 if it isn't a plain non-negative
+ * number */
+static int64_t dec_value(const char *v, size_t n) {
+    int64_t val = 0;
+
+    if(!n) {
+        return -1;
+    }
+    while(n--) {
+        if(*v < '0' || *v > '9' || val > (INT64_MAX - 9) / 10) {
+            return -1;
+        }
+        val = val * 10 + (*v++ - '0');
+    }
+    return val;
+}
+
+/* Copies a name record into *buf, growing it as needed. Returns NULL for
+ * names that can't be used. */
+static char *keep_name(char **buf, size_t *cap, const char *value,
+                       size_t valueLen) {
+    if(!valueLen || memchr(value, '\0', valueLen)) {
+        fprintf(stderr, "Ignoring unusable name in extended header\n");
+        return NULL;
+    }
+    if(valueLen + 1 > *cap) {
+        *cap = valueLen + 1;
+        if(!(*buf = realloc(*buf, *cap))) {
+            perror("Couldn't realloc extended header name");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(*buf, value, valueLen);
+    (*buf)[valueLen] = '\0';
+    return *buf;
+}
+
+/* Seconds, with up to NSEC_DIGITS of fraction after a '.' */
+static void time_value(const char *v, size_t n, struct pax_ext *x) {
+    const char *dot = memchr(v, '.', n);
+    size_t i, digits;
+
+    x -> mtime = dec_value(v, dot ? (size_t)(dot - v) : n);
+    x -> mtimeNsec = 0;
+    if(!dot || x -> mtime < 0) {
+        return;
+    }
+    digits = n - (dot + 1 - v);
+    for(i = 0; i < NSEC_DIGITS; i++) {
+        char c = i < digits ? dot[1 + i] : '0';
+
+        if(c < '0' || c > '9') {
+            x -> mtime = -1;
+            return;
+        }
+        x -> mtimeNsec = x -> mtimeNsec * 10 + (c - '0');
+    }
+}
+
+static int key_is(const char *key, size_t keyLen, const char *name) {
+    return keyLen == strlen(name) && !memcmp(key, name, keyLen);
+}
+
+/* Keeps what one record says about the next member, if we know its key */
+static void pax_record(const char *key, size_t keyLen, const char *value,
+                       size_t valueLen, struct pax_ext *x) {
+    if(key_is(key, keyLen, SPARSE_MAJOR)) {
+        x -> major = dec_value(value, valueLen);
+    }
+    else if(key_is(key, keyLen, SPARSE_MINOR)) {
+        x -> minor = dec_value(value, valueLen);
+    }
+    else if(key_is(key, keyLen, SPARSE_REALSIZE)) {
+        x -> realSize = dec_value(value, valueLen);
+    }
+    else if(key_is(key, keyLen, SPARSE_NAME) ||
+            key_is(key, keyLen, PAX_PATH)) {
+        x -> path = keep_name(&pathBuf, &pathCap, value, valueLen);
+    }
+    else if(key_is(key, keyLen, PAX_LINKPATH)) {
+        x -> linkpath = keep_name(&linkBuf, &linkCap, value, valueLen);
+    }
+    else if(key_is(key, keyLen, PAX_SIZE)) {
+        x -> size = dec_value(value, valueLen);
+    }
+    else if(key_is(key, keyLen, PAX_MTIME)) {
+        time_value(value, valueLen, x);
+    }
+}
+
+static void pax_parse(const char *p, size_t n, struct pax_ext *x) {
+    while(n) {
+        size_t len = 0, i = 0;
+        const char *key, *end, *eq;
+
+        for(; i < n && p[i] >= '0' && p[i] <= '9' && len <= n; i++) {
+            len = len * 10 + (p[i] - '0');
+        }
+        if(!i || i >= n || p[i] != ' ' || len > n || len <= i + 1 ||
+           p[len - 1] != '\n') {
+            fprintf(stderr, "Ignoring corrupted extended header\n");
+            return;
+        }
+
+        key = p + i + 1;
+        end = p + len - 1;
+        if((eq = memchr(key, '=', end - key))) {
+            pax_record(key, eq - key, eq + 1, end - eq - 1, x);
+        }
+        p += len;
+        n -= len;
+    }
+}
+
+/* hdr_decode() for a member that may be preceded by extended headers. *h
+ * is the first header; any extended ones are consumed, and *h is left
+ * pointing at the member's own ustar header, whose fields are then
+ * overridden by what the extended headers said. Returns the status of
+ * that last header. */
+int pax_decode(struct archive_io *in, const struct header **h,
+               struct hdr_info *info, struct pax_info *px) {
+    struct pax_ext x;
+    int status;
+
+    memset(px, 0, sizeof(*px));
+    x.path = x.linkpath = NULL;
+    x.size = x.mtime = x.major = x.minor = x.realSize = -1;
+    x.mtimeNsec = 0;
+
+    while((status = hdr_decode(*h, info)) == HDR_VALID &&
+          (info -> type == PAX_FLAG || info -> type == PAX_GLOBAL_FLAG ||
+           info -> type == GNU_LONGNAME_FLAG ||
+           info -> type == GNU_LONGLINK_FLAG)) {
+        char *body;
+
+        if(info -> size > PAX_MAX_SIZE) {
+            fprintf(stderr, "Extended header is too large! Exiting.");
+            exit(EXIT_FAILURE);
+        }
+        if(!(body = malloc(info -> size + 1))) {
+            perror("Couldn't malloc extended header");
+            exit(EXIT_FAILURE);
+        }
+        if(aio_read(in, body, info -> size) != (size_t)info -> size) {
+            pax_truncated();
+        }
+        aio_skip(in, AIO_PADDED(info -> size) - info -> size);
+
+        /* Nothing we understand belongs in a global header. GNU's long
+         * names are the whole body, usually with a NUL on the end. */
+        if(info -> type == PAX_FLAG) {
+            pax_parse(body, info -> size, &x);
+        }
+        else if(info -> type == GNU_LONGNAME_FLAG) {
+            x.path = keep_name(&pathBuf, &pathCap, body,
+                               strnlen(body, info -> size));
+        }
+        else if(info -> type == GNU_LONGLINK_FLAG) {
+            x.linkpath = keep_name(&linkBuf, &linkCap, body,
+                                   strnlen(body, info -> size));
+        }
+        free(body);
+
+        if(!(*h = aio_next(in, AIO_BLOCK))) {
+            pax_truncated();
+        }
+    }
+
+    if(status != HDR_VALID) {
+        return status;
+    }
+    if(x.path) {
+        info -> path = x.path;
+    }
+    if(x.linkpath) {
+        info -> linkname = x.linkpath;
+    }
+    if(x.size >= 0) {
+        info -> size = x.size;
+    }
+    if(x.mtime >= 0) {
+        info -> mtime = x.mtime;
+        info -> mtimeNsec = x.mtimeNsec;
+    }
+    if(x.major == 1 && x.minor == 0 && x.realSize >= 0) {
+        px -> sparse = 1;
+        px -> realSize = x.realSize;
+    }
+    return status;
+}
+
+static void add_extent(struct sparse_map *m, off_t offset, off_t size) {
+    if(m -> count == m -> cap) {
+        m -> cap = m -> cap ? m -> cap * 2 : SPARSE_START;
+        if(!(m -> extents = realloc(m -> extents,
+                                    m -> cap * sizeof(*m -> extents)))) {
+            perror("Couldn't realloc sparse map");
+            exit(EXIT_FAILURE);
+        }
+    }
+    m -> extents[m -> count].offset = offset;
+    m -> extents[m -> count].size = size;
+    m -> count++;
+}
+
+/* sparse_scan() giving up: puts the offset back and empties m */
+static int sparse_none(int fd, off_t start, struct sparse_map *m) {
+    if(lseek(fd, start, SEEK_SET) == -1) {
+        perror("lseek");
+        exit(EXIT_FAILURE);
+    }
+    sparse_free(m);
+    return 0;
+}
+
+/* Finds the data extents of the regular file fd with SEEK_DATA and
+ * SEEK_HOLE. Returns 1 if it has holes, having moved the file offset;
+ * otherwise, or if the file system can't tell, 0 with m left empty and
+ * the offset where it was. */
+int sparse_scan(int fd, const struct stat *sb, struct sparse_map *m) {
+    off_t pos = 0, data, hole, start;
+
+    memset(m, 0, sizeof(*m));
+
+    /* Every block is there, so there can't be any holes. Not worth two
+     * lseek()s per file to find out. */
+    if((off_t)sb -> st_blocks * S_BLKSIZE >= sb -> st_size) {
+        return 0;
+    }
+    /* The caller copies the body from here if there turn out to be no
+     * holes after all */
+    if((start = lseek(fd, 0, SEEK_CUR)) == -1) {
+        return 0;
+    }
+
+    while(pos < sb -> st_size) {
+        if((data = lseek(fd, pos, SEEK_DATA)) == -1) {
+            /* ENXIO: only a hole is left */
+            if(errno == ENXIO) {
+                break;
+            }
+            return sparse_none(fd, start, m);
+        }
+        if(data >= sb -> st_size) {
+            break;
+        }
+        if((hole = lseek(fd, data, SEEK_HOLE)) == -1) {
+            return sparse_none(fd, start, m);
+        }
+        if(hole > sb -> st_size) {
+            hole = sb -> st_size;
+        }
+        add_extent(m, data, hole - data);
+        pos = hole;
+    }
+
+    if(sparse_data_size(m) == sb -> st_size) {
+        return sparse_none(fd, start, m);
+    }
+
+    /* Like GNU tar, end with an empty extent at the real end of the file,
+     * so that readers that go by the map alone get the length right */
+    if(!m -> count || m -> extents[m -> count - 1].offset +
+                      m -> extents[m -> count - 1].size < sb -> st_size) {
+        add_extent(m, sb -> st_size, 0);
+    }
+    return 1;
+}
+
+off_t sparse_data_size(const struct sparse_map *m) {
+    off_t total = 0;
+    size_t i;
+
+    for(i = 0; i < m -> count; i++) {
+        total += m -> extents[i].size;
+    }
+    return total;
+}
+
+/* Bytes the map takes up in the archive, padding included */
+off_t sparse_map_size(const struct sparse_map *m) {
+    off_t len = snprintf(NULL, 0, "%zu\n", m -> count);
+    size_t i;
+
+    for(i = 0; i < m -> count; i++) {
+        len += snprintf(NULL, 0, "%lld\n%lld\n",
+                        (long long)m -> extents[i].offset,
+                        (long long)m -> extents[i].size);
+    }
+    return AIO_PADDED(len);
+}
+
+/* Writes the map: the number of extents, then each one's offset and size,
+ * all one decimal number per line, padded to a block */
+void sparse_write_map(struct archive_io *out, const struct sparse_map *m) {
+    char line[2 * MAP_LINE_SIZE];
+    size_t i;
+
+    aio_write(out, line, snprintf(line, sizeof(line), "%zu\n", m -> count));
+    for(i = 0; i < m -> count; i++) {
+        aio_write(out, line, snprintf(line, sizeof(line), "%lld\n%lld\n",
+                                      (long long)m -> extents[i].offset,
+                                      (long long)m -> extents[i].size));
+    }
+    aio_pad_block(out);
+}
+
+/* Reads the map at the start of a sparse member's body, size bytes long,
+ * of a file realSize bytes long. Extents must be in order and inside the
+ * file, and fit in the body along with the map. Returns the bytes the map
+ * took up; the reader is left at the first extent's data. */
+off_t sparse_read_map(struct archive_io *in, off_t size, off_t realSize,
+                      struct sparse_map *m) {
+    int64_t count = -1, num = 0, k = 0;
+    off_t mapLen = 0, end = 0, data = 0, offset = 0;
+    int digits = 0;
+
+    memset(m, 0, sizeof(*m));
+
+    /* k counts numbers read: the count, then offset and size pairs */
+    while(count < 0 || k < 1 + 2 * count) {
+        const char *b;
+        size_t i;
+
+        if(mapLen + AIO_BLOCK > size || !(b = aio_next(in, AIO_BLOCK))) {
+            sparse_corrupt();
+        }
+        mapLen += AIO_BLOCK;
+
+        for(i = 0; i < AIO_BLOCK && (count < 0 || k < 1 + 2 * count); i++) {
+            if(b[i] >= '0' && b[i] <= '9' && num <= (INT64_MAX - 9) / 10) {
+                num = num * 10 + (b[i] - '0');
+                digits++;
+                continue;
+            }
+            if(b[i] != '\n' || !digits) {
+                sparse_corrupt();
+            }
+
+            if(count < 0) {
+                /* Every extent takes at least four bytes of map */
+                if(num > size / 4) {
+                    sparse_corrupt();
+                }
+                count = num;
+            }
+            else if(k % 2) {
+                offset = num;
+            }
+            else {
+                if(offset < end || num > realSize - offset) {
+                    sparse_corrupt();
+                }
+                add_extent(m, offset, num);
+                end = offset + num;
+                data += num;
+            }
+            k++;
+            num = 0;
+            digits = 0;
+        }
+    }
+
+    if(data > size - mapLen) {
+        sparse_corrupt();
+    }
+    return mapLen;
+}
+
+void sparse_free(struct sparse_map *m) {
+    free(m -> extents);
+    memset(m, 0, sizeof(*m));
+}
@@ -0,0 +1,88 @@
+#ifndef PAX_H
+#define PAX_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "header.h"
+#include "codec.h"
+#include "blockio.h"
+
+/* POSIX pax extended headers, and GNU's sparse format 1.0 built on them.
+ * An extended header is a member of its own, typeflag 'x', whose body is
+ * "<len> <key>=<value>\n" records that apply to the member after it.
+ * create writes one wherever the ustar header falls short: names and link
+ * targets too long for it, sizes and mtimes too large, and then the exact
+ * mtime too. A sparse file is archived as a regular member whose body is
+ * a map of its data extents, padded to a block, followed by just those
+ * extents; the extended header carries its real name and size. */
+
+#define PAX_FLAG 'x'
+#define PAX_GLOBAL_FLAG 'g'
+/* GNU's older way: the name of the next member is the body of one of these */
+#define GNU_LONGNAME_FLAG 'L'
+#define GNU_LONGLINK_FLAG 'K'
+/* Larger extended headers are taken for corruption */
+#define PAX_MAX_SIZE (1024 * 1024)
+#define PAX_BUF_START 256
+#define SPARSE_START 16
+
+/* Keys that stand in for ustar header fields */
+#define PAX_PATH "path"
+#define PAX_LINKPATH "linkpath"
+#define PAX_SIZE "size"
+#define PAX_MTIME "mtime"
+
+/* Extended header records being put together */
+struct pax_buf {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+struct sparse_extent {
+    off_t offset;
+    off_t size;
+};
+
+/* Data extents of a sparse file, in file order */
+struct sparse_map {
+    struct sparse_extent *extents;
+    size_t count;
+    size_t cap;
+};
+
+/* What the extended header before a member said about it, beyond what
+ * pax_decode() already put in its hdr_info */
+struct pax_info {
+    /* Body is a sparse map and extents, of a file realSize bytes long */
+    int sparse;
+    off_t realSize;
+};
+
+void pax_add(struct pax_buf *b, const char *key, const char *value);
+
+void pax_add_num(struct pax_buf *b, const char *key, int64_t value);
+
+void pax_add_time(struct pax_buf *b, const char *key, time_t sec, long nsec);
+
+void pax_write(struct archive_io *out, const char *name, time_t mtime,
+               struct pax_buf *b);
+
+int pax_decode(struct archive_io *in, const struct header **h,
+               struct hdr_info *info, struct pax_info *px);
+
+int sparse_scan(int fd, const struct stat *sb, struct sparse_map *m);
+
+off_t sparse_data_size(const struct sparse_map *m);
+
+off_t sparse_map_size(const struct sparse_map *m);
+
+void sparse_write_map(struct archive_io *out, const struct sparse_map *m);
+
+off_t sparse_read_map(struct archive_io *in, off_t size, off_t realSize,
+                      struct sparse_map *m);
+
+void sparse_free(struct sparse_map *m);
+
+#endif
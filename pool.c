@@ -0,0 +1,431 @@
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include "pool.h"
+#include "blockio.h"
+#include "dircache.h"
+
+/* Work items queued per worker before the scanner blocks */
+#define ITEMS_PER_WORKER 64
+#define QUEUED_START_BUCKETS 1024
+/* Descriptors left alone for the archive, the workers' output files and
+ * whatever else is open */
+#define SPARE_FDS 32
+
+/* A private dup of a parent directory's cached fd, shared by the items
+ * queued for that directory and by the scanner while it is adding to it */
+struct xdir {
+    int fd;
+    int refs;
+};
+
+struct xitem {
+    off_t offset;
+    off_t size;
+    /* Name relative to dir, or to the working directory if NULL */
+    struct xdir *dir;
+    char *name;
+    mode_t mode;
+    time_t mtime;
+    long mtimeNsec;
+    /* -1 to leave as created */
+    uid_t uid;
+    gid_t gid;
+};
+
+/* A path handed to the workers since the pool was last idle */
+struct queued {
+    char *path;
+    unsigned int hash;
+    struct queued *next;
+};
+
+struct xpool {
+    int archiveFd;
+    int numWorkers;
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+    /* Ring of pending items */
+    struct xitem *ring;
+    int cap;
+    int head;
+    int count;
+    int closing;
+    /* Items taken off the ring and not yet written */
+    int busy;
+    pthread_cond_t idle;
+    /* Paths queued since the last wait for idle, only touched by the
+     * scanning thread */
+    struct queued **queued;
+    size_t numBuckets;
+    size_t numQueued;
+    /* Directory the scanner last added to, and its path; only touched by
+     * the scanning thread */
+    struct xdir *lastDir;
+    char *lastParent;
+    size_t lastParentLen;
+    /* Directory dups open, and how many may be before the scanner waits */
+    int numDirs;
+    int maxDirs;
+};
+
+/* FNV-1a, same as the directory cache */
+static unsigned int hash_path(const char *path) {
+    unsigned int h = 2166136261u;
+
+    for(; *path; path++) {
+        h ^= (unsigned char)*path;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void grow_queued(struct xpool *p) {
+    size_t n = p -> numBuckets * 2, i;
+    struct queued **buckets = calloc(n, sizeof(struct queued *));
+
+    if(!buckets) {
+        perror("Couldn't calloc queued paths");
+        exit(EXIT_FAILURE);
+    }
+    for(i = 0; i < p -> numBuckets; i++) {
+        struct queued *e = p -> queued[i], *next;
+
+        for(; e; e = next) {
+            next = e -> next;
+            e -> next = buckets[e -> hash % n];
+            buckets[e -> hash % n] = e;
+        }
+    }
+    free(p -> queued);
+    p -> queued = buckets;
+    p -> numBuckets = n;
+}
+
+static void clear_queued(struct xpool *p) {
+    size_t i;
+
+    for(i = 0; i < p -> numBuckets; i++) {
+        struct queued *e = p -> queued[i], *next;
+
+        for(; e; e = next) {
+            next = e -> next;
+            free(e -> path);
+            free(e);
+        }
+        p -> queued[i] = NULL;
+    }
+    p -> numQueued = 0;
+}
+
+/* Gives an extracted member its archived owner (unless both ids are -1),
+ * exact mode and mtime, all through the open fd. The owner goes first
+ * since chown clears set-id bits; atime is left alone. */
+void xpool_metadata(int fd, mode_t mode, time_t mtime, long mtimeNsec,
+                    uid_t uid, gid_t gid) {
+    struct timespec times[2];
+
+    if((uid != (uid_t)-1 || gid != (gid_t)-1) && fchown(fd, uid, gid)) {
+        perror("Couldn't restore owner");
+    }
+
+    if(fchmod(fd, mode)) {
+        perror("Couldn't set mode");
+        exit(errno);
+    }
+
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec = mtime;
+    times[1].tv_nsec = mtimeNsec;
+    if(futimens(fd, times)) {
+        perror("Couldn't set utime");
+        exit(errno);
+    }
+}
+
+/* Lets go of one reference to d, closing it after the last */
+static void drop_dir(struct xpool *p, struct xdir *d) {
+    int last;
+
+    pthread_mutex_lock(&p -> lock);
+    if((last = !--d -> refs)) {
+        p -> numDirs--;
+        pthread_cond_signal(&p -> notFull);
+    }
+    pthread_mutex_unlock(&p -> lock);
+
+    if(last) {
+        close(d -> fd);
+        free(d);
+    }
+}
+
+/* The scanner stops sharing its last directory, so the next member gets
+ * a fresh dup */
+static void forget_dir(struct xpool *p) {
+    if(p -> lastDir) {
+        drop_dir(p, p -> lastDir);
+        p -> lastDir = NULL;
+    }
+}
+
+/* Returns the shared dup of dirFd, the parent of path, with a reference
+ * taken for one more item. Members of one directory tend to come
+ * together, so only the last directory is remembered. */
+static struct xdir *get_dir(struct xpool *p, const char *path,
+                            size_t parentLen, int dirFd) {
+    struct xdir *d;
+
+    if(p -> lastDir && parentLen == p -> lastParentLen &&
+       !strncmp(path, p -> lastParent, parentLen)) {
+        pthread_mutex_lock(&p -> lock);
+        p -> lastDir -> refs++;
+        pthread_mutex_unlock(&p -> lock);
+        return p -> lastDir;
+    }
+    forget_dir(p);
+
+    pthread_mutex_lock(&p -> lock);
+    while(p -> numDirs >= p -> maxDirs) {
+        pthread_cond_wait(&p -> notFull, &p -> lock);
+    }
+    p -> numDirs++;
+    pthread_mutex_unlock(&p -> lock);
+
+    /* The worker may run after the cache has closed the original */
+    if(!(d = malloc(sizeof(struct xdir))) ||
+       !(p -> lastParent = realloc(p -> lastParent, parentLen + 1))) {
+        perror("Couldn't malloc directory");
+        exit(EXIT_FAILURE);
+    }
+    if((d -> fd = fcntl(dirFd, F_DUPFD_CLOEXEC, 0)) == -1) {
+        perror("Couldn't dup directory fd");
+        exit(errno);
+    }
+    d -> refs = 2;
+    memcpy(p -> lastParent, path, parentLen);
+    p -> lastParent[parentLen] = '\0';
+    p -> lastParentLen = parentLen;
+    p -> lastDir = d;
+    return d;
+}
+
+/* Creates one member and fills it from its range of the archive */
+static void xpool_extract(struct xpool *p, struct xitem *item) {
+    int new_file;
+
+    if((new_file = openat(item -> dir ? item -> dir -> fd : AT_FDCWD,
+                          item -> name, O_WRONLY|O_CREAT|O_TRUNC,
+                          XPOOL_CREATE_PERMS)) == -1) {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+
+    aio_copy_range(p -> archiveFd, item -> offset, new_file, item -> size);
+    xpool_metadata(new_file, item -> mode, item -> mtime,
+                   item -> mtimeNsec, item -> uid, item -> gid);
+    close(new_file);
+}
+
+static void *xpool_worker(void *arg) {
+    struct xpool *p = arg;
+
+    for(;;) {
+        struct xitem item;
+
+        pthread_mutex_lock(&p -> lock);
+        while(!p -> count && !p -> closing) {
+            pthread_cond_wait(&p -> notEmpty, &p -> lock);
+        }
+        if(!p -> count) {
+            pthread_mutex_unlock(&p -> lock);
+            return NULL;
+        }
+        item = p -> ring[p -> head];
+        p -> head = (p -> head + 1) % p -> cap;
+        p -> count--;
+        p -> busy++;
+        pthread_cond_signal(&p -> notFull);
+        pthread_mutex_unlock(&p -> lock);
+
+        xpool_extract(p, &item);
+        if(item.dir) {
+            drop_dir(p, item.dir);
+        }
+        free(item.name);
+
+        pthread_mutex_lock(&p -> lock);
+        if(!--p -> busy && !p -> count) {
+            pthread_cond_broadcast(&p -> idle);
+        }
+        pthread_mutex_unlock(&p -> lock);
+    }
+}
+
+struct xpool *xpool_start(int archiveFd, int numWorkers) {
+    struct xpool *p;
+    struct rlimit rl;
+    int i;
+
+    errno = 0;
+    p = calloc(1, sizeof(struct xpool));
+    if(errno) {
+        perror("Couldn't calloc pool");
+        exit(errno);
+    }
+
+    p -> archiveFd = archiveFd;
+    p -> numWorkers = numWorkers;
+    p -> cap = numWorkers * ITEMS_PER_WORKER;
+
+    /* Every queued directory holds a descriptor, on top of the cache's
+     * own and one per worker */
+    p -> maxDirs = p -> cap;
+    if(!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur != RLIM_INFINITY &&
+       rl.rlim_cur < (rlim_t)p -> cap + dcache_max_fds() + numWorkers +
+                     SPARE_FDS) {
+        p -> maxDirs = (int)rl.rlim_cur - dcache_max_fds() - numWorkers -
+                       SPARE_FDS;
+        if(p -> maxDirs < 1) {
+            p -> maxDirs = 1;
+        }
+    }
+
+    errno = 0;
+    p -> ring = calloc(p -> cap, sizeof(struct xitem));
+    p -> threads = calloc(numWorkers, sizeof(pthread_t));
+    p -> queued = calloc(QUEUED_START_BUCKETS, sizeof(struct queued *));
+    p -> numBuckets = QUEUED_START_BUCKETS;
+    if(errno) {
+        perror("Couldn't calloc pool");
+        exit(errno);
+    }
+
+    pthread_mutex_init(&p -> lock, NULL);
+    pthread_cond_init(&p -> notEmpty, NULL);
+    pthread_cond_init(&p -> notFull, NULL);
+    pthread_cond_init(&p -> idle, NULL);
+
+    for(i = 0; i < numWorkers; i++) {
+        if((errno = pthread_create(&p -> threads[i], NULL, xpool_worker, p))) {
+            perror("Couldn't start worker");
+            exit(errno);
+        }
+    }
+
+    return p;
+}
+
+/* Waits until every member queued so far is on disk */
+void xpool_wait(struct xpool *p) {
+    pthread_mutex_lock(&p -> lock);
+    while(p -> count || p -> busy) {
+        pthread_cond_wait(&p -> idle, &p -> lock);
+    }
+    pthread_mutex_unlock(&p -> lock);
+    clear_queued(p);
+    /* Whatever comes next may have been removed and made again */
+    forget_dir(p);
+}
+
+/* Call before anything is written at path. An archive can hold several
+ * copies of a path, and the last one has to win, so if a worker may still
+ * be writing an earlier copy this waits for all of them to finish. */
+void xpool_claim(struct xpool *p, const char *path) {
+    unsigned int hash = hash_path(path);
+    struct queued *e;
+
+    for(e = p -> queued[hash % p -> numBuckets]; e; e = e -> next) {
+        if(e -> hash == hash && !strcmp(e -> path, path)) {
+            break;
+        }
+    }
+    if(e) {
+        xpool_wait(p);
+    }
+}
+
+/* Queues a member, blocking while the ring is full. path is its name in
+ * the archive, for xpool_claim(); dirFd only has to stay open until this
+ * returns. */
+void xpool_add(struct xpool *p, off_t offset, off_t size, const char *path,
+               int dirFd, const char *name, mode_t mode, time_t mtime,
+               long mtimeNsec, uid_t uid, gid_t gid) {
+    unsigned int hash = hash_path(path);
+    struct xdir *dir = NULL;
+    struct xitem *item;
+    struct queued *e;
+
+    if(!(e = malloc(sizeof(struct queued))) || !(e -> path = strdup(path))) {
+        perror("Couldn't malloc queued path");
+        exit(EXIT_FAILURE);
+    }
+    e -> hash = hash;
+    e -> next = p -> queued[hash % p -> numBuckets];
+    p -> queued[hash % p -> numBuckets] = e;
+    if(++p -> numQueued > p -> numBuckets * 2) {
+        grow_queued(p);
+    }
+
+    if(dirFd != AT_FDCWD) {
+        dir = get_dir(p, path, strlen(path) - strlen(name), dirFd);
+    }
+
+    pthread_mutex_lock(&p -> lock);
+    while(p -> count == p -> cap) {
+        pthread_cond_wait(&p -> notFull, &p -> lock);
+    }
+
+    item = &p -> ring[(p -> head + p -> count) % p -> cap];
+    item -> offset = offset;
+    item -> size = size;
+    item -> mode = mode;
+    item -> mtime = mtime;
+    item -> mtimeNsec = mtimeNsec;
+    item -> uid = uid;
+    item -> gid = gid;
+    item -> dir = dir;
+    if(!(item -> name = strdup(name))) {
+        perror("Couldn't strdup name");
+        exit(EXIT_FAILURE);
+    }
+    p -> count++;
+
+    pthread_cond_signal(&p -> notEmpty);
+    pthread_mutex_unlock(&p -> lock);
+}
+
+/* Waits until every queued member is on disk, then tears the pool down */
+void xpool_finish(struct xpool *p) {
+    int i;
+
+    forget_dir(p);
+    pthread_mutex_lock(&p -> lock);
+    p -> closing = 1;
+    pthread_cond_broadcast(&p -> notEmpty);
+    pthread_mutex_unlock(&p -> lock);
+
+    for(i = 0; i < p -> numWorkers; i++) {
+        pthread_join(p -> threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&p -> lock);
+    pthread_cond_destroy(&p -> notEmpty);
+    pthread_cond_destroy(&p -> notFull);
+    pthread_cond_destroy(&p -> idle);
+    clear_queued(p);
+    free(p -> queued);
+    free(p -> lastParent);
+    free(p -> threads);
+    free(p -> ring);
+    free(p);
+}
@@ -0,0 +1,35 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define MAX_JOBS 256
+/* Files are created private and get their real mode once written */
+#define XPOOL_CREATE_PERMS (S_IRUSR | S_IWUSR)
+
+/* Extraction worker pool. The scanning thread hands over regular file
+ * members as (offset, size, parent dir fd, name, mode, mtime, owner);
+ * workers create the file and pread() its body out of the archive on
+ * their own. Members reach the disk in any order, so the scanner claims
+ * each path before writing it, which holds back a later copy of a path
+ * until the workers are done with the earlier one. */
+struct xpool;
+
+struct xpool *xpool_start(int archiveFd, int numWorkers);
+
+void xpool_wait(struct xpool *p);
+
+void xpool_claim(struct xpool *p, const char *path);
+
+void xpool_add(struct xpool *p, off_t offset, off_t size, const char *path,
+               int dirFd, const char *name, mode_t mode, time_t mtime,
+               long mtimeNsec, uid_t uid, gid_t gid);
+
+void xpool_finish(struct xpool *p);
+
+void xpool_metadata(int fd, mode_t mode, time_t mtime, long mtimeNsec,
+                    uid_t uid, gid_t gid);
+
+#endif
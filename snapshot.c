@@ -0,0 +1,300 @@
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "snapshot.h"
+
+#define ENTRIES_START 256
+#define NAMES_START 4096
+#define DUMPDIR_START 256
+
+struct snap_builder {
+    struct snap_entry *entries;
+    size_t count;
+    size_t cap;
+    char *names;
+    size_t namesLen;
+    size_t namesCap;
+};
+
+struct snapshot {
+    const char *map;
+    size_t mapLen;
+    const uint32_t *slots;
+    uint64_t mask;
+    const struct snap_entry *entries;
+    uint64_t count;
+    const char *names;
+    uint64_t namesLen;
+};
+
+/* FNV-1a, 64 bit */
+static uint64_t hash_path(const char *path, size_t len) {
+    uint64_t h = 0xCBF29CE484222325ULL;
+    size_t i;
+
+    for(i = 0; i < len; i++) {
+        h ^= (unsigned char)path[i];
+        h *= 0x100000001B3ULL;
+    }
+    return h;
+}
+
+/* Maps the snapshot called name. Returns NULL if there is none yet, or if
+ * it is damaged, so that everything gets archived. */
+struct snapshot *snap_open(const char *name) {
+    const struct snap_file_header *h;
+    struct snapshot *s;
+    struct stat sb;
+    uint64_t tableEnd, namesEnd;
+    void *map;
+    int fd;
+
+    if((fd = open(name, O_RDONLY)) == -1) {
+        if(errno != ENOENT) {
+            perror("Couldn't open snapshot");
+        }
+        return NULL;
+    }
+    if(fstat(fd, &sb) == -1 || sb.st_size < (off_t)sizeof(*h)) {
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+        return NULL;
+    }
+
+    h = map;
+    tableEnd = sizeof(*h) + h -> numSlots * sizeof(uint32_t);
+    namesEnd = h -> entriesOffset + h -> count * sizeof(struct snap_entry);
+    if(memcmp(h -> magic, SNAP_MAGIC, SNAP_MAGIC_LEN) ||
+       h -> numSlots < SNAP_MIN_SLOTS ||
+       (h -> numSlots & (h -> numSlots - 1)) ||
+       h -> count >= h -> numSlots || h -> count >= SNAP_EMPTY ||
+       h -> entriesOffset != tableEnd + tableEnd % sizeof(uint64_t) ||
+       h -> namesOffset != namesEnd ||
+       h -> namesOffset > (uint64_t)sb.st_size) {
+        fprintf(stderr, "Ignoring damaged snapshot %s\n", name);
+        munmap(map, sb.st_size);
+        return NULL;
+    }
+
+    if(!(s = calloc(1, sizeof(struct snapshot)))) {
+        perror("Couldn't calloc snapshot");
+        exit(EXIT_FAILURE);
+    }
+    s -> map = map;
+    s -> mapLen = sb.st_size;
+    s -> slots = (const uint32_t *)(s -> map + sizeof(*h));
+    s -> mask = h -> numSlots - 1;
+    s -> entries = (const struct snap_entry *)(s -> map + h -> entriesOffset);
+    s -> count = h -> count;
+    s -> names = s -> map + h -> namesOffset;
+    s -> namesLen = sb.st_size - h -> namesOffset;
+    return s;
+}
+
+/* Nonzero if path was archived before and neither its contents nor its
+ * inode have changed since. ctime catches renames over it, permission
+ * changes and anything that set mtime back. */
+int snap_unchanged(const struct snapshot *s, const char *path,
+                   const struct stat *sb) {
+    size_t len = strlen(path);
+    uint64_t h = hash_path(path, len), i;
+
+    for(i = h & s -> mask; s -> slots[i] != SNAP_EMPTY;
+        i = (i + 1) & s -> mask) {
+        const struct snap_entry *e;
+
+        if(s -> slots[i] >= s -> count) {
+            return 0;
+        }
+        e = &s -> entries[s -> slots[i]];
+        if(e -> hash != h || e -> nameLen != len ||
+           e -> nameOffset + len >= s -> namesLen ||
+           memcmp(s -> names + e -> nameOffset, path, len)) {
+            continue;
+        }
+        return e -> dev == (uint64_t)sb -> st_dev &&
+               e -> ino == (uint64_t)sb -> st_ino &&
+               e -> size == (uint64_t)sb -> st_size &&
+               e -> mtime == sb -> st_mtim.tv_sec &&
+               e -> mtimeNsec == sb -> st_mtim.tv_nsec &&
+               e -> ctime == sb -> st_ctim.tv_sec &&
+               e -> ctimeNsec == sb -> st_ctim.tv_nsec;
+    }
+    return 0;
+}
+
+void snap_close(struct snapshot *s) {
+    munmap((void *)s -> map, s -> mapLen);
+    free(s);
+}
+
+struct snap_builder *snap_begin(void) {
+    struct snap_builder *b = calloc(1, sizeof(struct snap_builder));
+
+    if(!b) {
+        perror("Couldn't calloc snapshot");
+        exit(EXIT_FAILURE);
+    }
+    return b;
+}
+
+/* Records how path looks now, as create saw it */
+void snap_add(struct snap_builder *b, const char *path,
+              const struct stat *sb) {
+    size_t len = strlen(path);
+    struct snap_entry *e;
+
+    if(b -> count == b -> cap) {
+        b -> cap = b -> cap ? b -> cap * 2 : ENTRIES_START;
+        if(!(b -> entries = realloc(b -> entries,
+                                    b -> cap * sizeof(struct snap_entry)))) {
+            perror("Couldn't realloc snapshot");
+            exit(EXIT_FAILURE);
+        }
+    }
+    while(b -> namesLen + len + 1 > b -> namesCap) {
+        b -> namesCap = b -> namesCap ? b -> namesCap * 2 : NAMES_START;
+        if(!(b -> names = realloc(b -> names, b -> namesCap))) {
+            perror("Couldn't realloc snapshot names");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    e = &b -> entries[b -> count++];
+    memset(e, 0, sizeof(struct snap_entry));
+    e -> hash = hash_path(path, len);
+    e -> nameOffset = b -> namesLen;
+    e -> nameLen = len;
+    e -> dev = sb -> st_dev;
+    e -> ino = sb -> st_ino;
+    e -> size = sb -> st_size;
+    e -> mtime = sb -> st_mtim.tv_sec;
+    e -> mtimeNsec = sb -> st_mtim.tv_nsec;
+    e -> ctime = sb -> st_ctim.tv_sec;
+    e -> ctimeNsec = sb -> st_ctim.tv_nsec;
+
+    memcpy(b -> names + b -> namesLen, path, len + 1);
+    b -> namesLen += len + 1;
+}
+
+/* Hashes the entries into their table and writes the snapshot as name,
+ * then frees the builder. Any earlier snapshot is replaced whole. */
+void snap_write(struct snap_builder *b, const char *name) {
+    struct snap_file_header h;
+    uint32_t *slots;
+    uint64_t numSlots = SNAP_MIN_SLOTS, tableEnd, zero = 0;
+    size_t i, padLen;
+    char *tmpName;
+    FILE *f;
+
+    if(b -> count >= SNAP_EMPTY) {
+        fprintf(stderr, "Too many files for a snapshot\n");
+        exit(EXIT_FAILURE);
+    }
+    while(numSlots * SNAP_LOAD_NUM / SNAP_LOAD_DEN <= b -> count) {
+        numSlots *= 2;
+    }
+    if(!(slots = malloc(numSlots * sizeof(uint32_t)))) {
+        perror("Couldn't malloc snapshot table");
+        exit(EXIT_FAILURE);
+    }
+    memset(slots, 0xFF, numSlots * sizeof(uint32_t));
+    for(i = 0; i < b -> count; i++) {
+        uint64_t s = b -> entries[i].hash & (numSlots - 1);
+
+        while(slots[s] != SNAP_EMPTY) {
+            s = (s + 1) & (numSlots - 1);
+        }
+        slots[s] = i;
+    }
+
+    /* Entries start 8 byte aligned so the mapping can be used in place */
+    tableEnd = sizeof(h) + numSlots * sizeof(uint32_t);
+    padLen = tableEnd % sizeof(uint64_t);
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SNAP_MAGIC, SNAP_MAGIC_LEN);
+    h.count = b -> count;
+    h.numSlots = numSlots;
+    h.entriesOffset = tableEnd + padLen;
+    h.namesOffset = h.entriesOffset + b -> count * sizeof(struct snap_entry);
+
+    if(!(tmpName = malloc(strlen(name) + 5))) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(tmpName, "%s.tmp", name);
+
+    /* Written aside and renamed, so a failed run leaves the old one */
+    if(!(f = fopen(tmpName, "w"))) {
+        perror("Couldn't create snapshot");
+        exit(errno);
+    }
+    if(fwrite(&h, sizeof(h), 1, f) != 1 ||
+       fwrite(slots, sizeof(uint32_t), numSlots, f) != numSlots ||
+       (padLen && fwrite(&zero, padLen, 1, f) != 1) ||
+       (b -> count && fwrite(b -> entries, sizeof(struct snap_entry),
+                             b -> count, f) != b -> count) ||
+       (b -> namesLen && fwrite(b -> names, b -> namesLen, 1, f) != 1) ||
+       fclose(f)) {
+        perror("Couldn't write snapshot");
+        exit(errno);
+    }
+    if(rename(tmpName, name)) {
+        perror("Couldn't rename snapshot");
+        exit(errno);
+    }
+
+    free(tmpName);
+    free(slots);
+    free(b -> entries);
+    free(b -> names);
+    free(b);
+}
+
+/* Appends the last component of path, a member create is looking at,
+ * to a directory's listing */
+void dumpdir_add(struct dumpdir *d, char code, const char *path) {
+    size_t len = strlen(path);
+    const char *base;
+
+    /* Directories end in '/' */
+    if(len && path[len - 1] == '/') {
+        len--;
+    }
+    for(base = path + len; base > path && base[-1] != '/'; base--);
+    len -= base - path;
+
+    while(d -> len + len + 2 > d -> cap) {
+        d -> cap = d -> cap ? d -> cap * 2 : DUMPDIR_START;
+        if(!(d -> data = realloc(d -> data, d -> cap))) {
+            perror("Couldn't realloc dumpdir");
+            exit(EXIT_FAILURE);
+        }
+    }
+    d -> data[d -> len++] = code;
+    memcpy(d -> data + d -> len, base, len);
+    d -> len += len;
+    d -> data[d -> len++] = '\0';
+}
+
+/* Closes off the listing with its empty name */
+void dumpdir_end(struct dumpdir *d) {
+    if(d -> len + 1 > d -> cap) {
+        d -> cap = d -> cap ? d -> cap * 2 : DUMPDIR_START;
+        if(!(d -> data = realloc(d -> data, d -> cap))) {
+            perror("Couldn't realloc dumpdir");
+            exit(EXIT_FAILURE);
+        }
+    }
+    d -> data[d -> len++] = '\0';
+}
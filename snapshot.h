@@ -0,0 +1,86 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* Snapshot database for incremental create ('g'). It holds what every
+ * path looked like when it was last archived, so the next run can leave
+ * out whatever hasn't changed since. The file is a snap_file_header, an
+ * open addressing table of numSlots entry numbers keyed by path hash, then
+ * count snap_entry records and the NUL terminated names they point at. It
+ * is mapped as is, so a lookup costs a probe or two whatever its size. */
+
+#define SNAP_MAGIC "MYTARSN1"
+#define SNAP_MAGIC_LEN 8
+/* Slot with no entry in it */
+#define SNAP_EMPTY 0xFFFFFFFFu
+/* At most this many entries per slot, for short probe runs */
+#define SNAP_LOAD_NUM 3
+#define SNAP_LOAD_DEN 4
+#define SNAP_MIN_SLOTS 16
+
+/* GNU dumpdir members: a directory whose body lists its contents when it
+ * was archived, one NUL terminated name per entry, each behind a code
+ * saying whether it is in this archive. An empty name ends the list. */
+#define DUMPDIR_FLAG 'D'
+#define DUMPDIR_ARCHIVED 'Y'
+#define DUMPDIR_UNCHANGED 'N'
+#define DUMPDIR_DIR 'D'
+/* Larger listings are taken for corruption */
+#define DUMPDIR_MAX_SIZE (256 * 1024 * 1024)
+
+struct snap_file_header {
+    char magic[SNAP_MAGIC_LEN];
+    uint64_t count;
+    /* A power of two */
+    uint64_t numSlots;
+    /* File offsets of the entries and of the name table */
+    uint64_t entriesOffset;
+    uint64_t namesOffset;
+};
+
+struct snap_entry {
+    uint64_t hash;
+    /* Offset of the name in the name table */
+    uint64_t nameOffset;
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime;
+    int64_t mtimeNsec;
+    int64_t ctime;
+    int64_t ctimeNsec;
+    uint32_t nameLen;
+    char pad[4];
+};
+
+/* A dumpdir body being put together */
+struct dumpdir {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+struct snapshot;
+struct snap_builder;
+
+struct snapshot *snap_open(const char *name);
+
+int snap_unchanged(const struct snapshot *s, const char *path,
+                   const struct stat *sb);
+
+void snap_close(struct snapshot *s);
+
+struct snap_builder *snap_begin(void);
+
+void snap_add(struct snap_builder *b, const char *path, const struct stat *sb);
+
+void snap_write(struct snap_builder *b, const char *name);
+
+void dumpdir_add(struct dumpdir *d, char code, const char *path);
+
+void dumpdir_end(struct dumpdir *d);
+
+#endif
@@ -0,0 +1,75 @@
+#!/bin/sh
+# Round trips values too big for ustar's octal fields through mytar: a
+# 9 GiB sparse file with a marker byte past 8 GiB, an mtime past
+# 077777777777 and, when run as root, uid and gid past 07777777. GNU tar,
+# when installed, has to read what mytar wrote and the other way around.
+
+set -e
+
+MYTAR=$(cd "$(dirname "$0")/.." && pwd)/mytar
+BIG_SIZE=9663676416
+MARKER_AT=8589938688
+MTIME=10000000000
+IDS=3000000:3000001
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/mytar-test.XXXXXX")
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK"
+
+fail() {
+    echo "FAIL: $*" >&2
+    exit 1
+}
+
+# check_tree dir: the extracted copy of src matches
+check_tree() {
+    [ "$(stat -c %s "$1/src/big")" = "$BIG_SIZE" ] ||
+        fail "$1: size of big is $(stat -c %s "$1/src/big")"
+    [ "$(dd if="$1/src/big" bs=1 skip=$MARKER_AT count=1 2>/dev/null)" = M ] ||
+        fail "$1: marker past 8 GiB is missing"
+    [ "$(stat -c %Y "$1/src/small")" = "$MTIME" ] ||
+        fail "$1: mtime of small is $(stat -c %Y "$1/src/small")"
+    if [ "$ROOT" ]; then
+        [ "$(stat -c %u:%g "$1/src/small")" = "$IDS" ] ||
+            fail "$1: owner of small is $(stat -c %u:%g "$1/src/small")"
+    fi
+}
+
+mkdir src
+truncate -s $BIG_SIZE src/big
+printf M | dd of=src/big bs=1 seek=$MARKER_AT conv=notrunc 2>/dev/null
+echo small > src/small
+touch -d @$MTIME src/small
+ROOT=
+if [ "$(id -u)" = 0 ]; then
+    chown $IDS src/small
+    ROOT=1
+fi
+
+"$MYTAR" cf mytar.tar src
+"$MYTAR" tvf mytar.tar | grep -q " $BIG_SIZE .* src/big$" ||
+    fail "mytar doesn't list big at its full size"
+mkdir out
+(cd out && "$MYTAR" xpf ../mytar.tar)
+check_tree out
+
+if command -v tar > /dev/null; then
+    tar --numeric-owner -tvf mytar.tar > gnu.list
+    grep -q " $BIG_SIZE .* src/big$" gnu.list ||
+        fail "GNU tar doesn't list big at its full size"
+    if [ "$ROOT" ]; then
+        grep -q "${IDS%:*}/${IDS#*:} .* src/small$" gnu.list ||
+            fail "GNU tar doesn't list the ids of small"
+    fi
+    mkdir gnu-out
+    tar --warning=no-timestamp -xpf mytar.tar -C gnu-out
+    check_tree gnu-out
+
+    # GNU tar stores the 9 GiB body whole, with a base-256 size
+    tar --format=gnu -cf gnu.tar src
+    mkdir from-gnu
+    (cd from-gnu && "$MYTAR" xpf ../gnu.tar)
+    check_tree from-gnu
+fi
+
+echo "bignum: ok"
@@ -1,27 +1,114 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include "header.h"
+#include "util.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
 
 #define HEADER_PADDING 12
 #define CHKSUM_START 148
 #define CHKSUM_END 155
+#define CHKSUM_LEN (CHKSUM_END - CHKSUM_START + 1)
+#define BLOCK_LEN 512
+
+/* The checksum covers the first 500 bytes with the chksum field read as
+ * spaces. Rather than branch on every byte we sum the whole block with
+ * the widest adds the CPU has and then correct for the few bytes that
+ * shouldn't have counted. */
+
+static unsigned int sum_block_scalar(const unsigned char *b) {
+    unsigned int total = 0;
+    int i;
+
+    for(i = 0; i < BLOCK_LEN; i++) {
+        total += b[i];
+    }
+    return total;
+}
+
+#ifdef HAVE_X86_SIMD
+/* psadbw against zero adds up 8 bytes at a time into 64 bit lanes */
+__attribute__((target("sse2")))
+static unsigned int sum_block_sse2(const unsigned char *b) {
+    __m128i acc = _mm_setzero_si128(), zero = _mm_setzero_si128();
+    int i;
+
+    for(i = 0; i < BLOCK_LEN; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(b + i));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+    }
+    return _mm_cvtsi128_si32(acc) +
+           _mm_cvtsi128_si32(_mm_unpackhi_epi64(acc, acc));
+}
+
+__attribute__((target("avx2")))
+static unsigned int sum_block_avx2(const unsigned char *b) {
+    __m256i acc = _mm256_setzero_si256(), zero = _mm256_setzero_si256();
+    __m128i half;
+    int i;
+
+    for(i = 0; i < BLOCK_LEN; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(b + i));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(v, zero));
+    }
+    half = _mm_add_epi64(_mm256_castsi256_si128(acc),
+                         _mm256_extracti128_si256(acc, 1));
+    return _mm_cvtsi128_si32(half) +
+           _mm_cvtsi128_si32(_mm_unpackhi_epi64(half, half));
+}
+#endif
+
+static unsigned int sum_block_pick(const unsigned char *b);
+
+/* Chosen on first use */
+static unsigned int (*sum_block)(const unsigned char *) = sum_block_pick;
+
+static unsigned int sum_block_pick(const unsigned char *b) {
+    sum_block = sum_block_scalar;
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        sum_block = sum_block_avx2;
+    }
+    else if(__builtin_cpu_supports("sse2")) {
+        sum_block = sum_block_sse2;
+    }
+#endif
+    return sum_block(b);
+}
 
 /* We pass the header as a char to make pointer arithmetic easy. */
 int calc_checksum(unsigned char *h) {
-    int total = 0;
+    int total = sum_block(h);
     int i;
 
-    for(i = 0; i < (sizeof(struct header) - HEADER_PADDING); i++) {
-        /* If we're within the indices of the chksum, treat it as a space. */
-        if(i < CHKSUM_START || i > CHKSUM_END) {
-            /* Make sure that it's interpreted as unsigned */
-            total += (unsigned char)(*h);
-            h++;
-        }
-        /* Otherwise, add the current octet to running total */
-        else {
-            total += ' ';
-            h++;
-        }
-    }
-    
-    return total;
+    /* Take back the trailing padding and the stored checksum, and count
+     * the checksum field as spaces instead */
+    for(i = BLOCK_LEN - HEADER_PADDING; i < BLOCK_LEN; i++) {
+        total -= h[i];
+    }
+    for(i = CHKSUM_START; i <= CHKSUM_END; i++) {
+        total -= h[i];
+    }
+    return total + CHKSUM_LEN * ' ';
+}
+
+/* True if all 512 bytes are zero, as in the end of archive marker */
+int is_zero_block(const unsigned char *b) {
+    uint64_t any = 0;
+    int i;
+
+    /* OR everything together a word at a time so it vectorizes; memcpy
+     * because blocks in a pipe's record buffer needn't be aligned */
+    for(i = 0; i < BLOCK_LEN; i += sizeof(uint64_t)) {
+        uint64_t w;
+
+        memcpy(&w, b + i, sizeof(w));
+        any |= w;
+    }
+    return !any;
 }
@@ -1,3 +1,12 @@
-/* TODO: Add methods from util.c when we know their signatures */
+#ifndef UTIL_H
+#define UTIL_H
+
+#define HDR_VALID 0
+#define HDR_ZERO 1
+#define HDR_BAD 2
 
 int calc_checksum(unsigned char *h);
+
+int is_zero_block(const unsigned char *b);
+
+#endif
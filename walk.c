@@ -0,0 +1,841 @@
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "walk.h"
+
+/* Parallel front end for create. Traversal and lstat() run on a work
+ * stealing pool. As soon as the next stretch of the tree in the preorder
+ * archive() would have produced is known, it is queued for the reader
+ * threads, which open and read ahead regular files into a bounded ring of
+ * slots, and for the single writer (the caller), which drains the ring in
+ * that same order, so the output doesn't depend on thread timing. Nodes
+ * are freed once the writer is past them, and traversal holding more than
+ * TRAVERSE_AHEAD of them only works on what the preorder is waiting for. */
+
+#define TASKS_START 64
+#define KIDS_START 16
+#define QUEUE_START 1024
+#define DEPTH_START 16
+/* How long an idle traversal worker sleeps before looking for work again */
+#define IDLE_NSEC 1000000
+
+#define TASK_LIST 0
+#define TASK_STAT 1
+
+#define SLOT_FREE 0
+#define SLOT_READY 1
+
+struct wnode {
+    /* Directories end in '/', as archive() names them */
+    char *path;
+    struct stat sb;
+    int skip;
+    /* Regular file the caller said it won't read, so no slot */
+    int unread;
+    struct wnode *kids;
+    int numKids;
+    struct wnode *parent;
+    /* Directories: listed, and every kid lstat()ed */
+    int ready;
+    int batchesLeft;
+    /* Its own member plus each kid that will be one, until the writer is
+     * past them */
+    int held;
+};
+
+struct wtask {
+    int kind;
+    struct wnode *node;
+    /* TASK_STAT: which kids of node to lstat() */
+    int first;
+    int count;
+};
+
+/* Per worker deque: the owner pushes and pops at the bottom, thieves take
+ * from the top */
+struct wdeque {
+    pthread_mutex_t lock;
+    struct wtask *tasks;
+    int top;
+    int bottom;
+    int cap;
+};
+
+/* Nodes in archive order. Entry i is at items[i - base]; those before the
+ * consumer's position get dropped when room is needed. */
+struct wqueue {
+    struct wnode **items;
+    long base;
+    long end;
+    long cap;
+};
+
+/* A directory the preorder is inside of, and the next kid to visit */
+struct wframe {
+    struct wnode *dir;
+    int next;
+};
+
+struct wslot {
+    /* Sequence number of the file this slot holds or is waiting for */
+    long seq;
+    int state;
+    int fd;
+    char *buf;
+    size_t len;
+};
+
+struct walk {
+    int numJobs;
+    struct wnode *roots;
+    int numRoots;
+    int (*skipRead)(const char *path, const struct stat *sb);
+
+    /* traversal */
+    struct wdeque *deques;
+    pthread_mutex_t idleLock;
+    pthread_cond_t idleCond;
+    long pending;
+    pthread_t *traversers;
+    struct worker_arg *args;
+
+    /* how far the preorder has got, and every member and just the regular
+     * files it has given so far; all under orderLock */
+    pthread_mutex_t orderLock;
+    pthread_cond_t orderCond;
+    struct wframe *stack;
+    int depth;
+    int stackCap;
+    int nextRoot;
+    int walked;
+    struct wqueue order;
+    struct wqueue files;
+    /* nodes allocated below the roots, and the directory the preorder is
+     * waiting for, if any */
+    long live;
+    struct wnode *stuckOn;
+
+    /* read ahead ring */
+    pthread_t *readers;
+    pthread_mutex_t ringLock;
+    pthread_cond_t ringCond;
+    struct wslot *slots;
+    int numSlots;
+    long nextClaim;
+
+    /* writer position */
+    long nextOrder;
+    long nextFile;
+    struct wnode *last;
+};
+
+struct worker_arg {
+    struct walk *w;
+    int id;
+};
+
+static void *xcalloc(size_t n, size_t size) {
+    void *p;
+
+    errno = 0;
+    p = calloc(n, size);
+    if(errno || !p) {
+        perror("Couldn't calloc walk state");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static void queue_push(struct wqueue *q, struct wnode *n, long keep) {
+    if(q -> end - q -> base == q -> cap) {
+        /* Slide down if that frees up half, otherwise grow */
+        if(keep - q -> base >= q -> cap / 2 && keep > q -> base) {
+            memmove(q -> items, q -> items + (keep - q -> base),
+                    (q -> end - keep) * sizeof(struct wnode *));
+            q -> base = keep;
+        }
+        else {
+            q -> cap = q -> cap ? q -> cap * 2 : QUEUE_START;
+            if(!(q -> items = realloc(q -> items,
+                                      q -> cap * sizeof(struct wnode *)))) {
+                perror("Couldn't realloc order");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    q -> items[q -> end++ - q -> base] = n;
+}
+
+static struct wnode *queue_at(const struct wqueue *q, long i) {
+    return q -> items[i - q -> base];
+}
+
+/* Whether archive() would write a member for n */
+static int kept(const struct wnode *n) {
+    return !n -> skip && (S_ISDIR(n -> sb.st_mode) ||
+                          S_ISREG(n -> sb.st_mode) ||
+                          S_ISLNK(n -> sb.st_mode));
+}
+
+/* Lets go of one of n's holds, freeing what nobody needs any more: a node
+ * that's done takes its kids with it and lets go of its parent's hold */
+static void node_put(struct walk *w, struct wnode *n) {
+    int i;
+
+    while(n && !--n -> held) {
+        for(i = 0; i < n -> numKids; i++) {
+            free(n -> kids[i].path);
+        }
+        free(n -> kids);
+        w -> live -= n -> numKids;
+        n -> kids = NULL;
+        n -> numKids = 0;
+        n = n -> parent;
+    }
+}
+
+/* Moves the preorder on as far as what has been traversed allows, handing
+ * each member to the writer and each regular file to the readers. Called
+ * with orderLock held. */
+static void advance(struct walk *w) {
+    long before = w -> order.end;
+
+    w -> stuckOn = NULL;
+
+    for(;;) {
+        struct wnode *n;
+
+        if(!w -> depth) {
+            if(w -> nextRoot == w -> numRoots) {
+                w -> walked = 1;
+                break;
+            }
+            n = &w -> roots[w -> nextRoot];
+        }
+        else if(w -> stack[w -> depth - 1].next ==
+                w -> stack[w -> depth - 1].dir -> numKids) {
+            node_put(w, w -> stack[--w -> depth].dir);
+            continue;
+        }
+        else {
+            struct wframe *f = &w -> stack[w -> depth - 1];
+
+            n = &f -> dir -> kids[f -> next];
+        }
+
+        /* A directory's member needs its kids, and what comes next is
+         * its first kid */
+        if(!n -> skip && S_ISDIR(n -> sb.st_mode) && !n -> ready) {
+            w -> stuckOn = n;
+            break;
+        }
+        if(w -> depth) {
+            w -> stack[w -> depth - 1].next++;
+        }
+        else {
+            w -> nextRoot++;
+        }
+        if(!kept(n)) {
+            continue;
+        }
+
+        queue_push(&w -> order, n, w -> nextOrder);
+        if(S_ISREG(n -> sb.st_mode)) {
+            if(w -> skipRead && w -> skipRead(n -> path, &n -> sb)) {
+                n -> unread = 1;
+            }
+            else {
+                queue_push(&w -> files, n, w -> nextClaim);
+            }
+        }
+        else if(S_ISDIR(n -> sb.st_mode)) {
+            if(w -> depth == w -> stackCap) {
+                w -> stackCap = w -> stackCap ? w -> stackCap * 2 :
+                                DEPTH_START;
+                if(!(w -> stack = realloc(w -> stack, w -> stackCap *
+                                          sizeof(struct wframe)))) {
+                    perror("Couldn't realloc walk stack");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            /* Held while we go through its kids, some of which the
+             * writer may never see */
+            n -> held++;
+            w -> stack[w -> depth].dir = n;
+            w -> stack[w -> depth].next = 0;
+            w -> depth++;
+        }
+    }
+
+    if(w -> order.end != before || w -> walked) {
+        pthread_cond_broadcast(&w -> orderCond);
+    }
+}
+
+/* A directory's kids are all lstat()ed; called with orderLock held */
+static void dir_ready(struct walk *w, struct wnode *n) {
+    n -> ready = 1;
+    w -> live += n -> numKids;
+    advance(w);
+}
+
+static void push_task(struct walk *w, int id, int kind, struct wnode *node,
+                      int first, int count) {
+    struct wdeque *d = &w -> deques[id];
+
+    pthread_mutex_lock(&w -> idleLock);
+    w -> pending++;
+    pthread_mutex_unlock(&w -> idleLock);
+
+    pthread_mutex_lock(&d -> lock);
+    if(d -> bottom == d -> cap) {
+        /* Slide down before growing, thieves may have emptied the top */
+        if(d -> top) {
+            memmove(d -> tasks, d -> tasks + d -> top,
+                    (d -> bottom - d -> top) * sizeof(struct wtask));
+        }
+        d -> bottom -= d -> top;
+        d -> top = 0;
+        if(d -> bottom == d -> cap) {
+            d -> cap = d -> cap ? d -> cap * 2 : TASKS_START;
+            if(!(d -> tasks = realloc(d -> tasks,
+                                      d -> cap * sizeof(struct wtask)))) {
+                perror("Couldn't realloc tasks");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    d -> tasks[d -> bottom].kind = kind;
+    d -> tasks[d -> bottom].node = node;
+    d -> tasks[d -> bottom].first = first;
+    d -> tasks[d -> bottom].count = count;
+    d -> bottom++;
+    pthread_mutex_unlock(&d -> lock);
+
+    pthread_cond_signal(&w -> idleCond);
+}
+
+/* Takes from our own bottom, or else steals from someone else's top */
+static int take_task(struct walk *w, int id, struct wtask *t) {
+    int i;
+
+    for(i = 0; i < w -> numJobs; i++) {
+        int victim = (id + i) % w -> numJobs;
+        struct wdeque *d = &w -> deques[victim];
+        int found = 0;
+
+        pthread_mutex_lock(&d -> lock);
+        if(d -> bottom > d -> top) {
+            if(victim == id) {
+                *t = d -> tasks[--d -> bottom];
+            }
+            else {
+                *t = d -> tasks[d -> top++];
+            }
+            found = 1;
+        }
+        pthread_mutex_unlock(&d -> lock);
+
+        if(found) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Names a directory the way archive() does, with a trailing '/' */
+static void dir_path(struct wnode *n) {
+    size_t len = strlen(n -> path);
+    char *p;
+
+    if(!(p = realloc(n -> path, len + 2))) {
+        perror("Couldn't realloc path");
+        exit(EXIT_FAILURE);
+    }
+    strcpy(p + len, "/");
+    n -> path = p;
+}
+
+/* readdir()s one directory into its kids, then splits the lstat()s into
+ * batches other workers can steal */
+static void list_dir(struct walk *w, int id, struct wnode *n) {
+    DIR *d;
+    struct dirent *e;
+    int cap = 0, i;
+
+    if(!(d = opendir(n -> path))) {
+        perror("opendir");
+        exit(EXIT_FAILURE);
+    }
+
+    while((e = readdir(d))) {
+        struct wnode *kid;
+
+        if(!strcmp(e -> d_name, ".") || !strcmp(e -> d_name, "..")) {
+            continue;
+        }
+
+        if(n -> numKids == cap) {
+            cap = cap ? cap * 2 : KIDS_START;
+            if(!(n -> kids = realloc(n -> kids, cap * sizeof(struct wnode)))) {
+                perror("Couldn't realloc kids");
+                exit(EXIT_FAILURE);
+            }
+        }
+        kid = &n -> kids[n -> numKids++];
+        memset(kid, 0, sizeof(struct wnode));
+        if(!(kid -> path = malloc(strlen(n -> path) +
+                                  strlen(e -> d_name) + 1))) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        strcpy(kid -> path, n -> path);
+        strcat(kid -> path, e -> d_name);
+    }
+    closedir(d);
+
+    /* kids doesn't move from here on, so they can point back at n */
+    for(i = 0; i < n -> numKids; i++) {
+        n -> kids[i].parent = n;
+        n -> kids[i].held = 1;
+    }
+
+    if(!n -> numKids) {
+        pthread_mutex_lock(&w -> orderLock);
+        dir_ready(w, n);
+        pthread_mutex_unlock(&w -> orderLock);
+        return;
+    }
+
+    /* Pushed last first, so we pop them in archive order and thieves
+     * take what the writer needs last */
+    n -> batchesLeft = (n -> numKids + STAT_BATCH - 1) / STAT_BATCH;
+    for(i = (n -> batchesLeft - 1) * STAT_BATCH; i >= 0; i -= STAT_BATCH) {
+        int count = n -> numKids - i;
+
+        push_task(w, id, TASK_STAT, n, i,
+                  count < STAT_BATCH ? count : STAT_BATCH);
+    }
+}
+
+/* lstat()s a batch of kids. Whoever does the last batch lists the
+ * directories among them, once the whole directory can go out. */
+static void stat_kids(struct walk *w, int id, struct wtask *t) {
+    struct wnode *n = t -> node;
+    int i, members = 0;
+
+    for(i = t -> first; i < t -> first + t -> count; i++) {
+        struct wnode *kid = &n -> kids[i];
+
+        if(lstat(kid -> path, &kid -> sb) == -1) {
+            perror("stat");
+            kid -> skip = 1;
+        }
+        else if(S_ISDIR(kid -> sb.st_mode)) {
+            dir_path(kid);
+        }
+        members += kept(kid);
+    }
+
+    /* Under the lock, as once n is ready the writer may get through it
+     * and free the kids */
+    pthread_mutex_lock(&w -> orderLock);
+    n -> held += members;
+    if(!--n -> batchesLeft) {
+        for(i = n -> numKids - 1; i >= 0; i--) {
+            if(!n -> kids[i].skip && S_ISDIR(n -> kids[i].sb.st_mode)) {
+                push_task(w, id, TASK_LIST, &n -> kids[i], 0, 0);
+            }
+        }
+        dir_ready(w, n);
+    }
+    pthread_mutex_unlock(&w -> orderLock);
+}
+
+/* Once traversal holds more than TRAVERSE_AHEAD nodes, workers only take
+ * the tasks the preorder is stuck on, wherever they are queued, and only
+ * when the writer is running short of members. That keeps the writer
+ * going without letting the rest of the tree pile up. */
+static int take_needed(struct walk *w, struct wtask *t) {
+    struct wnode *needed = NULL;
+    int i, k;
+
+    pthread_mutex_lock(&w -> orderLock);
+    if(w -> order.end - w -> nextOrder < TRAVERSE_AHEAD / 2) {
+        needed = w -> stuckOn;
+    }
+    pthread_mutex_unlock(&w -> orderLock);
+    if(!needed) {
+        return 0;
+    }
+
+    for(i = 0; i < w -> numJobs; i++) {
+        struct wdeque *d = &w -> deques[i];
+
+        pthread_mutex_lock(&d -> lock);
+        for(k = d -> top; k < d -> bottom; k++) {
+            if(d -> tasks[k].node == needed) {
+                *t = d -> tasks[k];
+                memmove(d -> tasks + k, d -> tasks + k + 1,
+                        (d -> bottom - k - 1) * sizeof(struct wtask));
+                d -> bottom--;
+                pthread_mutex_unlock(&d -> lock);
+                return 1;
+            }
+        }
+        pthread_mutex_unlock(&d -> lock);
+    }
+
+    return 0;
+}
+
+static void *traverse_worker(void *arg) {
+    struct walk *w = ((struct worker_arg *)arg) -> w;
+    int id = ((struct worker_arg *)arg) -> id;
+
+    for(;;) {
+        struct wtask t;
+        int ahead;
+
+        pthread_mutex_lock(&w -> orderLock);
+        ahead = w -> live > TRAVERSE_AHEAD;
+        pthread_mutex_unlock(&w -> orderLock);
+
+        if(ahead ? take_needed(w, &t) : take_task(w, id, &t)) {
+            if(t.kind == TASK_LIST) {
+                list_dir(w, id, t.node);
+            }
+            else {
+                stat_kids(w, id, &t);
+            }
+
+            pthread_mutex_lock(&w -> idleLock);
+            if(!--w -> pending) {
+                pthread_cond_broadcast(&w -> idleCond);
+            }
+            pthread_mutex_unlock(&w -> idleLock);
+            continue;
+        }
+
+        pthread_mutex_lock(&w -> idleLock);
+        if(!w -> pending) {
+            pthread_mutex_unlock(&w -> idleLock);
+            return NULL;
+        }
+        /* Pushes don't take idleLock around the deque, so don't trust a
+         * wakeup to arrive; look again shortly either way */
+        {
+            struct timespec until;
+
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_nsec += IDLE_NSEC;
+            if(until.tv_nsec >= 1000000000L) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&w -> idleCond, &w -> idleLock, &until);
+        }
+        pthread_mutex_unlock(&w -> idleLock);
+    }
+}
+
+/* Reader thread: claims the next regular file, waits for its slot to come
+ * free, and reads the start of it */
+static void *reader_worker(void *arg) {
+    struct walk *w = arg;
+
+    for(;;) {
+        struct wnode *n;
+        struct wslot *s;
+        long seq;
+        size_t want;
+        int fd;
+
+        pthread_mutex_lock(&w -> orderLock);
+        while(w -> nextClaim == w -> files.end && !w -> walked) {
+            pthread_cond_wait(&w -> orderCond, &w -> orderLock);
+        }
+        if(w -> nextClaim == w -> files.end) {
+            pthread_mutex_unlock(&w -> orderLock);
+            return NULL;
+        }
+        seq = w -> nextClaim++;
+        n = queue_at(&w -> files, seq);
+        pthread_mutex_unlock(&w -> orderLock);
+
+        s = &w -> slots[seq % w -> numSlots];
+        pthread_mutex_lock(&w -> ringLock);
+        while(s -> seq != seq) {
+            pthread_cond_wait(&w -> ringCond, &w -> ringLock);
+        }
+        pthread_mutex_unlock(&w -> ringLock);
+
+        if((fd = open(n -> path, O_RDONLY)) == -1) {
+            perror("open");
+            exit(EXIT_FAILURE);
+        }
+
+        want = n -> sb.st_size < PREFETCH_SIZE ?
+               (size_t)n -> sb.st_size : PREFETCH_SIZE;
+        s -> len = 0;
+        while(s -> len < want) {
+            ssize_t num = read(fd, s -> buf + s -> len, want - s -> len);
+
+            if(num == -1 && errno == EINTR) {
+                continue;
+            }
+            if(num <= 0) {
+                /* The writer zero fills whatever went missing */
+                break;
+            }
+            s -> len += num;
+        }
+
+        /* Small files are done with, unless they're short of blocks and
+         * the writer has to look for holes; big ones stay open for it */
+        if(s -> len == n -> sb.st_size &&
+           (off_t)n -> sb.st_blocks * S_BLKSIZE >= n -> sb.st_size) {
+            close(fd);
+            fd = -1;
+        }
+
+        pthread_mutex_lock(&w -> ringLock);
+        s -> fd = fd;
+        s -> state = SLOT_READY;
+        pthread_cond_broadcast(&w -> ringCond);
+        pthread_mutex_unlock(&w -> ringLock);
+    }
+}
+
+/* skipRead, if given, picks out regular files the caller won't need the
+ * contents of; they still come out of walk_next(), but nothing is opened
+ * or read for them. It is called from the traversal threads. */
+struct walk *walk_start(char **roots, int numRoots, int numJobs,
+                        int (*skipRead)(const char *path,
+                                        const struct stat *sb)) {
+    struct walk *w = xcalloc(1, sizeof(struct walk));
+    int i;
+
+    w -> numJobs = numJobs;
+    w -> skipRead = skipRead;
+    w -> deques = xcalloc(numJobs, sizeof(struct wdeque));
+    for(i = 0; i < numJobs; i++) {
+        pthread_mutex_init(&w -> deques[i].lock, NULL);
+    }
+    pthread_mutex_init(&w -> idleLock, NULL);
+    pthread_cond_init(&w -> idleCond, NULL);
+    pthread_mutex_init(&w -> orderLock, NULL);
+    pthread_cond_init(&w -> orderCond, NULL);
+
+    /* Roots are lstat()ed up front, in order, like create_cmd() does */
+    w -> roots = xcalloc(numRoots, sizeof(struct wnode));
+    w -> numRoots = numRoots;
+    for(i = numRoots - 1; i >= 0; i--) {
+        struct wnode *n = &w -> roots[i];
+
+        if(!(n -> path = strdup(roots[i]))) {
+            perror("strdup");
+            exit(EXIT_FAILURE);
+        }
+        n -> held = 1;
+        if(lstat(n -> path, &n -> sb) == -1) {
+            perror("stat");
+            n -> skip = 1;
+        }
+        else if(S_ISDIR(n -> sb.st_mode)) {
+            dir_path(n);
+            push_task(w, 0, TASK_LIST, n, 0, 0);
+        }
+    }
+    /* Roots that aren't directories can go straight out */
+    pthread_mutex_lock(&w -> orderLock);
+    advance(w);
+    pthread_mutex_unlock(&w -> orderLock);
+
+    /* The ring has to be there before anything can be read ahead */
+    pthread_mutex_init(&w -> ringLock, NULL);
+    pthread_cond_init(&w -> ringCond, NULL);
+    w -> numSlots = numJobs * SLOTS_PER_READER;
+    w -> slots = xcalloc(w -> numSlots, sizeof(struct wslot));
+    for(i = 0; i < w -> numSlots; i++) {
+        w -> slots[i].seq = i;
+        w -> slots[i].fd = -1;
+        if(!(w -> slots[i].buf = malloc(PREFETCH_SIZE))) {
+            perror("Couldn't malloc prefetch slot");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    w -> args = xcalloc(numJobs, sizeof(struct worker_arg));
+    w -> traversers = xcalloc(numJobs, sizeof(pthread_t));
+    for(i = 0; i < numJobs; i++) {
+        w -> args[i].w = w;
+        w -> args[i].id = i;
+        if((errno = pthread_create(&w -> traversers[i], NULL,
+                                   traverse_worker, &w -> args[i]))) {
+            perror("Couldn't start walker");
+            exit(errno);
+        }
+    }
+
+    w -> readers = xcalloc(numJobs, sizeof(pthread_t));
+    for(i = 0; i < numJobs; i++) {
+        if((errno = pthread_create(&w -> readers[i], NULL, reader_worker,
+                                   w))) {
+            perror("Couldn't start reader");
+            exit(errno);
+        }
+    }
+
+    return w;
+}
+
+/* Fills in the next member in archive order, waiting for traversal to get
+ * that far. Returns 0 once there are no more. Regular files have to be
+ * handed back with walk_release(). The last entry's strings are only good
+ * until the next call. */
+int walk_next(struct walk *w, struct walk_entry *e) {
+    struct wnode *n;
+
+    pthread_mutex_lock(&w -> orderLock);
+    if(w -> last) {
+        node_put(w, w -> last);
+        w -> last = NULL;
+    }
+    while(w -> nextOrder == w -> order.end && !w -> walked) {
+        pthread_cond_wait(&w -> orderCond, &w -> orderLock);
+    }
+    if(w -> nextOrder == w -> order.end) {
+        pthread_mutex_unlock(&w -> orderLock);
+        return 0;
+    }
+    n = queue_at(&w -> order, w -> nextOrder++);
+    pthread_mutex_unlock(&w -> orderLock);
+
+    w -> last = n;
+    e -> path = n -> path;
+    e -> sb = &n -> sb;
+    e -> data = NULL;
+    e -> dataLen = 0;
+    e -> fd = -1;
+    e -> node = n;
+
+    if(S_ISREG(n -> sb.st_mode) && !n -> unread) {
+        long seq = w -> nextFile;
+        struct wslot *s = &w -> slots[seq % w -> numSlots];
+
+        pthread_mutex_lock(&w -> ringLock);
+        while(s -> seq != seq || s -> state != SLOT_READY) {
+            pthread_cond_wait(&w -> ringCond, &w -> ringLock);
+        }
+        pthread_mutex_unlock(&w -> ringLock);
+
+        e -> data = s -> buf;
+        e -> dataLen = s -> len;
+        e -> fd = s -> fd;
+    }
+
+    return 1;
+}
+
+/* Gives a regular file's slot back to the readers */
+void walk_release(struct walk *w, struct walk_entry *e) {
+    struct wslot *s;
+
+    if(!S_ISREG(e -> sb -> st_mode) || e -> node -> unread) {
+        return;
+    }
+
+    s = &w -> slots[w -> nextFile % w -> numSlots];
+    if(s -> fd != -1) {
+        close(s -> fd);
+    }
+
+    pthread_mutex_lock(&w -> ringLock);
+    s -> fd = -1;
+    s -> state = SLOT_FREE;
+    s -> seq = w -> nextFile + w -> numSlots;
+    w -> nextFile++;
+    pthread_cond_broadcast(&w -> ringCond);
+    pthread_mutex_unlock(&w -> ringLock);
+}
+
+/* Number of things listed in a directory member, including any that
+ * won't be archived */
+int walk_kids(const struct walk_entry *e) {
+    return e -> node -> numKids;
+}
+
+/* The i'th thing in a directory member, in archive order. Returns 0 if it
+ * couldn't be looked at and won't be archived. */
+int walk_kid(const struct walk_entry *e, int i, const char **path,
+             const struct stat **sb) {
+    const struct wnode *kid = &e -> node -> kids[i];
+
+    if(kid -> skip) {
+        return 0;
+    }
+    *path = kid -> path;
+    *sb = &kid -> sb;
+    return 1;
+}
+
+/* Whatever node_put() didn't get to */
+static void free_node(struct wnode *n) {
+    int i;
+
+    for(i = 0; i < n -> numKids; i++) {
+        free_node(&n -> kids[i]);
+    }
+    free(n -> kids);
+    free(n -> path);
+}
+
+void walk_finish(struct walk *w) {
+    int i;
+
+    for(i = 0; i < w -> numJobs; i++) {
+        pthread_join(w -> traversers[i], NULL);
+        pthread_join(w -> readers[i], NULL);
+    }
+    for(i = 0; i < w -> numSlots; i++) {
+        free(w -> slots[i].buf);
+    }
+    pthread_mutex_lock(&w -> orderLock);
+    if(w -> last) {
+        node_put(w, w -> last);
+    }
+    pthread_mutex_unlock(&w -> orderLock);
+    for(i = 0; i < w -> numRoots; i++) {
+        free_node(&w -> roots[i]);
+    }
+    for(i = 0; i < w -> numJobs; i++) {
+        pthread_mutex_destroy(&w -> deques[i].lock);
+        free(w -> deques[i].tasks);
+    }
+    pthread_mutex_destroy(&w -> idleLock);
+    pthread_cond_destroy(&w -> idleCond);
+    pthread_mutex_destroy(&w -> orderLock);
+    pthread_cond_destroy(&w -> orderCond);
+    pthread_mutex_destroy(&w -> ringLock);
+    pthread_cond_destroy(&w -> ringCond);
+    free(w -> traversers);
+    free(w -> args);
+    free(w -> readers);
+    free(w -> slots);
+    free(w -> roots);
+    free(w -> stack);
+    free(w -> order.items);
+    free(w -> files.items);
+    free(w -> deques);
+    free(w);
+}
@@ -0,0 +1,48 @@
+#ifndef WALK_H
+#define WALK_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* Per file read ahead done by the reader threads */
+#define PREFETCH_SIZE (256 * 1024)
+/* Prefetch slots per reader thread */
+#define SLOTS_PER_READER 4
+/* Directory entries lstat()ed per traversal task */
+#define STAT_BATCH 64
+/* Nodes traversal may hold before it sticks to what the writer needs */
+#define TRAVERSE_AHEAD 65536
+
+struct wnode;
+
+/* One member as the writer sees it, in archive order. For regular files
+ * the first dataLen bytes of the body are already in data and fd is open
+ * just past them; fd is -1 when data holds the whole body, unless the file
+ * is short of blocks and may have holes. */
+struct walk_entry {
+    char *path;
+    struct stat *sb;
+    const char *data;
+    size_t dataLen;
+    int fd;
+    const struct wnode *node;
+};
+
+struct walk;
+
+struct walk *walk_start(char **roots, int numRoots, int numJobs,
+                        int (*skipRead)(const char *path,
+                                        const struct stat *sb));
+
+int walk_next(struct walk *w, struct walk_entry *e);
+
+void walk_release(struct walk *w, struct walk_entry *e);
+
+int walk_kids(const struct walk_entry *e);
+
+int walk_kid(const struct walk_entry *e, int i, const char **path,
+             const struct stat **sb);
+
+void walk_finish(struct walk *w);
+
+#endif